@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Bump allocator that owns the memory of one memtable: its nodes and the bytes
+// of every key and value written into it. Memory comes from large blocks and
+// is never freed piecemeal; destroying the arena releases all of it at once.
+//
+// allocate() is safe to call from several threads. The critical section is a
+// pointer bump guarded by a spin lock, with a new block fetched from the heap
+// only once every BLOCK_SIZE bytes. Waiters spin briefly with a CPU pause hint,
+// then yield, so a holder stuck in new[] doesn't have its core taken.
+class Arena {
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    static const size_t ALIGNMENT = alignof(std::max_align_t);
+
+    char* allocPtr = nullptr;
+    size_t allocRemaining = 0;
+    std::vector<char*> blocks;
+    std::atomic<size_t> usage{0};
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+
+    char* allocateNewBlock(size_t bytes) {
+        char* block = new char[bytes];
+        blocks.push_back(block);
+        usage.fetch_add(bytes + sizeof(char*), std::memory_order_relaxed);
+        return block;
+    }
+
+    // Called when the current block cannot fit the request
+    char* allocateFallback(size_t bytes) {
+        if (bytes > BLOCK_SIZE / 4) {
+            // Large objects get a block of their own, so the rest of the current
+            // block is not wasted
+            return allocateNewBlock(bytes);
+        }
+        allocPtr = allocateNewBlock(BLOCK_SIZE);
+        allocRemaining = BLOCK_SIZE;
+        char* result = allocPtr;
+        allocPtr += bytes;
+        allocRemaining -= bytes;
+        return result;
+    }
+
+    static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    void acquireLock() {
+        const unsigned MAX_SPINS = 64;
+        for (unsigned spins = 0; lock.test_and_set(std::memory_order_acquire); spins++) {
+            if (spins < MAX_SPINS) {
+                cpuRelax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    char* allocateWithAlignment(size_t bytes, size_t alignment) {
+        acquireLock();
+        size_t padding = (alignment - reinterpret_cast<uintptr_t>(allocPtr) % alignment) % alignment;
+        char* result;
+        if (bytes + padding <= allocRemaining) {
+            result = allocPtr + padding;
+            allocPtr += bytes + padding;
+            allocRemaining -= bytes + padding;
+        } else {
+            result = allocateFallback(bytes); // Fresh blocks from new[] are already aligned
+        }
+        lock.clear(std::memory_order_release);
+        return result;
+    }
+
+public:
+    Arena() = default;
+    ~Arena() {
+        for (char* block : blocks) {
+            delete[] block;
+        }
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Returns uninitialized memory with no alignment guarantee, for raw bytes
+    char* allocate(size_t bytes) { return allocateWithAlignment(bytes, 1); }
+
+    // Returns uninitialized memory aligned for any object type
+    char* allocateAligned(size_t bytes) { return allocateWithAlignment(bytes, ALIGNMENT); }
+
+    // Copies data into the arena and returns a view of the copy
+    std::string_view copy(std::string_view data) {
+        if (data.empty()) {
+            return std::string_view();
+        }
+        char* bytes = allocate(data.size());
+        std::memcpy(bytes, data.data(), data.size());
+        return std::string_view(bytes, data.size());
+    }
+
+    // Total bytes held by the arena, including unused space at the end of blocks
+    size_t memoryUsage() const { return usage.load(std::memory_order_relaxed); }
+};
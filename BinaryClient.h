@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "BinaryProtocol.h"
+
+// A response received by BinaryClient
+struct BinaryResponse {
+    BinaryStatus status = BinaryStatus::ERROR;
+    uint64_t id = 0;
+    std::string value;
+};
+
+// Client for the binary protocol (see BinaryProtocol.h). One connection; not
+// thread-safe, so use one client per thread.
+//
+// Pipelining: sendGet(), sendPut(), sendDelete() and sendPing() queue a
+// request and return its id without waiting; the queue goes out on flush() or
+// receive(). receive() returns responses as they arrive, in any order, to be
+// matched up by id:
+//
+//   BinaryClient client;
+//   client.connect("127.0.0.1", 7070);
+//   uint64_t a = client.sendPut("k1", "v1");
+//   uint64_t b = client.sendGet("k2");
+//   for (BinaryResponse response; client.receive(response);) { ... }
+//
+// get(), put() and remove() send one request and wait for its answer.
+class BinaryClient {
+private:
+    int fd = -1;
+    std::string output; // Requests not yet sent
+    size_t sent = 0;
+    std::string input;  // Received bytes, from consumed on not yet parsed
+    size_t consumed = 0;
+    uint64_t nextId = 1;
+    size_t inFlight = 0;
+    // Responses received by a blocking call while it waited for its own
+    std::unordered_map<uint64_t, BinaryResponse> stashed;
+
+    uint64_t queue(BinaryOpcode opcode, std::string_view key, std::string_view value) {
+        uint64_t id = nextId++;
+        appendBinaryRequest(output, opcode, id, key, value);
+        inFlight++;
+        return id;
+    }
+
+    // Waits until the socket can be read (or written, if wantWrite), then
+    // reads what it can. Returns false if the connection failed or closed.
+    bool pump(bool wantWrite) {
+        pollfd waiting{fd, static_cast<short>(POLLIN | (wantWrite ? POLLOUT : 0)), 0};
+        if (poll(&waiting, 1, -1) < 0) {
+            return errno == EINTR;
+        }
+        if (waiting.revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (consumed > 0) {
+                input.erase(0, consumed);
+                consumed = 0;
+            }
+            size_t used = input.size();
+            input.resize(used + 64 * 1024);
+            ssize_t received = recv(fd, input.data() + used, 64 * 1024, MSG_DONTWAIT);
+            input.resize(used + (received > 0 ? received : 0));
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                return false;
+            }
+        }
+        if (waiting.revents & POLLOUT) {
+            ssize_t written = send(fd, output.data() + sent, output.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return false;
+            }
+            sent += written > 0 ? written : 0;
+            if (sent == output.size()) {
+                output.clear();
+                sent = 0;
+            }
+        }
+        return true;
+    }
+
+    // Reads the next response off the connection. Returns false if the
+    // connection failed or the server sent a malformed frame.
+    bool readResponse(BinaryResponse& response) {
+        while (true) {
+            BinaryResponseView view;
+            size_t pos = consumed;
+            BinaryParseResult result = parseBinaryResponse(input, pos, view);
+            if (result == BinaryParseResult::COMPLETE) {
+                consumed = pos;
+                response = BinaryResponse{view.status, view.id, std::string(view.value)};
+                return true;
+            }
+            if (result == BinaryParseResult::MALFORMED || !pump(sent < output.size())) {
+                return false;
+            }
+        }
+    }
+
+    std::optional<BinaryResponse> wait(uint64_t id) {
+        BinaryResponse response;
+        while (fd >= 0 && readResponse(response)) {
+            if (response.id == id) {
+                inFlight--;
+                return response;
+            }
+            stashed.emplace(response.id, std::move(response));
+        }
+        return std::nullopt;
+    }
+
+public:
+    BinaryClient() = default;
+    BinaryClient(const BinaryClient&) = delete;
+    BinaryClient& operator=(const BinaryClient&) = delete;
+    ~BinaryClient() { disconnect(); }
+
+    bool connect(const std::string& host, uint16_t port) {
+        disconnect();
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+            return false;
+        }
+        for (addrinfo* address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+            fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+            if (fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) < 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd >= 0;
+    }
+
+    void disconnect() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        output.clear();
+        sent = 0;
+        input.clear();
+        consumed = 0;
+        inFlight = 0;
+        stashed.clear();
+    }
+
+    bool connected() const { return fd >= 0; }
+
+    // Requests sent or queued whose responses have not been returned yet
+    size_t pending() const { return inFlight; }
+
+    uint64_t sendGet(std::string_view key) { return queue(BinaryOpcode::GET, key, ""); }
+    uint64_t sendPut(std::string_view key, std::string_view value) { return queue(BinaryOpcode::PUT, key, value); }
+    uint64_t sendDelete(std::string_view key) { return queue(BinaryOpcode::DELETE, key, ""); }
+    uint64_t sendPing(std::string_view payload = "") { return queue(BinaryOpcode::PING, "", payload); }
+
+    // Sends every queued request, reading responses meanwhile so a server
+    // that stops reading until its responses are read can't deadlock it.
+    // Returns false if the connection failed.
+    bool flush() {
+        while (sent < output.size()) {
+            if (fd < 0 || !pump(true)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Waits for the next response to any request in flight. Returns false if
+    // none is in flight or the connection failed.
+    bool receive(BinaryResponse& response) {
+        if (!stashed.empty()) {
+            auto it = stashed.begin();
+            response = std::move(it->second);
+            stashed.erase(it);
+            inFlight--;
+            return true;
+        }
+        if (inFlight == 0 || fd < 0 || !readResponse(response)) {
+            return false;
+        }
+        inFlight--;
+        return true;
+    }
+
+    // Blocking calls: each sends one request and waits for its response.
+    // Responses to other requests that arrive meanwhile are kept for
+    // receive().
+    BinaryStatus get(std::string_view key, std::string& value) {
+        std::optional<BinaryResponse> response = wait(sendGet(key));
+        if (!response) {
+            return BinaryStatus::ERROR;
+        }
+        value = std::move(response->value);
+        return response->status;
+    }
+
+    BinaryStatus put(std::string_view key, std::string_view value) {
+        std::optional<BinaryResponse> response = wait(sendPut(key, value));
+        return response ? response->status : BinaryStatus::ERROR;
+    }
+
+    BinaryStatus remove(std::string_view key) {
+        std::optional<BinaryResponse> response = wait(sendDelete(key));
+        return response ? response->status : BinaryStatus::ERROR;
+    }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "Coding.h"
+
+// The binary protocol: length-prefixed frames carrying requests and responses
+// on a TCP connection. Integers are little-endian.
+//
+// Request frame:
+//
+//   length      fixed32   bytes in the frame after this field
+//   opcode      1 byte    BinaryOpcode
+//   request id  fixed64   chosen by the client, echoed in the response
+//   key length  fixed32
+//   key         key length bytes
+//   value       the rest of the frame (empty except for PUT and PING)
+//
+// Response frame:
+//
+//   length      fixed32   bytes in the frame after this field
+//   status      1 byte    BinaryStatus
+//   request id  fixed64   of the request this answers
+//   value       the rest of the frame: the value for a GET, the echoed
+//               payload for a PING, the message for an ERROR
+//
+// A client may send any number of requests without waiting. Responses come
+// back in whatever order the server finishes them; the request id says which
+// request each one answers.
+
+enum class BinaryOpcode : uint8_t { GET = 1, PUT = 2, DELETE = 3, PING = 4 };
+
+enum class BinaryStatus : uint8_t { OK = 0, NOT_FOUND = 1, ERROR = 2 };
+
+const size_t BINARY_REQUEST_HEADER_SIZE = 4 + 1 + 8 + 4;
+const size_t BINARY_RESPONSE_HEADER_SIZE = 4 + 1 + 8;
+// Larger frames are a protocol error, which closes the connection
+const uint32_t BINARY_MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+// Outcome of parsing the next frame out of received bytes
+enum class BinaryParseResult { COMPLETE, INCOMPLETE, MALFORMED };
+
+// A decoded request; key and value point into the received bytes
+struct BinaryRequest {
+    BinaryOpcode opcode;
+    uint64_t id;
+    std::string_view key;
+    std::string_view value;
+};
+
+// A decoded response; value points into the received bytes
+struct BinaryResponseView {
+    BinaryStatus status;
+    uint64_t id;
+    std::string_view value;
+};
+
+inline void appendBinaryRequest(std::string& dst, BinaryOpcode opcode, uint64_t id, std::string_view key, std::string_view value) {
+    appendFixed32(dst, static_cast<uint32_t>(BINARY_REQUEST_HEADER_SIZE - 4 + key.size() + value.size()));
+    dst.push_back(static_cast<char>(opcode));
+    appendFixed64(dst, id);
+    appendFixed32(dst, static_cast<uint32_t>(key.size()));
+    dst.append(key);
+    dst.append(value);
+}
+
+inline void appendBinaryResponse(std::string& dst, BinaryStatus status, uint64_t id, std::string_view value) {
+    appendFixed32(dst, static_cast<uint32_t>(BINARY_RESPONSE_HEADER_SIZE - 4 + value.size()));
+    dst.push_back(static_cast<char>(status));
+    appendFixed64(dst, id);
+    dst.append(value);
+}
+
+// The frame starting at data[pos], with its length field checked against the
+// smallest frame of its kind and BINARY_MAX_FRAME_SIZE. On COMPLETE, frame
+// holds the bytes after the length field and pos moves past the frame.
+inline BinaryParseResult nextBinaryFrame(std::string_view data, size_t& pos, size_t headerSize, std::string_view& frame) {
+    if (data.size() - pos < 4) {
+        return BinaryParseResult::INCOMPLETE;
+    }
+    uint32_t length = decodeFixed32(data.data() + pos);
+    if (length < headerSize - 4 || length > BINARY_MAX_FRAME_SIZE) {
+        return BinaryParseResult::MALFORMED;
+    }
+    if (data.size() - pos - 4 < length) {
+        return BinaryParseResult::INCOMPLETE;
+    }
+    frame = data.substr(pos + 4, length);
+    pos += 4 + length;
+    return BinaryParseResult::COMPLETE;
+}
+
+// Parses the request frame at data[pos]. The opcode is not checked, so the
+// server can answer an unknown one with an error instead of dropping the
+// connection.
+inline BinaryParseResult parseBinaryRequest(std::string_view data, size_t& pos, BinaryRequest& request) {
+    std::string_view frame;
+    size_t start = pos;
+    BinaryParseResult result = nextBinaryFrame(data, pos, BINARY_REQUEST_HEADER_SIZE, frame);
+    if (result != BinaryParseResult::COMPLETE) {
+        return result;
+    }
+    uint32_t keyLength = decodeFixed32(frame.data() + 9);
+    if (keyLength > frame.size() - (BINARY_REQUEST_HEADER_SIZE - 4)) {
+        pos = start;
+        return BinaryParseResult::MALFORMED;
+    }
+    request.opcode = static_cast<BinaryOpcode>(frame[0]);
+    request.id = decodeFixed64(frame.data() + 1);
+    request.key = frame.substr(BINARY_REQUEST_HEADER_SIZE - 4, keyLength);
+    request.value = frame.substr(BINARY_REQUEST_HEADER_SIZE - 4 + keyLength);
+    return BinaryParseResult::COMPLETE;
+}
+
+inline BinaryParseResult parseBinaryResponse(std::string_view data, size_t& pos, BinaryResponseView& response) {
+    std::string_view frame;
+    BinaryParseResult result = nextBinaryFrame(data, pos, BINARY_RESPONSE_HEADER_SIZE, frame);
+    if (result != BinaryParseResult::COMPLETE) {
+        return result;
+    }
+    response.status = static_cast<BinaryStatus>(frame[0]);
+    response.id = decodeFixed64(frame.data() + 1);
+    response.value = frame.substr(BINARY_RESPONSE_HEADER_SIZE - 4);
+    return BinaryParseResult::COMPLETE;
+}
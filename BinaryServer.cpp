@@ -0,0 +1,379 @@
+#include "KVStore.cpp"
+#include "BinaryProtocol.h"
+#include "Socket.h"
+#include <unordered_map>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// Settings of the binary protocol front end (see BinaryProtocol.h)
+struct BinaryServerOptions {
+    string host = "127.0.0.1";
+    uint16_t port = 7070;
+    // Event loops, each a thread with its own epoll instance, listening socket
+    // on the shared port and writer thread
+    unsigned eventLoops = max(1u, thread::hardware_concurrency());
+};
+
+// Bytes asked of the socket per read
+const size_t BINARY_READ_SIZE = 64 * 1024;
+// A connection stops reading requests while this many response bytes are
+// unsent, or this many of its writes are waiting to be applied, so a client
+// that pipelines without reading responses can't exhaust memory
+const size_t BINARY_OUTPUT_LIMIT = 4 * 1024 * 1024;
+const size_t BINARY_MAX_PENDING_WRITES = 16 * 1024;
+
+// One client connection. The event loop that accepted it owns it; its writes
+// in flight hold a reference too, so it outlives a close until they finish.
+struct BinaryConnection {
+    int fd = -1;
+    string input;         // Received bytes not yet parsed into requests
+    string output;        // Responses, of which the first sent bytes are on the wire
+    size_t sent = 0;
+    // Edge-triggered epoll reports new data only once, so this stays set until
+    // a read finds the socket drained
+    bool readable = false;
+    // The peer shut down its side, or sent a malformed frame; the connection
+    // closes once every response is sent
+    bool closing = false;
+    bool closed = false;
+    size_t pendingWrites = 0; // Handed to the writer thread, not yet answered
+};
+
+// A PUT or DELETE waiting for its response
+struct BinaryWrite {
+    shared_ptr<BinaryConnection> conn;
+    uint64_t id;
+    bool ok = false;
+};
+
+// One event loop. Reads are answered on the loop thread as soon as they are
+// parsed. Writes go to the loop's writer thread, which applies everything
+// queued since its last write as one WriteBatch, so a pipeline of writes
+// shares one WAL append and sync, while the loop keeps serving reads. Their
+// responses come back through an eventfd, usually after later reads'
+// responses: a GET pipelined behind a PUT of the same key may not see it, so a
+// client that needs to read its own write waits for the PUT's response first.
+class BinaryEventLoop {
+private:
+    KVStore& store;
+    int listenFd;
+    int epollFd = -1;
+    int wakeFd = -1; // Signalled by the writer thread when writes are applied
+    unordered_map<int, shared_ptr<BinaryConnection>> connections;
+
+    thread writer;
+    mutex writeMutex;
+    condition_variable writesQueued;
+    bool writerStopping = false; // Set on destruction; the writer drains its queue and exits
+    WriteBatch queuedBatch;           // Writes for the writer thread's next batch
+    vector<BinaryWrite> queuedWrites; // Who to answer for them
+    vector<BinaryWrite> appliedWrites; // Applied, waiting for the loop to answer them
+
+    // Tells the event loop that writes were applied. EAGAIN means the counter
+    // is about to overflow, so a wakeup is pending anyway.
+    void signalApplied() {
+        uint64_t one = 1;
+        while (::write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            if (errno != EINTR) {
+                LOG_ERROR("Could not signal the binary protocol event loop", "error", strerror(errno));
+                return;
+            }
+        }
+    }
+
+    // Resets the wakeup counter. EAGAIN means it was already reset.
+    void clearApplied() {
+        uint64_t signals;
+        while (::read(wakeFd, &signals, sizeof(signals)) < 0 && errno != EAGAIN) {
+            if (errno != EINTR) {
+                LOG_ERROR("Could not read the binary protocol wakeup counter", "error", strerror(errno));
+                return;
+            }
+        }
+    }
+
+    // Applies the queued writes, one batch at a time, until stopped
+    void writeLoop() {
+        unique_lock<mutex> lock(writeMutex);
+        while (true) {
+            writesQueued.wait(lock, [this] { return writerStopping || !queuedWrites.empty(); });
+            if (queuedWrites.empty()) {
+                return;
+            }
+            WriteBatch batch = move(queuedBatch);
+            queuedBatch.clear();
+            vector<BinaryWrite> writes = move(queuedWrites);
+            queuedWrites.clear();
+            lock.unlock();
+
+            bool ok = store.write(batch);
+
+            lock.lock();
+            for (BinaryWrite& write : writes) {
+                write.ok = ok;
+                appliedWrites.push_back(move(write));
+            }
+            signalApplied();
+        }
+    }
+
+    // Answers or queues every complete request in the connection's input, in
+    // order. Stops early once the connection reaches its output or pending
+    // write limit.
+    void processInput(const shared_ptr<BinaryConnection>& conn) {
+        size_t pos = 0;
+        BinaryRequest request;
+        WriteBatch batch;
+        vector<BinaryWrite> writes;
+        while (pos < conn->input.size() && conn->output.size() - conn->sent < BINARY_OUTPUT_LIMIT &&
+               conn->pendingWrites + writes.size() < BINARY_MAX_PENDING_WRITES) {
+            BinaryParseResult result = parseBinaryRequest(conn->input, pos, request);
+            if (result == BinaryParseResult::INCOMPLETE) {
+                break;
+            }
+            if (result == BinaryParseResult::MALFORMED) {
+                appendBinaryResponse(conn->output, BinaryStatus::ERROR, 0, "malformed frame");
+                conn->closing = true;
+                pos = conn->input.size();
+                break;
+            }
+            switch (request.opcode) {
+            case BinaryOpcode::GET: {
+                PinnedValue value;
+                if (store.getKey(string(request.key), value)) {
+                    appendBinaryResponse(conn->output, BinaryStatus::OK, request.id, value.view());
+                } else {
+                    appendBinaryResponse(conn->output, BinaryStatus::NOT_FOUND, request.id, "");
+                }
+                break;
+            }
+            case BinaryOpcode::PUT:
+                batch.put(request.key, request.value);
+                writes.push_back({conn, request.id});
+                break;
+            case BinaryOpcode::DELETE:
+                batch.remove(request.key);
+                writes.push_back({conn, request.id});
+                break;
+            case BinaryOpcode::PING:
+                appendBinaryResponse(conn->output, BinaryStatus::OK, request.id, request.value);
+                break;
+            default:
+                appendBinaryResponse(conn->output, BinaryStatus::ERROR, request.id, "unknown opcode");
+                break;
+            }
+        }
+        conn->input.erase(0, pos);
+
+        if (!writes.empty()) {
+            conn->pendingWrites += writes.size();
+            lock_guard<mutex> lock(writeMutex);
+            queuedBatch.append(batch);
+            queuedWrites.insert(queuedWrites.end(), make_move_iterator(writes.begin()), make_move_iterator(writes.end()));
+            writesQueued.notify_one();
+        }
+    }
+
+    // Reads until the socket is drained or the connection is at a limit,
+    // handling the requests and sending the responses as it goes. Returns
+    // false once the connection should be closed.
+    bool handleEvents(const shared_ptr<BinaryConnection>& conn, uint32_t events) {
+        if (events & EPOLLERR) {
+            return false;
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+            conn->readable = true;
+        }
+        while (true) {
+            processInput(conn); // Requests held back by a limit
+            if (!sendPending(conn->fd, conn->output, conn->sent)) {
+                return false;
+            }
+            if (conn->output.size() - conn->sent >= BINARY_OUTPUT_LIMIT || conn->pendingWrites >= BINARY_MAX_PENDING_WRITES ||
+                !conn->readable || conn->closing) {
+                break;
+            }
+            size_t used = conn->input.size();
+            conn->input.resize(used + BINARY_READ_SIZE);
+            ssize_t received = recv(conn->fd, conn->input.data() + used, BINARY_READ_SIZE, 0);
+            conn->input.resize(used + max<ssize_t>(received, 0));
+            if (received == 0) {
+                conn->closing = true; // Still answer what the peer sent before shutting down
+                conn->readable = false;
+            } else if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    conn->readable = false;
+                    break;
+                }
+                if (errno != EINTR) {
+                    return false;
+                }
+            }
+        }
+        return !(conn->closing && conn->output.empty() && conn->pendingWrites == 0);
+    }
+
+    void closeConnection(const shared_ptr<BinaryConnection>& conn) {
+        conn->closed = true;
+        close(conn->fd); // Also removes it from the epoll set
+        connections.erase(conn->fd);
+    }
+
+    void acceptConnections() {
+        // Edge-triggered: accept every pending connection now
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Could not accept a binary protocol connection", "error", strerror(errno));
+                }
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            auto conn = make_shared<BinaryConnection>();
+            conn->fd = fd;
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.fd = fd;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                close(fd);
+                continue;
+            }
+            connections.emplace(fd, move(conn));
+        }
+    }
+
+    // Sends the responses of the writes the writer thread has applied
+    void answerAppliedWrites() {
+        clearApplied();
+        vector<BinaryWrite> applied;
+        {
+            lock_guard<mutex> lock(writeMutex);
+            applied.swap(appliedWrites);
+        }
+        vector<shared_ptr<BinaryConnection>> answered;
+        for (BinaryWrite& write : applied) {
+            BinaryConnection& conn = *write.conn;
+            conn.pendingWrites--;
+            if (conn.closed) {
+                continue;
+            }
+            if (write.ok) {
+                appendBinaryResponse(conn.output, BinaryStatus::OK, write.id, "");
+            } else {
+                appendBinaryResponse(conn.output, BinaryStatus::ERROR, write.id, "could not write to the WAL");
+            }
+            if (answered.empty() || answered.back() != write.conn) {
+                answered.push_back(write.conn);
+            }
+        }
+        for (const auto& conn : answered) {
+            // May also resume reading a connection that was at its write limit
+            if (!conn->closed && !handleEvents(conn, 0)) {
+                closeConnection(conn);
+            }
+        }
+    }
+
+public:
+    BinaryEventLoop(KVStore& store, int listenFd) : store(store), listenFd(listenFd) {}
+
+    // Stops the writer thread once it has applied what is queued. Call after
+    // run() has returned.
+    ~BinaryEventLoop() {
+        {
+            lock_guard<mutex> lock(writeMutex);
+            writerStopping = true;
+        }
+        writesQueued.notify_one();
+        if (writer.joinable()) {
+            writer.join();
+        }
+        for (auto& [fd, conn] : connections) {
+            close(fd);
+        }
+        for (int fd : {epollFd, wakeFd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    BinaryEventLoop(const BinaryEventLoop&) = delete;
+    BinaryEventLoop& operator=(const BinaryEventLoop&) = delete;
+
+    // Serves connections until the process exits or epoll fails
+    void run() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            LOG_ERROR("Could not create an epoll instance", "error", strerror(errno));
+            return;
+        }
+        for (int fd : {listenFd, wakeFd}) {
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        }
+        writer = thread([this] { writeLoop(); });
+
+        vector<epoll_event> events(256);
+        while (true) {
+            int ready = epoll_wait(epollFd, events.data(), events.size(), -1);
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("epoll_wait failed", "error", strerror(errno));
+                return;
+            }
+            for (int i = 0; i < ready; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptConnections();
+                } else if (fd == wakeFd) {
+                    answerAppliedWrites();
+                } else if (auto it = connections.find(fd); it != connections.end()) {
+                    shared_ptr<BinaryConnection> conn = it->second;
+                    if (!handleEvents(conn, events[i].events)) {
+                        closeConnection(conn);
+                    }
+                }
+            }
+        }
+    }
+};
+
+// Serves the store over the binary protocol (see BinaryProtocol.h), with any
+// number of pipelined requests per connection answered in any order. Blocks
+// until the event loops exit.
+void start_binary_server(KVStore& store, const BinaryServerOptions& options = BinaryServerOptions()) {
+    vector<int> listeners;
+    for (unsigned i = 0; i < max(1u, options.eventLoops); i++) {
+        int fd = openTcpListener(options.host, options.port);
+        if (fd < 0) {
+            for (int listener : listeners) {
+                close(listener);
+            }
+            return;
+        }
+        listeners.push_back(fd);
+    }
+
+    LOG_INFO("Starting binary protocol server", "host", options.host, "port", options.port, "event_loops", listeners.size());
+    vector<unique_ptr<BinaryEventLoop>> loops;
+    vector<thread> threads;
+    for (int fd : listeners) {
+        loops.push_back(make_unique<BinaryEventLoop>(store, fd));
+        threads.emplace_back([loop = loops.back().get()] { loop->run(); });
+    }
+    for (auto& loopThread : threads) {
+        loopThread.join();
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "LRUCache.h"
+#include "MappedFile.h"
+
+// A block read from an SSTable, checksum-verified and parsed once. offsets
+// holds the start of every entry in contents, so a lookup can binary-search
+// the entries instead of decoding them in order. Filter blocks have no entries.
+//
+// contents points either at the block's own copy in data, or straight into a
+// mapped table file, which mapping then keeps alive.
+struct Block {
+    std::string_view contents;
+    std::string data; // Empty if the block lives in a mapped file
+    std::shared_ptr<const MappedFile> mapping;
+    std::vector<uint32_t> offsets;
+
+    Block() = default;
+    Block(const Block&) = delete; // contents may point into data
+    Block& operator=(const Block&) = delete;
+
+    // Memory the block holds, as counted against the cache's capacity. A mapped
+    // block's bytes belong to the page cache and aren't counted.
+    size_t charge() const { return sizeof(Block) + data.capacity() + offsets.capacity() * sizeof(uint32_t); }
+};
+
+// Identifies a block across every table of a store. Table numbers are never
+// reused, so a replaced table's blocks can't be mistaken for another's.
+struct BlockCacheKey {
+    uint64_t table = 0;
+    uint64_t offset = 0;
+
+    bool operator==(const BlockCacheKey& other) const { return table == other.table && offset == other.offset; }
+};
+
+struct BlockCacheKeyHash {
+    size_t operator()(const BlockCacheKey& key) const {
+        // Mix both halves (the MurmurHash3 finalizer) so shards fill evenly
+        uint64_t h = key.table * 0x9e3779b97f4a7c15ull ^ key.offset;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+};
+
+// Parsed SSTable blocks shared by every reader of a store, bounded by bytes
+using BlockCache = LRUCache<BlockCacheKey, Block, BlockCacheKeyHash>;
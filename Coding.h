@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define FASTKV_CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define FASTKV_CRC32C_ARM 1
+#endif
+
+// Encoding helpers shared by the on-disk formats. Multi-byte integers are
+// little-endian regardless of the host.
+
+
+// ----------------------------------------------------------------------------
+// --- FIXED-WIDTH AND VARIABLE-LENGTH INTEGERS
+// ----------------------------------------------------------------------------
+
+inline void appendFixed32(std::string& dst, uint32_t value) {
+    char buf[4];
+    for (int i = 0; i < 4; i++) {
+        buf[i] = static_cast<char>(value >> (8 * i));
+    }
+    dst.append(buf, 4);
+}
+
+inline void appendFixed64(std::string& dst, uint64_t value) {
+    char buf[8];
+    for (int i = 0; i < 8; i++) {
+        buf[i] = static_cast<char>(value >> (8 * i));
+    }
+    dst.append(buf, 8);
+}
+
+inline uint32_t decodeFixed32(const char* p) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return value;
+}
+
+inline uint64_t decodeFixed64(const char* p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Seven bits per byte, low bits first, high bit set on all but the last byte
+inline void appendVarint64(std::string& dst, uint64_t value) {
+    char buf[10];
+    int len = 0;
+    while (value >= 0x80) {
+        buf[len++] = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = static_cast<char>(value);
+    dst.append(buf, len);
+}
+
+inline void appendVarint32(std::string& dst, uint32_t value) {
+    appendVarint64(dst, value);
+}
+
+// Decodes a varint starting at p, never reading at or past limit. On success
+// advances p past it and returns true; returns false if it is truncated or
+// longer than the type allows.
+inline bool decodeVarint64(const char*& p, const char* limit, uint64_t& value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift <= 63 && p < limit; shift += 7) {
+        uint64_t byte = static_cast<unsigned char>(*p++);
+        result |= (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool decodeVarint32(const char*& p, const char* limit, uint32_t& value) {
+    uint64_t wide;
+    const char* start = p;
+    if (!decodeVarint64(p, limit, wide) || wide > UINT32_MAX) {
+        p = start;
+        return false;
+    }
+    value = static_cast<uint32_t>(wide);
+    return true;
+}
+
+// A varint length followed by that many bytes
+inline void appendLengthPrefixed(std::string& dst, std::string_view data) {
+    appendVarint32(dst, static_cast<uint32_t>(data.size()));
+    dst.append(data.data(), data.size());
+}
+
+inline bool decodeLengthPrefixed(const char*& p, const char* limit, std::string_view& data) {
+    uint32_t length;
+    const char* start = p;
+    if (!decodeVarint32(p, limit, length) || static_cast<size_t>(limit - p) < length) {
+        p = start;
+        return false;
+    }
+    data = std::string_view(p, length);
+    p += length;
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// --- CRC32C (Castagnoli)
+// ----------------------------------------------------------------------------
+
+namespace crc32c {
+
+// Byte-at-a-time table lookup, used when the CPU has no CRC32C instruction
+inline uint32_t extendPortable(uint32_t crc, const char* data, size_t n) {
+    struct Table {
+        uint32_t entries[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int bit = 0; bit < 8; bit++) {
+                    c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+                }
+                entries[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    for (size_t i = 0; i < n; i++) {
+        crc = table.entries[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(FASTKV_CRC32C_SSE42)
+// Compiled for SSE4.2 regardless of the global flags; only called after a
+// runtime check, so the binary still runs on older CPUs
+__attribute__((target("sse4.2"))) inline uint32_t extendHardware(uint32_t crc, const char* data, size_t n) {
+    uint64_t c = crc;
+    while (n >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+        data += 8;
+        n -= 8;
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    while (n > 0) {
+        c32 = _mm_crc32_u8(c32, static_cast<unsigned char>(*data++));
+        n--;
+    }
+    return c32;
+}
+
+inline bool hardwareAvailable() {
+    static const bool available = __builtin_cpu_supports("sse4.2");
+    return available;
+}
+#elif defined(FASTKV_CRC32C_ARM)
+inline uint32_t extendHardware(uint32_t crc, const char* data, size_t n) {
+    while (n >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+        data += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        crc = __crc32cb(crc, static_cast<uint8_t>(*data++));
+        n--;
+    }
+    return crc;
+}
+
+inline bool hardwareAvailable() { return true; }
+#else
+inline uint32_t extendHardware(uint32_t crc, const char* data, size_t n) { return extendPortable(crc, data, n); }
+inline bool hardwareAvailable() { return false; }
+#endif
+
+// CRC32C of n bytes
+inline uint32_t value(const char* data, size_t n) {
+    uint32_t crc = 0xFFFFFFFFu;
+    crc = hardwareAvailable() ? extendHardware(crc, data, n) : extendPortable(crc, data, n);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+} // namespace crc32c
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+#include "Version.h"
+
+// How a store merges its SSTables, chosen when it is opened
+//  - LEVELED keeps one sorted run per level below L0, each level ten times the
+//    one above. Reads and space stay tight; data is rewritten once per level.
+//  - UNIVERSAL keeps every sorted run in L0 and merges runs of similar size,
+//    rewriting data far less often at the cost of more runs to read and more
+//    space held by overwritten values.
+enum class CompactionStyle { LEVELED, UNIVERSAL };
+
+// Settings of leveled compaction
+struct LeveledCompactionOptions {
+    size_t level0FileTrigger = 4;                // Compact L0 once it has this many tables
+    uint64_t levelBaseBytes = 10 * 1024 * 1024;  // Target size of L1
+    int levelMultiplier = 10;                    // Each level targets this many times the previous one
+};
+
+// Settings of universal compaction
+struct UniversalCompactionOptions {
+    size_t runTrigger = 4;                       // Compact once there are this many sorted runs
+    unsigned sizeRatioPercent = 1;               // A run joins a merge if it is at most this much larger than the runs picked so far
+    size_t minMergeWidth = 2;
+    size_t maxMergeWidth = SIZE_MAX;
+    unsigned maxSizeAmplificationPercent = 200;  // Merge everything once the newer runs outgrow the oldest by this much
+};
+
+// One unit of compaction work: merge inputs (from level) with the overlapping
+// tables of outputLevel, and write the result to outputLevel.
+struct Compaction {
+    int level = 0;
+    int outputLevel = 1;
+    std::vector<std::shared_ptr<SSTable>> inputs;
+    std::vector<std::shared_ptr<SSTable>> outputLevelInputs;
+
+    std::vector<std::shared_ptr<SSTable>> allInputs() const {
+        std::vector<std::shared_ptr<SSTable>> all = inputs;
+        all.insert(all.end(), outputLevelInputs.begin(), outputLevelInputs.end());
+        return all;
+    }
+
+    // A single table with nothing to merge against can simply change level
+    bool isTrivialMove() const { return inputs.size() == 1 && outputLevelInputs.empty(); }
+
+    // Lowest sequence number among the inputs
+    uint64_t smallestSeq() const {
+        uint64_t seq = UINT64_MAX;
+        for (const auto& table : allInputs()) {
+            seq = std::min(seq, table->properties().minSeq);
+        }
+        return seq;
+    }
+};
+
+// Decides what to compact next. Not thread-safe; the caller serializes calls.
+class CompactionPicker {
+public:
+    virtual ~CompactionPicker() = default;
+
+    // How urgently level needs compaction; it is due at 1 or more
+    virtual double score(const Version& version, int level) const = 0;
+
+    // The most urgent compaction that touches no busy table, if any is due
+    virtual std::optional<Compaction> pick(const Version& version, const std::set<uint64_t>& busy) = 0;
+};
+
+inline bool anyBusy(const std::vector<std::shared_ptr<SSTable>>& tables, const std::set<uint64_t>& busy) {
+    for (const auto& table : tables) {
+        if (busy.count(table->number()) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Chooses leveled compactions. Each level has a score: for L0 its table count
+// over level0FileTrigger, for the others its size over its target size. The
+// level with the highest score of at least 1 is compacted first.
+//  - L0 compacts all of its tables at once (their ranges overlap, so older
+//    ones can't be left behind) together with every L1 table they overlap.
+//  - Higher levels compact one table at a time, cycling through the key space,
+//    together with the tables of the next level it overlaps.
+// Tables already being compacted are skipped, so several compactions can run
+// in parallel on disjoint tables. The last level is never compacted.
+class LeveledCompactionPicker : public CompactionPicker {
+private:
+    LeveledCompactionOptions options;
+    std::string compactPointer[NUM_LEVELS]; // Largest key last compacted per level
+
+    std::optional<Compaction> pickLevel0(const Version& version, const std::set<uint64_t>& busy) const;
+    std::optional<Compaction> pickLevel(const Version& version, int level, const std::set<uint64_t>& busy);
+
+public:
+    explicit LeveledCompactionPicker(const LeveledCompactionOptions& options) : options(options) {}
+
+    uint64_t maxBytesForLevel(int level) const {
+        uint64_t bytes = options.levelBaseBytes;
+        for (int i = 1; i < level; i++) {
+            bytes *= options.levelMultiplier;
+        }
+        return bytes;
+    }
+
+    double score(const Version& version, int level) const override {
+        if (level == 0) {
+            return static_cast<double>(version.levels[0].size()) / options.level0FileTrigger;
+        }
+        if (level == NUM_LEVELS - 1) {
+            return 0;
+        }
+        return static_cast<double>(version.levelBytes(level)) / maxBytesForLevel(level);
+    }
+
+    std::optional<Compaction> pick(const Version& version, const std::set<uint64_t>& busy) override;
+};
+
+// Chooses universal (size-tiered) compactions. Every sorted run is one L0
+// table, ordered by age, and a compaction merges a span of adjacent runs into
+// one, so the runs' sequence ranges never interleave. Once there are
+// runTrigger runs, in order of preference:
+//  1. Size amplification: if the newer runs add up to maxSizeAmplificationPercent
+//     of the oldest, merge everything, which also drops all tombstones.
+//  2. Size ratio: starting from the newest run, extend the span to older runs
+//     while each is at most sizeRatioPercent larger than the span so far.
+//  3. Otherwise, if there are more than runTrigger runs, merge the newest ones,
+//     enough to get back to runTrigger.
+class UniversalCompactionPicker : public CompactionPicker {
+private:
+    UniversalCompactionOptions options;
+
+    static Compaction mergeRuns(const std::vector<std::shared_ptr<SSTable>>& runs, size_t first, size_t last) {
+        Compaction compaction;
+        compaction.level = 0;
+        compaction.outputLevel = 0;
+        compaction.inputs.assign(runs.begin() + first, runs.begin() + last + 1);
+        return compaction;
+    }
+
+public:
+    explicit UniversalCompactionPicker(const UniversalCompactionOptions& options) : options(options) {}
+
+    double score(const Version& version, int level) const override {
+        return level == 0 ? static_cast<double>(version.levels[0].size()) / options.runTrigger : 0;
+    }
+
+    std::optional<Compaction> pick(const Version& version, const std::set<uint64_t>& busy) override;
+};
+
+inline std::unique_ptr<CompactionPicker> newCompactionPicker(CompactionStyle style, const LeveledCompactionOptions& leveled,
+                                                             const UniversalCompactionOptions& universal) {
+    if (style == CompactionStyle::UNIVERSAL) {
+        return std::make_unique<UniversalCompactionPicker>(universal);
+    }
+    return std::make_unique<LeveledCompactionPicker>(leveled);
+}
+
+
+// ----------------------------------------------------------------------------
+// --- IMPLEMENTATIONS
+// ----------------------------------------------------------------------------
+
+inline std::optional<Compaction> LeveledCompactionPicker::pickLevel0(const Version& version, const std::set<uint64_t>& busy) const {
+    Compaction compaction;
+    compaction.level = 0;
+    compaction.outputLevel = 1;
+    compaction.inputs = version.levels[0];
+    if (compaction.inputs.empty() || anyBusy(compaction.inputs, busy)) {
+        return std::nullopt;
+    }
+    std::string smallest = compaction.inputs[0]->properties().minKey;
+    std::string largest = compaction.inputs[0]->properties().maxKey;
+    for (const auto& table : compaction.inputs) {
+        smallest = std::min(smallest, table->properties().minKey);
+        largest = std::max(largest, table->properties().maxKey);
+    }
+    compaction.outputLevelInputs = version.overlapping(1, smallest, largest);
+    if (anyBusy(compaction.outputLevelInputs, busy)) {
+        return std::nullopt;
+    }
+    return compaction;
+}
+
+inline std::optional<Compaction> LeveledCompactionPicker::pickLevel(const Version& version, int level, const std::set<uint64_t>& busy) {
+    const auto& tables = version.levels[level];
+    if (tables.empty()) {
+        return std::nullopt;
+    }
+    // Start after the last compacted key, wrapping around
+    size_t start = 0;
+    while (start < tables.size() && !compactPointer[level].empty() && tables[start]->properties().minKey <= compactPointer[level]) {
+        start++;
+    }
+    for (size_t i = 0; i < tables.size(); i++) {
+        const auto& table = tables[(start + i) % tables.size()];
+        if (busy.count(table->number()) > 0) {
+            continue;
+        }
+        Compaction compaction;
+        compaction.level = level;
+        compaction.outputLevel = level + 1;
+        compaction.inputs = {table};
+        compaction.outputLevelInputs = version.overlapping(level + 1, table->properties().minKey, table->properties().maxKey);
+        if (anyBusy(compaction.outputLevelInputs, busy)) {
+            continue;
+        }
+        compactPointer[level] = table->properties().maxKey;
+        return compaction;
+    }
+    return std::nullopt;
+}
+
+inline std::optional<Compaction> LeveledCompactionPicker::pick(const Version& version, const std::set<uint64_t>& busy) {
+    // Levels in order of urgency
+    std::vector<std::pair<double, int>> scores;
+    for (int level = 0; level < NUM_LEVELS - 1; level++) {
+        double levelScore = score(version, level);
+        if (levelScore >= 1) {
+            scores.emplace_back(levelScore, level);
+        }
+    }
+    std::sort(scores.rbegin(), scores.rend());
+
+    for (const auto& [levelScore, level] : scores) {
+        std::optional<Compaction> compaction = (level == 0) ? pickLevel0(version, busy) : pickLevel(version, level, busy);
+        if (compaction) {
+            return compaction;
+        }
+    }
+    return std::nullopt;
+}
+
+inline std::optional<Compaction> UniversalCompactionPicker::pick(const Version& version, const std::set<uint64_t>& busy) {
+    const auto& runs = version.levels[0]; // Oldest first
+    if (runs.size() < std::max<size_t>(options.runTrigger, 2)) {
+        return std::nullopt;
+    }
+    size_t minWidth = std::max<size_t>(options.minMergeWidth, 2);
+    size_t maxWidth = std::max(options.maxMergeWidth, minWidth);
+
+    // 1. Size amplification
+    if (!anyBusy(runs, busy)) {
+        uint64_t newerBytes = 0;
+        for (size_t i = 1; i < runs.size(); i++) {
+            newerBytes += runs[i]->fileSize();
+        }
+        if (newerBytes * 100 >= static_cast<uint64_t>(options.maxSizeAmplificationPercent) * runs[0]->fileSize()) {
+            return mergeRuns(runs, 0, runs.size() - 1);
+        }
+    }
+
+    // 2. Size ratio, newest runs first
+    for (size_t last = runs.size(); last-- > 0;) {
+        if (busy.count(runs[last]->number()) > 0) {
+            continue;
+        }
+        uint64_t spanBytes = runs[last]->fileSize();
+        size_t first = last;
+        while (first > 0 && last - first + 1 < maxWidth && busy.count(runs[first - 1]->number()) == 0 &&
+               runs[first - 1]->fileSize() * 100 <= spanBytes * (100 + options.sizeRatioPercent)) {
+            first--;
+            spanBytes += runs[first]->fileSize();
+        }
+        if (last - first + 1 >= minWidth) {
+            return mergeRuns(runs, first, last);
+        }
+    }
+
+    // 3. Too many runs
+    if (runs.size() <= options.runTrigger) {
+        return std::nullopt;
+    }
+    size_t width = std::min(std::max(runs.size() - options.runTrigger + 1, minWidth), runs.size());
+    size_t first = runs.size() - width;
+    for (size_t i = first; i < runs.size(); i++) {
+        if (busy.count(runs[i]->number()) > 0) {
+            return std::nullopt;
+        }
+    }
+    return mergeRuns(runs, first, runs.size() - 1);
+}
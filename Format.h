@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// What a write does to its key. Stored as one byte in WAL records, memtables
+// and SSTable entries, so deletes are distinguishable from any value.
+enum class RecordType : uint8_t { PUT = 1, DELETION = 2 };
+
+// A read at this sequence number sees every write, the newest version of each
+// key. Reads at a snapshot use the snapshot's sequence number instead.
+const uint64_t MAX_SEQUENCE_NUMBER = UINT64_MAX;
+
+inline bool isValidRecordType(uint8_t raw) {
+    return raw == static_cast<uint8_t>(RecordType::PUT) || raw == static_cast<uint8_t>(RecordType::DELETION);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include "Format.h"
+
+// Ordered cursor over stored entries: a memtable, an SSTable, or a merge of
+// several. Entries come in key order; key() and value() stay valid until the
+// next call that moves the cursor.
+class EntryIterator {
+public:
+    virtual ~EntryIterator() = default;
+
+    virtual bool valid() const = 0;
+    virtual void seekToFirst() = 0;
+    virtual void seek(std::string_view target) = 0; // First key >= target
+    virtual void next() = 0;
+    virtual std::string_view key() const = 0;
+    virtual std::string_view value() const = 0; // Empty for a DELETION
+    virtual uint64_t seq() const = 0;
+    virtual RecordType type() const = 0;
+
+    // True if the iterator stopped early because data could not be read
+    virtual bool failed() const { return false; }
+};
+
+// Merges several iterators into one. Entries with the same key come newest
+// first (highest seq), so the first entry seen for a key is its current value.
+// The valid children sit in a binary heap with the next entry on top, so a step
+// costs O(log n) even when a scan merges every table of a large level 0.
+class MergingIterator : public EntryIterator {
+private:
+    std::vector<std::unique_ptr<EntryIterator>> children;
+    std::vector<EntryIterator*> heap; // Valid children only
+
+    // Heap order: true if a's entry comes after b's
+    static bool after(const EntryIterator* a, const EntryIterator* b) {
+        int order = a->key().compare(b->key());
+        return order != 0 ? order > 0 : a->seq() < b->seq();
+    }
+
+    void buildHeap() {
+        heap.clear();
+        for (auto& child : children) {
+            if (child->valid()) {
+                heap.push_back(child.get());
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), after);
+    }
+
+public:
+    explicit MergingIterator(std::vector<std::unique_ptr<EntryIterator>> children) : children(std::move(children)) {}
+
+    bool valid() const override { return !heap.empty(); }
+
+    void seekToFirst() override {
+        for (auto& child : children) {
+            child->seekToFirst();
+        }
+        buildHeap();
+    }
+
+    void seek(std::string_view target) override {
+        for (auto& child : children) {
+            child->seek(target);
+        }
+        buildHeap();
+    }
+
+    void next() override {
+        std::pop_heap(heap.begin(), heap.end(), after);
+        EntryIterator* child = heap.back();
+        child->next();
+        if (child->valid()) {
+            std::push_heap(heap.begin(), heap.end(), after);
+        } else {
+            heap.pop_back();
+        }
+    }
+
+    std::string_view key() const override { return heap.front()->key(); }
+    std::string_view value() const override { return heap.front()->value(); }
+    uint64_t seq() const override { return heap.front()->seq(); }
+    RecordType type() const override { return heap.front()->type(); }
+
+    bool failed() const override {
+        for (const auto& child : children) {
+            if (child->failed()) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
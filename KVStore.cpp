@@ -1,236 +1,1402 @@
+#pragma once
+
 #include <iostream>
 #include <string>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <filesystem>
+#include <algorithm>
+#include <optional>
+#include <set>
+#include <atomic>
 #include <chrono> // For timing
-#include "RBTree.h"
+#include <functional>
+#include "BlockCache.h"
+#include "Compaction.h"
+#include "Logger.h"
+#include "Manifest.h"
+#include "Memtable.h"
+#include "PinnedValue.h"
+#include "PrefixExtractor.h"
+#include "SSTable.h"
+#include "Version.h"
+#include "WAL.h"
+#include "WriteBatch.h"
 
 using namespace std;
 using namespace chrono;
 
-// Represents the in-memory index for a single SSTable
-struct SSTableIndex {
-    string filename;
-    map<string, streampos> sparseIndex; // Maps a key to its file offset
+// Construction-time settings of a KVStore
+struct KVStoreOptions {
+    // Where the store keeps its SSTables and MANIFEST, with its WAL files in a
+    // temp/ directory inside. Created if missing.
+    string directory = ".";
+    MemtableType memtableType = MemtableType::RBTREE;
+    // Switch to a fresh memtable once the active one's arena holds this many
+    // bytes. The arena grows in 64 KB blocks, so much smaller values rotate
+    // after every write.
+    size_t memtableThreshold = 4 * 1024 * 1024;
+    // Writes stall while this many full memtables are waiting to be flushed
+    size_t maxImmutableMemtables = 2;
+    // How writes are made durable (see WAL.h). Fixed for the life of an open
+    // store: with NONE it writes no WAL, keeps writes in memtables until they
+    // are flushed, and flushes them all on close.
+    WALSyncMode walSyncMode = WALSyncMode::GROUP;
+    // How often the WAL is synced in WALSyncMode::INTERVAL
+    unsigned walSyncIntervalMs = 100;
+    // Threads used to decode the WAL on startup. 0 means one per hardware thread.
+    unsigned recoveryThreads = 0;
+    // Target size of an SSTable data block, the unit of a disk read
+    size_t blockSize = 4096;
+    // Size of each SSTable's Bloom filter. 10 bits per key gives about 1.2% false
+    // positives; 0 disables filters.
+    int bloomBitsPerKey = 10;
+    // Cuts keys into the prefixes that prefix scans ask for (see
+    // PrefixExtractor.h); each SSTable then carries a prefix Bloom filter.
+    // Null disables prefix filters.
+    shared_ptr<const PrefixExtractor> prefixExtractor;
+    // Bytes of parsed SSTable blocks kept in memory, shared by all reads; 0
+    // disables the cache
+    size_t blockCacheCapacity = 64 * 1024 * 1024;
+    // Keep the index and filter blocks of every open table in memory. If false
+    // they compete for the block cache with data blocks.
+    bool pinIndexAndFilterBlocks = true;
+    // SSTables kept open (file descriptor plus index and filter blocks) in the
+    // table cache; 0 keeps every table open
+    size_t maxOpenTables = 1000;
+    // Read SSTables through a memory map instead of pread. Suits read-mostly
+    // data that fits in the page cache: blocks are used in place rather than
+    // copied into the block cache, which then holds only their parsed offsets.
+    bool mmapReads = false;
+    // Background threads merging SSTables
+    unsigned compactionThreads = 2;
+    // Leveled compaction outputs are split into tables of about this size
+    uint64_t targetFileSize = 2 * 1024 * 1024;
+    CompactionStyle compactionStyle = CompactionStyle::LEVELED;
+    LeveledCompactionOptions leveledCompaction;
+    UniversalCompactionOptions universalCompaction;
+};
+
+// Shape of one level, as reported by KVStore::getStats()
+struct LevelStats {
+    size_t tables = 0;
+    uint64_t bytes = 0;
+    double score = 0; // Compaction is due at 1 or more
+};
+
+// Counters reported by KVStore::getStats()
+struct KVStoreStats {
+    uint64_t bloomHits = 0;           // Filter passed and the table had the key
+    uint64_t bloomMisses = 0;         // Filter ruled a table out
+    uint64_t bloomFalsePositives = 0; // Filter passed but the table lacked the key
+    uint64_t prefixBloomHits = 0;     // Prefix filter let a table into a prefix scan
+    uint64_t prefixBloomMisses = 0;   // Prefix filter ruled a table out of a prefix scan
+    uint64_t flushBytesWritten = 0;      // SSTable bytes written by memtable flushes
+    uint64_t compactionBytesRead = 0;    // SSTable bytes read by compactions
+    uint64_t compactionBytesWritten = 0; // SSTable bytes written by compactions
+    uint64_t compactions = 0;            // Compactions finished, including trivial moves
+    uint64_t runningCompactions = 0;
+    // SSTable bytes written per byte flushed: 1 means data was written once
+    double writeAmplification = 0;
+    vector<LevelStats> levels;
+    CacheStats blockCache; // All zero if the store has no block cache
+    CacheStats tableCache; // All zero if every table stays open
+};
+
+// Per-write settings
+struct WriteOptions {
+    // Overrides KVStoreOptions::walSyncMode for this write. A store with a WAL
+    // rejects NONE, since a write left out of the WAL could be lost behind an
+    // older logged one on recovery; a store without one ignores the override.
+    optional<WALSyncMode> syncMode;
+};
+
+// A consistent point-in-time view of a store, from KVStore::getSnapshot().
+// Reads at a snapshot see exactly the writes that were visible when it was
+// taken, and compaction keeps the versions they need until it is released.
+class Snapshot {
+private:
+    friend class KVStore;
+    friend class ShardedKVStore;
+    uint64_t seq;
+    vector<const Snapshot*> shardSnapshots; // From ShardedKVStore::getSnapshot(): one per shard
+
+    explicit Snapshot(uint64_t seq) : seq(seq) {}
+
+public:
+    // Every write up to this sequence number is visible at the snapshot; 0 for
+    // a ShardedKVStore snapshot, whose shards each have their own sequence
+    uint64_t sequence() const { return seq; }
 };
 
+// Per-read settings
+struct ReadOptions {
+    // Read as of this snapshot. Null reads the latest writes: every write
+    // acknowledged before the read began, and all of a batch or none of it.
+    const Snapshot* snapshot = nullptr;
+    // Only keys starting with this prefix are visited, and SSTables that can't
+    // hold one are skipped: by key range, and by prefix filter if prefix is a
+    // full prefix for KVStoreOptions::prefixExtractor. Empty for all keys. Only
+    // used by iterators and scans.
+    string prefix;
+};
+
+// A full memtable waiting for the background thread to write it out. Once it
+// is flushed, every WAL file numbered up to walNumber can be deleted.
+struct ImmutableMemtable {
+    shared_ptr<Memtable> table;
+    uint64_t walNumber;
+};
+
+// Forward cursor over a store's live keys at a sequence number, from
+// KVStore::newIterator(). It merges every memtable and SSTable, shows only the
+// newest version of each key no newer than the sequence number, and skips
+// deleted ones. The memtables and table set it was created on are held until
+// it is destroyed, so nothing it reads is freed or deleted under it.
+class StoreIterator : public EntryIterator {
+private:
+    vector<shared_ptr<Memtable>> memtables;
+    shared_ptr<const Version> version;
+    MergingIterator merged; // Declared last: its children use the above
+    uint64_t snapshot;      // Versions written after it are skipped
+    string prefix;          // Keys outside it end the iteration
+    string currentKey;
+
+    // Moves past every remaining version of the current key
+    void skipKey() {
+        currentKey.assign(merged.key().data(), merged.key().size());
+        do {
+            merged.next();
+        } while (merged.valid() && merged.key() == currentKey);
+    }
+
+    // Moves to the newest visible version of the next key that is not deleted.
+    // Versions of a key come newest first, so the first one at or below the
+    // snapshot is the one to show.
+    void skipHidden() {
+        while (valid()) {
+            if (merged.seq() > snapshot) {
+                merged.next();
+            } else if (merged.type() == RecordType::DELETION) {
+                skipKey();
+            } else {
+                return;
+            }
+        }
+    }
+
+public:
+    StoreIterator(vector<shared_ptr<Memtable>> memtables, shared_ptr<const Version> version, vector<unique_ptr<EntryIterator>> children,
+                  uint64_t snapshot, string prefix = "")
+        : memtables(move(memtables)), version(move(version)), merged(move(children)), snapshot(snapshot), prefix(move(prefix)) {}
+
+    bool valid() const override { return merged.valid() && merged.key().compare(0, prefix.size(), prefix) == 0; }
+
+    void seekToFirst() override {
+        if (!prefix.empty()) {
+            seek(prefix);
+            return;
+        }
+        merged.seekToFirst();
+        skipHidden();
+    }
+
+    void seek(string_view target) override {
+        merged.seek(max(target, string_view(prefix)));
+        skipHidden();
+    }
+
+    void next() override {
+        skipKey();
+        skipHidden();
+    }
+
+    string_view key() const override { return merged.key(); }
+    string_view value() const override { return merged.value(); }
+    uint64_t seq() const override { return merged.seq(); }
+    RecordType type() const override { return RecordType::PUT; }
+    bool failed() const override { return merged.failed(); }
+};
+
+// Concurrency model:
+//  - writeMutex fixes the order of the WAL: queueing a record and assigning its
+//    sequence number happen in one critical section. It also guards the
+//    immutable memtable queue and the current WAL file. Waiting for the record
+//    to be synced happens after writeMutex is released, so concurrent writers
+//    share one write and one fdatasync (group commit, see WAL.h).
+//  - memtableMutex guards the memtable pointers. Readers and writers share it;
+//    it is taken exclusively only to swap the pointers. A writer acquires its
+//    shared lock before releasing writeMutex, so the memtable can never be
+//    swapped out between a writer's WAL record and its memtable insert.
+//  - The memtable synchronizes its own contents (see Memtable.h), so with the
+//    skiplist memtable inserts from different threads run in parallel.
+//  - sstableMutex guards the version pointer. A published Version is never
+//    mutated, so readers copy the pointer and search it without holding a lock.
+//    The immutable memtable list is published the same way.
+//  - versionEditMutex serializes changes to the table set: it is held while a
+//    flush or compaction logs its MANIFEST edit and publishes the next Version,
+//    and guards the set of tables that compactions are working on.
+//  - Writers reach the memtable out of sequence order, so a write is only
+//    published once every write numbered before it is in: publishMutex tracks
+//    the writes in between, and visibleSequence is the newest write a read
+//    may see. A writer returns once its own write is visible, so reads after
+//    it always see it. Reads without a snapshot read at visibleSequence, which
+//    also makes a batch appear all at once.
+//
+// Memtables and SSTables keep older versions of a key next to the newest, so
+// a read at a snapshot skips versions written after it. Flushes and
+// compactions drop a version only once no live snapshot can see it.
+//
+// When the active memtable fills up, the next writer moves it to the immutable
+// queue, starts a new WAL file and carries on with an empty memtable. A
+// background thread writes queued memtables to SSTables, oldest first, and only
+// then removes them from the read path. Writers wait only when
+// maxImmutableMemtables are already queued.
+//
+// Flushed tables go to level 0. A pool of compaction threads merges them into
+// the sorted levels below, or with universal compaction into fewer, larger
+// level 0 runs (see Compaction.h), dropping overwritten values and, once
+// nothing older remains underneath, tombstones.
+//
+// The set of SSTables is recorded in the MANIFEST (see Manifest.h). A new table
+// is added there before its WAL files are deleted, and on startup the table set
+// is rebuilt from it, loading only each table's index, filter and metadata.
 class KVStore {
 private:
-    RBTree<string, string> memtable;
-    size_t memtableSize = 0;
-    const size_t MEMTABLE_THRESHOLD = 1024;
-    const size_t INDEX_INTERVAL = 128; // Create an index entry every 128 bytes
-    int sstableCounter = 0;
-    string walPath = "temp/wal.log";
-    const string TOMBSTONE = "---DELETED---";
-    vector<SSTableIndex> sstableIndices;
+    KVStoreOptions options;
+    shared_ptr<Memtable> memtable;
+    shared_ptr<const vector<ImmutableMemtable>> immutableMemtables = make_shared<const vector<ImmutableMemtable>>(); // Oldest first
+    uint64_t lastSequence = 0; // Sequence number of the newest WAL record, guarded by writeMutex
+    atomic<uint64_t> visibleSequence{0}; // Every write up to this one is in a memtable
+    set<uint64_t> unpublishedWrites; // First sequence numbers of writes logged but not yet in a memtable
+    uint64_t assignedSequence = 0;   // Newest sequence number handed out, guarded by publishMutex
+    map<const Snapshot*, uint64_t> liveSnapshots; // Unreleased snapshots and their sequence numbers
+    atomic<uint64_t> nextTableNumber{0};
+    Manifest manifest;
+    const string walDirectory;
+    uint64_t logNumber = 0; // WAL files numbered below this are already in SSTables
+    uint64_t walNumber = 0; // WAL file of the active memtable
+    shared_ptr<WALWriter> wal; // Null if the store has no WAL
+    shared_ptr<const Version> version = make_shared<const Version>();
+    shared_ptr<BlockCache> blockCache; // Null if disabled
+    shared_ptr<TableCache> tableCache; // Null if every table stays open
+    unique_ptr<CompactionPicker> compactionPicker;
+    set<uint64_t> compactingTables; // Inputs of running compactions
+
+    BloomFilterStats filterStats;
+    BloomFilterStats prefixFilterStats; // Only hits and misses are counted
+    atomic<uint64_t> flushBytesWritten{0};
+    atomic<uint64_t> compactionBytesRead{0};
+    atomic<uint64_t> compactionBytesWritten{0};
+    atomic<uint64_t> compactionsCompleted{0};
+    atomic<uint64_t> compactionsRunning{0};
+
+    mutex writeMutex;
+    mutable shared_mutex memtableMutex;
+    mutable mutex sstableMutex;
+    mutex versionEditMutex;
+    mutex publishMutex;
+    condition_variable writesPublished; // Signals writers that visibleSequence moved
+    mutable mutex snapshotMutex;
+
+    thread flushThread;
+    thread walSyncThread; // Only runs in WALSyncMode::INTERVAL
+    condition_variable flushScheduled;  // Signals the flush thread that work was queued
+    condition_variable flushCompleted;  // Signals stalled writers that the queue shrank
+    condition_variable stopRequested;   // Wakes the WAL sync thread early on shutdown
+    bool stopping = false;
+    bool opened = false; // The table set was loaded and the background threads run
+
+    vector<thread> compactionThreads;
+    condition_variable compactionScheduled; // Signals compaction threads that the table set changed
+    atomic<bool> compactionsStopping{false};
+
+    bool hasWAL() const { return options.walSyncMode != WALSyncMode::NONE; }
+
+    // The sync mode of a write, or nullopt if the store must reject it
+    optional<WALSyncMode> writeSyncMode(const WriteOptions& writeOptions) const {
+        if (!hasWAL()) {
+            return WALSyncMode::NONE;
+        }
+        if (writeOptions.syncMode == WALSyncMode::NONE) {
+            LOG_WARN("Rejected a write without WAL on a store with a WAL");
+            return nullopt;
+        }
+        return writeOptions.syncMode.value_or(options.walSyncMode);
+    }
 
+    shared_ptr<const Version> currentVersion() const {
+        lock_guard<mutex> lock(sstableMutex);
+        return version;
+    }
+
+    string tableFileName(uint64_t number) const {
+        return options.directory + "/sstable_" + to_string(number) + ".sst";
+    }
+
+    // SSTable files in the store's directory, by number
+    map<uint64_t, string> listTableFiles() const {
+        map<uint64_t, string> files;
+        for (const auto& entry : filesystem::directory_iterator(options.directory)) {
+            string name = entry.path().filename().string();
+            if (name.rfind("sstable_", 0) == 0 && name.size() > 12 && name.compare(name.size() - 4, 4, ".sst") == 0) {
+                files[stoull(name.substr(8, name.size() - 12))] = entry.path().string();
+            }
+        }
+        return files;
+    }
+
+    // Rebuilds the table set from the MANIFEST and starts a fresh manifest file.
+    // Tables written before the store had a manifest are adopted in file order.
+    // Returns false, touching no file, if the manifest or one of its tables
+    // can't be read.
+    bool loadTables() {
+        ManifestState state;
+        bool found;
+        if (!manifest.load(state, found)) {
+            LOG_ERROR("Could not read MANIFEST", "directory", options.directory);
+            return false;
+        }
+        map<uint64_t, string> tableFiles = listTableFiles();
+        if (!found) {
+            for (const auto& [number, name] : tableFiles) {
+                state.tables[number] = 0;
+                state.nextTableNumber = number + 1;
+            }
+        }
+
+        auto loaded = make_shared<Version>();
+        for (const auto& [number, level] : state.tables) {
+            shared_ptr<SSTable> table = SSTable::open(tableFileName(number), number, tableReadOptions());
+            if (!table) {
+                LOG_ERROR("Could not open SSTable file", "file", tableFileName(number));
+                return false;
+            }
+            loaded->levels[level].push_back(table);
+        }
+        loaded->sortLevels();
+        if (!manifest.create(state)) {
+            LOG_ERROR("Could not write MANIFEST", "directory", options.directory);
+            return false;
+        }
+        // Files the manifest doesn't know are left over from a flush that never
+        // finished; their data is still in the WAL
+        for (const auto& [number, name] : tableFiles) {
+            if (state.tables.count(number) == 0) {
+                filesystem::remove(name);
+            }
+        }
+
+        version = loaded;
+        nextTableNumber = state.nextTableNumber;
+        logNumber = state.logNumber;
+        lastSequence = state.lastSequence;
+        LOG_INFO("Loaded SSTables from MANIFEST", "tables", loaded->tableCount());
+        return true;
+    }
+
+    string walFileName(uint64_t number) const {
+        return walDirectory + "/wal_" + to_string(number) + ".log";
+    }
+
+    // WAL files on disk, oldest first. The single wal.log written by older
+    // versions sorts before all numbered files.
+    vector<pair<uint64_t, string>> listWALFiles() const {
+        vector<pair<uint64_t, string>> files;
+        for (const auto& entry : filesystem::directory_iterator(walDirectory)) {
+            string name = entry.path().filename().string();
+            if (name == "wal.log") {
+                files.emplace_back(0, entry.path().string());
+            } else if (name.rfind("wal_", 0) == 0 && name.size() > 8 && name.compare(name.size() - 4, 4, ".log") == 0) {
+                files.emplace_back(stoull(name.substr(4, name.size() - 8)), entry.path().string());
+            }
+        }
+        sort(files.begin(), files.end());
+        return files;
+    }
+
+    // Opens the WAL file for the active memtable. Caller must hold writeMutex.
+    void openWAL(uint64_t number) {
+        walNumber = number;
+        if (!hasWAL()) {
+            return;
+        }
+        wal = make_shared<WALWriter>(walFileName(walNumber));
+        if (!wal->isOpen()) {
+            LOG_ERROR("Could not open WAL file for writing", "file", walFileName(walNumber));
+        } else if (!syncDirectory(walDirectory)) {
+            // Without it a synced record could vanish with its file after a crash
+            LOG_ERROR("Could not sync WAL directory", "directory", walDirectory);
+        }
+    }
+
+    // Moves the active memtable to the immutable queue and starts a new WAL file
+    // for its replacement. Caller must hold writeMutex.
+    void rotateMemtable() {
+        {
+            unique_lock<shared_mutex> lock(memtableMutex);
+            auto queued = make_shared<vector<ImmutableMemtable>>(*immutableMemtables);
+            queued->push_back(ImmutableMemtable{memtable, walNumber});
+            immutableMemtables = queued;
+            memtable = newMemtable(options.memtableType);
+        }
+        openWAL(walNumber + 1);
+        flushScheduled.notify_one();
+    }
+
+    // Makes sure the active memtable has room for another write, rotating it if
+    // it is full and waiting if too many memtables are already queued.
+    void makeRoomForWrite(unique_lock<mutex>& writeLock) {
+        while (!memtable->empty() && memtable->memoryUsage() > options.memtableThreshold) {
+            if (immutableMemtables->size() >= options.maxImmutableMemtables) {
+                LOG_INFO("Memtables waiting for flush; stalling writes", "memtables", immutableMemtables->size());
+                flushCompleted.wait(writeLock);
+                continue;
+            }
+            LOG_INFO("Memtable threshold reached; queued for flush to SSTable");
+            rotateMemtable();
+        }
+    }
+
+    // Logs a write and applies it to the memtable. Returns the memtable's memory
+    // usage afterwards, or 0 if the store is not open, the write asks for a
+    // sync mode the store rejects or the WAL append failed.
+    size_t applyWrite(RecordType type, const string& key, const string& value, const WriteOptions& writeOptions) {
+        optional<WALSyncMode> syncMode = writeSyncMode(writeOptions);
+        if (!opened || !syncMode) {
+            return 0;
+        }
+        unique_lock<mutex> writeLock(writeMutex);
+        makeRoomForWrite(writeLock);
+
+        // 1. Log to WAL first. The record's place in the file is fixed here...
+        shared_ptr<WALWriter> log = wal;
+        uint64_t seq = ++lastSequence;
+        beginWrite(seq, seq);
+        uint64_t ticket = log ? log->submit(encodeWALRecord(type, seq, key, value)) : 0;
+
+        // ...but waiting for the sync happens outside writeMutex, with the
+        // memtable pinned against a concurrent swap
+        shared_lock<shared_mutex> memtableLock(memtableMutex);
+        writeLock.unlock();
+        bool logged = !log || log->commit(ticket, *syncMode);
+
+        // 2. Insert into memtable
+        if (logged) {
+            memtable->insert(seq, type, key, value);
+        }
+        size_t usage = memtable->memoryUsage();
+        publishWrite(seq);
+        memtableLock.unlock();
+        if (!logged) {
+            LOG_ERROR("Could not write to WAL file");
+            return 0;
+        }
+        waitUntilVisible(seq);
+        return usage;
+    }
+
+    // Like applyWrite, for a whole batch: one WAL record and a run of
+    // consecutive sequence numbers
+    size_t applyBatch(const WriteBatch& batch, const WriteOptions& writeOptions) {
+        optional<WALSyncMode> syncMode = writeSyncMode(writeOptions);
+        if (!opened || !syncMode) {
+            return 0;
+        }
+        unique_lock<mutex> writeLock(writeMutex);
+        makeRoomForWrite(writeLock);
+
+        shared_ptr<WALWriter> log = wal;
+        uint64_t firstSeq = lastSequence + 1;
+        lastSequence += batch.count();
+        beginWrite(firstSeq, lastSequence);
+        uint64_t ticket = log ? log->submit(encodeWALBatch(firstSeq, batch)) : 0;
+
+        shared_lock<shared_mutex> memtableLock(memtableMutex);
+        writeLock.unlock();
+        bool logged = !log || log->commit(ticket, *syncMode);
+        if (logged) {
+            memtable->insertBatch(firstSeq, batch);
+        }
+        size_t usage = memtable->memoryUsage();
+        publishWrite(firstSeq);
+        memtableLock.unlock();
+        if (!logged) {
+            LOG_ERROR("Could not write to WAL file");
+            return 0;
+        }
+        waitUntilVisible(firstSeq + batch.count() - 1);
+        return usage;
+    }
+
+    // Records that sequence numbers first to last were handed out to a write
+    // that is not yet in the memtable. Caller must hold writeMutex.
+    void beginWrite(uint64_t first, uint64_t last) {
+        lock_guard<mutex> lock(publishMutex);
+        unpublishedWrites.insert(first);
+        assignedSequence = last;
+    }
+
+    // Marks the write starting at first as applied (or abandoned), and makes
+    // visible every write before the oldest one still in flight
+    void publishWrite(uint64_t first) {
+        lock_guard<mutex> lock(publishMutex);
+        unpublishedWrites.erase(first);
+        uint64_t visible = unpublishedWrites.empty() ? assignedSequence : *unpublishedWrites.begin() - 1;
+        if (visible > visibleSequence.load()) {
+            visibleSequence = visible;
+            writesPublished.notify_all();
+        }
+    }
+
+    // Blocks until reads see seq. Only waits while an earlier write is still
+    // on its way into the memtable.
+    void waitUntilVisible(uint64_t seq) {
+        unique_lock<mutex> lock(publishMutex);
+        writesPublished.wait(lock, [&] { return visibleSequence.load() >= seq; });
+    }
+
+    // The sequence number a read with readOptions reads at
+    uint64_t readSequence(const ReadOptions& readOptions) const {
+        return readOptions.snapshot ? readOptions.snapshot->sequence() : visibleSequence.load();
+    }
+
+    // Sequence numbers of the live snapshots, oldest first
+    vector<uint64_t> snapshotSequences() const {
+        lock_guard<mutex> lock(snapshotMutex);
+        vector<uint64_t> sequences;
+        for (const auto& [snapshot, seq] : liveSnapshots) {
+            sequences.push_back(seq);
+        }
+        sort(sequences.begin(), sequences.end());
+        return sequences;
+    }
+
+    // True if a flush or compaction must keep the version of a key written at
+    // seq: it is the newest one (newerSeq is MAX_SEQUENCE_NUMBER), or a live
+    // snapshot taken before the next newer version, at newerSeq, reads it.
+    static bool isVisibleVersion(const vector<uint64_t>& snapshots, uint64_t seq, uint64_t newerSeq) {
+        if (newerSeq == MAX_SEQUENCE_NUMBER) {
+            return true;
+        }
+        auto reader = lower_bound(snapshots.begin(), snapshots.end(), seq);
+        return reader != snapshots.end() && *reader < newerSeq;
+    }
+
+    // Replays every WAL file left on disk into memtables. A memtable is only
+    // rotated between files, so each queued memtable covers whole WAL files and
+    // those can be deleted once it is flushed. Caller must hold writeMutex.
     void recoverFromWAL() {
-        ifstream walFile(walPath);
-        if (!walFile.is_open()) {
+        vector<pair<uint64_t, string>> walFiles;
+        for (const auto& [number, path] : listWALFiles()) {
+            if (number < logNumber) {
+                filesystem::remove(path); // Flushed, but deleting it was interrupted
+            } else {
+                walFiles.emplace_back(number, path);
+            }
+        }
+        if (walFiles.empty()) {
+            openWAL(max<uint64_t>(logNumber, 1));
             return; // No WAL file, nothing to recover
         }
 
-        cout << "[INFO] Starting recovery from WAL..." << endl;
-        string line;
-        while (getline(walFile, line)) {
-            stringstream ss(line);
-            string key, value;
-            ss >> key;
-            getline(ss, value);
-            if (!value.empty() && value[0] == ' ') {
-                value.erase(0, 1);
+        LOG_INFO("Starting recovery from WAL");
+        auto start = high_resolution_clock::now();
+        unsigned threads = options.recoveryThreads > 0 ? options.recoveryThreads : max(1u, thread::hardware_concurrency());
+        size_t records = 0;
+        for (const auto& [number, path] : walFiles) {
+            WALReplayStats stats = replayWALFile(path, threads, lastSequence + 1, [this](const WALRecord& record) {
+                // Directly insert into memtable without logging again
+                memtable->insert(record.seq, record.type, record.key, record.value);
+            });
+            lastSequence = max(lastSequence, stats.maxSequence);
+            records += stats.recordsRead;
+            if (stats.torn) {
+                // A crash mid-write leaves a partial record at the end. Everything
+                // before it was acknowledged; the torn write never was.
+                LOG_INFO("Ignored incomplete record at the end of WAL file", "file", path);
+            }
+
+            walNumber = number;
+            if (!memtable->empty() && memtable->memoryUsage() > options.memtableThreshold) {
+                rotateMemtable();
             }
-            
-            // Directly insert into memtable without logging again
-            memtable.insert(key, value);
-            memtableSize += key.length() + value.length();
         }
-        walFile.close();
-        cout << "[INFO] WAL recovery finished. Memtable size: " << memtableSize << " bytes." << endl;
+        duration<double, milli> elapsed = high_resolution_clock::now() - start;
+        LOG_INFO("WAL recovery finished", "records", records, "ms", elapsed.count(), "memtable_bytes", memtable->memoryUsage());
+
+        // New writes go to a fresh file; the active memtable's flush will also
+        // retire the files it was recovered from.
+        openWAL(walFiles.back().first + 1);
+    }
 
-        if (memtableSize > MEMTABLE_THRESHOLD) {
-            flushToSSTable();
+    SSTableReadOptions tableReadOptions() const {
+        SSTableReadOptions readOptions;
+        readOptions.blockCache = blockCache;
+        readOptions.tableCache = tableCache;
+        readOptions.pinIndexAndFilter = options.pinIndexAndFilterBlocks;
+        readOptions.mmapReads = options.mmapReads;
+        return readOptions;
+    }
+
+    SSTableOptions tableOptions() const {
+        SSTableOptions tableOptions;
+        tableOptions.blockSize = options.blockSize;
+        tableOptions.bloomBitsPerKey = options.bloomBitsPerKey;
+        tableOptions.prefixExtractor = options.prefixExtractor;
+        return tableOptions;
+    }
+
+    // Logs edit to the MANIFEST and publishes the Version it describes. Caller
+    // must hold versionEditMutex.
+    bool installEdit(VersionEdit& edit, const vector<pair<int, shared_ptr<SSTable>>>& added) {
+        edit.nextTableNumber = nextTableNumber.load();
+        if (!manifest.logEdit(edit)) {
+            LOG_ERROR("Could not write MANIFEST");
+            return false;
         }
+        shared_ptr<const Version> next = currentVersion()->withEdit(edit.removedTables, added);
+        lock_guard<mutex> lock(sstableMutex);
+        version = next;
+        return true;
     }
 
-    void flushToSSTable() {
-        if (memtable.empty()) {
-            return;
+    // Writes one immutable memtable to a new level 0 SSTable, records it in the
+    // MANIFEST and publishes it. Runs on the flush thread without holding
+    // writeMutex or memtableMutex.
+    bool flushToSSTable(const ImmutableMemtable& flushing) {
+        uint64_t tableNumber = nextTableNumber++;
+        string filename = tableFileName(tableNumber);
+        SSTableBuilder builder(filename, tableOptions());
+
+        if (!builder.isOpen()) {
+            LOG_ERROR("Could not open SSTable file for writing", "file", filename);
+            return false;
         }
 
-        string filename = "sstable_" + to_string(sstableCounter++) + ".txt";
-        ofstream sstableFile(filename, ios::binary); // Open in binary mode for accurate streampos
+        // Stream the entries in key order straight from the memtable, with the
+        // older versions that live snapshots still read
+        vector<uint64_t> snapshots = snapshotSequences();
+        unique_ptr<EntryIterator> it = flushing.table->newIterator();
+        string_view currentKey; // Points into the memtable's arena
+        bool hasCurrentKey = false;
+        uint64_t newerSeq = MAX_SEQUENCE_NUMBER; // Of the previous version of currentKey
+        for (it->seekToFirst(); it->valid(); it->next()) {
+            if (!hasCurrentKey || it->key() != currentKey) {
+                currentKey = it->key();
+                hasCurrentKey = true;
+                newerSeq = MAX_SEQUENCE_NUMBER;
+            }
+            if (isVisibleVersion(snapshots, it->seq(), newerSeq)) {
+                builder.add(it->key(), it->seq(), it->type(), it->value());
+            }
+            newerSeq = it->seq();
+        }
+        it.reset();
 
-        if (!sstableFile.is_open()) {
-            cerr << "Error: Could not open SSTable file for writing: " << filename << endl;
-            return;
+        shared_ptr<SSTable> table = builder.finish() ? SSTable::open(filename, tableNumber, tableReadOptions()) : nullptr;
+        if (!table) {
+            LOG_ERROR("Could not write SSTable file", "file", filename);
+            filesystem::remove(filename);
+            return false;
         }
 
-        SSTableIndex newIndex;
-        newIndex.filename = filename;
-        streampos lastIndexPos = 0;
+        // Once this edit is on disk the memtable's WAL files are no longer needed
+        VersionEdit edit;
+        edit.addedTables.emplace_back(0, tableNumber);
+        edit.logNumber = flushing.walNumber + 1;
+        edit.lastSequence = table->properties().maxSeq;
+        {
+            lock_guard<mutex> lock(versionEditMutex);
+            if (!installEdit(edit, {{0, table}})) {
+                table->markObsolete();
+                return false;
+            }
+        }
+        compactionScheduled.notify_one();
+        flushBytesWritten += table->fileSize();
+        LOG_INFO("Memtable flushed", "file", filename, "entries", table->properties().entries, "bytes", table->fileSize());
+        return true;
+    }
 
-        vector<pair<string, string>> sortedData = memtable.getSortedData();
+    // True if no table outside the compaction can hold an older version of key,
+    // so a tombstone for it has nothing left to hide
+    static bool isBaseLevelForKey(const Version& base, const Compaction& compaction, string_view key) {
+        if (compaction.outputLevel == 0) {
+            // Universal compaction: older runs share level 0 with the inputs
+            uint64_t oldestInput = compaction.smallestSeq();
+            for (const auto& table : base.levels[0]) {
+                if (table->properties().maxSeq < oldestInput && table->overlaps(key, key)) {
+                    return false;
+                }
+            }
+        }
+        for (int level = compaction.outputLevel + 1; level < NUM_LEVELS; level++) {
+            if (base.findTable(level, key) != nullptr) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Merges a compaction's inputs into new tables at its output level, keeping
+    // the newest version of each key and the older ones live snapshots read,
+    // then swaps them in with one MANIFEST edit. Runs on a compaction thread; the inputs are marked busy, so no other
+    // compaction touches them meanwhile.
+    bool runCompaction(const Compaction& compaction) {
+        auto start = high_resolution_clock::now();
+        VersionEdit edit;
+
+        // 1. A lone table with nothing below it to merge with just changes level
+        if (compaction.isTrivialMove()) {
+            const shared_ptr<SSTable>& table = compaction.inputs[0];
+            edit.removedTables.push_back(table->number());
+            edit.addedTables.emplace_back(compaction.outputLevel, table->number());
+            lock_guard<mutex> lock(versionEditMutex);
+            if (!installEdit(edit, {{compaction.outputLevel, table}})) {
+                return false;
+            }
+            compactionsCompleted++;
+            LOG_INFO("Moved SSTable down a level", "file", table->fileName(), "from_level", compaction.level, "to_level", compaction.outputLevel);
+            return true;
+        }
+
+        // 2. Merge the inputs, newest version of each key first
+        vector<shared_ptr<SSTable>> inputs = compaction.allInputs();
+        vector<unique_ptr<EntryIterator>> children;
+        uint64_t bytesRead = 0;
+        for (const auto& table : inputs) {
+            children.push_back(table->newIterator(false)); // Read once; keep the cache for hot blocks
+            bytesRead += table->fileSize();
+        }
+        MergingIterator merged(move(children));
+        shared_ptr<const Version> base = currentVersion();
+
+        vector<shared_ptr<SSTable>> outputs;
+        unique_ptr<SSTableBuilder> builder;
+        uint64_t builderNumber = 0;
+        bool ok = true;
+        auto finishOutput = [&]() {
+            shared_ptr<SSTable> table = builder->finish() ? SSTable::open(tableFileName(builderNumber), builderNumber, tableReadOptions()) : nullptr;
+            builder.reset();
+            if (!table) {
+                LOG_ERROR("Could not write SSTable file", "file", tableFileName(builderNumber));
+                filesystem::remove(tableFileName(builderNumber));
+                return false;
+            }
+            outputs.push_back(table);
+            return true;
+        };
+
+        // A level 0 table must hold a whole sorted run, so only leveled outputs
+        // below it are split
+        bool splitOutputs = compaction.outputLevel > 0;
+        // A snapshot taken later reads at a sequence number past every input,
+        // so it only needs the newest versions, which are always kept
+        vector<uint64_t> snapshots = snapshotSequences();
+        uint64_t oldestSnapshot = snapshots.empty() ? MAX_SEQUENCE_NUMBER : snapshots.front();
+        string currentKey;
+        bool hasCurrentKey = false;
+        uint64_t newerSeq = MAX_SEQUENCE_NUMBER; // Of the previous version of currentKey
+        for (merged.seekToFirst(); ok && merged.valid(); merged.next()) {
+            if (compactionsStopping) {
+                ok = false;
+                break;
+            }
+            string_view key = merged.key();
+            bool newKey = !hasCurrentKey || key != currentKey;
+            if (newKey) {
+                currentKey.assign(key.data(), key.size());
+                hasCurrentKey = true;
+                newerSeq = MAX_SEQUENCE_NUMBER;
+            }
+            uint64_t seq = merged.seq();
+            bool visible = isVisibleVersion(snapshots, seq, newerSeq);
+            newerSeq = seq;
+            if (!visible) {
+                continue; // Shadowed by a newer version for every reader
+            }
+            // A tombstone older than every snapshot hides nothing from anyone
+            // once nothing older remains underneath
+            if (merged.type() == RecordType::DELETION && seq <= oldestSnapshot && isBaseLevelForKey(*base, compaction, key)) {
+                continue;
+            }
+
+            // Cut between keys, so a key's history never spans two tables
+            if (splitOutputs && newKey && builder && builder->fileSize() >= options.targetFileSize) {
+                ok = finishOutput();
+                if (!ok) {
+                    break;
+                }
+            }
+            if (!builder) {
+                builderNumber = nextTableNumber++;
+                builder = make_unique<SSTableBuilder>(tableFileName(builderNumber), tableOptions());
+                if (!builder->isOpen()) {
+                    LOG_ERROR("Could not open SSTable file for writing", "file", tableFileName(builderNumber));
+                    builder.reset();
+                    ok = false;
+                    break;
+                }
+            }
+            builder->add(key, seq, merged.type(), merged.value());
+        }
+        if (ok && merged.failed()) {
+            LOG_ERROR("Could not read an SSTable during compaction");
+            ok = false;
+        }
+        if (ok && builder) {
+            ok = finishOutput();
+        }
+        if (!ok) {
+            if (builder) {
+                builder.reset();
+                filesystem::remove(tableFileName(builderNumber));
+            }
+            for (const auto& table : outputs) {
+                table->markObsolete();
+            }
+            return false;
+        }
+
+        // 3. Swap the outputs in for the inputs
+        vector<pair<int, shared_ptr<SSTable>>> added;
+        uint64_t bytesWritten = 0;
+        for (const auto& table : inputs) {
+            edit.removedTables.push_back(table->number());
+        }
+        for (const auto& table : outputs) {
+            edit.addedTables.emplace_back(compaction.outputLevel, table->number());
+            added.emplace_back(compaction.outputLevel, table);
+            bytesWritten += table->fileSize();
+        }
+        {
+            lock_guard<mutex> lock(versionEditMutex);
+            if (!installEdit(edit, added)) {
+                for (const auto& table : outputs) {
+                    table->markObsolete();
+                }
+                return false;
+            }
+        }
+        // Files are deleted once the last reader of an older Version lets go
+        for (const auto& table : inputs) {
+            table->markObsolete();
+        }
+        compactionBytesRead += bytesRead;
+        compactionBytesWritten += bytesWritten;
+        compactionsCompleted++;
 
-        for (const auto& pair : sortedData) {
-            streampos currentPos = sstableFile.tellp();
-            if (newIndex.sparseIndex.empty() || static_cast<size_t>(currentPos - lastIndexPos) >= INDEX_INTERVAL) {
-                newIndex.sparseIndex[pair.first] = currentPos;
-                lastIndexPos = currentPos;
+        duration<double, milli> elapsed = high_resolution_clock::now() - start;
+        LOG_INFO("Compacted SSTables", "inputs", inputs.size(), "level", compaction.level, "outputs", outputs.size(),
+                 "output_level", compaction.outputLevel, "bytes_read", bytesRead, "bytes_written", bytesWritten, "ms", elapsed.count());
+        return true;
+    }
+
+    // Body of a compaction thread: runs the most urgent compaction whose tables
+    // are not already being compacted, until none is due
+    void backgroundCompactionLoop() {
+        unique_lock<mutex> lock(versionEditMutex);
+        while (true) {
+            optional<Compaction> compaction;
+            compactionScheduled.wait(lock, [&] {
+                if (compactionsStopping) {
+                    return true;
+                }
+                compaction = compactionPicker->pick(*currentVersion(), compactingTables);
+                return compaction.has_value();
+            });
+            if (compactionsStopping) {
+                return;
+            }
+            vector<shared_ptr<SSTable>> inputs = compaction->allInputs();
+            for (const auto& table : inputs) {
+                compactingTables.insert(table->number());
+            }
+            compactionsRunning++;
+
+            lock.unlock();
+            bool compacted = runCompaction(*compaction);
+            lock.lock();
+            compactionsRunning--;
+            for (const auto& table : inputs) {
+                compactingTables.erase(table->number());
+            }
+            if (!compacted && !compactionsStopping) {
+                compactionScheduled.wait_for(lock, seconds(1)); // Retry later
+            }
+            // The released tables may unblock a compaction another thread passed over
+            compactionScheduled.notify_all();
+        }
+    }
+
+    // Body of the WAL sync thread in WALSyncMode::INTERVAL
+    void backgroundSyncLoop() {
+        unique_lock<mutex> writeLock(writeMutex);
+        while (!stopping) {
+            stopRequested.wait_for(writeLock, milliseconds(options.walSyncIntervalMs), [this] { return stopping; });
+            shared_ptr<WALWriter> log = wal;
+            writeLock.unlock();
+            if (log && !log->syncAll()) {
+                LOG_ERROR("Could not sync WAL file");
             }
-            sstableFile << pair.first << " " << pair.second << "\n";
+            writeLock.lock();
         }
+    }
 
-        sstableFile.close();
-        sstableIndices.push_back(newIndex); // Add the new index to our in-memory list
-        memtable.clear();
-        memtableSize = 0;
+    // Body of the flush thread: drains the immutable queue oldest first. On
+    // shutdown it finishes the queue, which by then holds the active memtable
+    // too, before exiting.
+    void backgroundFlushLoop() {
+        unique_lock<mutex> writeLock(writeMutex);
+        while (true) {
+            flushScheduled.wait(writeLock, [this] { return stopping || !immutableMemtables->empty(); });
+            if (immutableMemtables->empty()) {
+                return;
+            }
+            ImmutableMemtable oldest = immutableMemtables->front();
 
-        // Clear the WAL file after successful flush
-        ofstream walFile(walPath, ofstream::out | ofstream::trunc);
-        walFile.close();
+            writeLock.unlock();
+            bool flushed = oldest.table->empty() || flushToSSTable(oldest);
+            writeLock.lock();
+            if (!flushed) {
+                if (stopping) {
+                    return; // The data is still in its WAL files
+                }
+                writeLock.unlock();
+                this_thread::sleep_for(seconds(1)); // Retry; writers stall meanwhile
+                writeLock.lock();
+                continue;
+            }
 
-        cout << "[INFO] Memtable flushed to " << filename << " and WAL cleared. Index created." << endl;
+            // The SSTable was published first, so a reader never sees the data in
+            // neither place.
+            {
+                unique_lock<shared_mutex> lock(memtableMutex);
+                immutableMemtables = make_shared<const vector<ImmutableMemtable>>(immutableMemtables->begin() + 1, immutableMemtables->end());
+            }
+            for (const auto& [number, path] : listWALFiles()) {
+                if (number <= oldest.walNumber) {
+                    filesystem::remove(path);
+                }
+            }
+            flushCompleted.notify_all();
+        }
     }
 
 public:
-    KVStore() {
-        // Create temp directory if it doesn't exist
-        system("mkdir temp 2>nul"); 
-        recoverFromWAL();
+    explicit KVStore(const KVStoreOptions& options = KVStoreOptions())
+        : options(options), memtable(newMemtable(options.memtableType)), manifest(options.directory), walDirectory(options.directory + "/temp"),
+          compactionPicker(newCompactionPicker(options.compactionStyle, options.leveledCompaction, options.universalCompaction)) {
+        if (options.blockCacheCapacity > 0) {
+            blockCache = make_shared<BlockCache>(options.blockCacheCapacity);
+        }
+        if (options.maxOpenTables > 0) {
+            tableCache = make_shared<TableCache>(options.maxOpenTables);
+        }
+        // Create the store and temp directories if they don't exist
+        filesystem::create_directories(walDirectory);
+        if (!loadTables()) {
+            return; // Left closed: isOpen() is false and every write fails
+        }
+        opened = true;
+        {
+            lock_guard<mutex> lock(writeMutex);
+            recoverFromWAL();
+            assignedSequence = lastSequence;
+            visibleSequence = lastSequence;
+        }
+        flushThread = thread(&KVStore::backgroundFlushLoop, this);
+        for (unsigned i = 0; i < max(1u, options.compactionThreads); i++) {
+            compactionThreads.emplace_back(&KVStore::backgroundCompactionLoop, this);
+        }
+        if (options.walSyncMode == WALSyncMode::INTERVAL) {
+            walSyncThread = thread(&KVStore::backgroundSyncLoop, this);
+        }
+    }
+
+    ~KVStore() {
+        if (!opened) {
+            return;
+        }
+        {
+            // Queue the active memtable so the flush thread writes it out: the
+            // next open then has no WAL to replay
+            lock_guard<mutex> lock(writeMutex);
+            if (!memtable->empty()) {
+                rotateMemtable();
+            }
+            stopping = true;
+        }
+        flushScheduled.notify_one();
+        stopRequested.notify_one();
+        flushThread.join();
+        if (walSyncThread.joinable()) {
+            walSyncThread.join();
+        }
+        {
+            lock_guard<mutex> lock(versionEditMutex);
+            compactionsStopping = true;
+        }
+        compactionScheduled.notify_all();
+        for (auto& compactionThread : compactionThreads) {
+            compactionThread.join();
+        }
     }
 
-    void insertKey(const string& key, const string& value) {
+    KVStore(const KVStore&) = delete;
+    KVStore& operator=(const KVStore&) = delete;
+
+    // False if the store's MANIFEST or tables could not be read. A store that
+    // failed to open rejects every write.
+    bool isOpen() const { return opened; }
+
+    const KVStoreOptions& getOptions() const { return options; }
+
+    // Returns false if the WAL could not be written or the write's sync mode
+    // was rejected (see WriteOptions), in which case the key was not changed
+    bool insertKey(const string& key, const string& value, const WriteOptions& writeOptions = WriteOptions()) {
         auto start = high_resolution_clock::now();
 
-        // 1. Log to WAL first
-        ofstream walFile(walPath, ios::app);
-        if (!walFile.is_open()) {
-            cerr << "Error: Could not open WAL file for writing." << endl;
-            return;
+        size_t size = applyWrite(RecordType::PUT, key, value, writeOptions);
+        if (size == 0) {
+            return false;
         }
-        walFile << key << " " << value << "\n";
-        walFile.close();
 
-        // 2. Insert into memtable
-        memtable.insert(key, value);
-        memtableSize += key.length() + value.length();
-        
         auto end = high_resolution_clock::now();
         duration<double, milli> duration = end - start;
-        cout << "[PERF] insertKey for '" << key << "' took " << duration.count() << " ms. Memtable size: " << memtableSize << " bytes." << endl;
+        LOG_DEBUG("Inserted key", "key", key, "ms", duration.count(), "memtable_bytes", size);
+        return true;
+    }
 
-        if (memtableSize > MEMTABLE_THRESHOLD) {
-            cout << "[INFO] Memtable threshold reached. Flushing to SSTable..." << endl;
-            flushToSSTable();
+    // Like insertKey, writing a tombstone
+    bool deleteKey(const string& key, const WriteOptions& writeOptions = WriteOptions()) {
+        size_t size = applyWrite(RecordType::DELETION, key, "", writeOptions);
+        if (size == 0) {
+            return false;
         }
+        LOG_DEBUG("Deleted key", "key", key, "memtable_bytes", size);
+        return true;
     }
 
-    void deleteKey(const string& key) {
-        // 1. Log tombstone to WAL
-        ofstream walFile(walPath, ios::app);
-        if (!walFile.is_open()) {
-            cerr << "Error: Could not open WAL file for writing." << endl;
-            return;
+    // Applies every put and delete in batch as one write: it is logged as a
+    // single WAL record, so a crash recovers all of it or none, and no other
+    // write lands between its entries. Readers see all of it or none, since it
+    // only becomes visible once every entry is in the memtable. Returns false
+    // if the WAL could not be written or the sync mode was rejected, in which
+    // case nothing was applied.
+    bool write(const WriteBatch& batch, const WriteOptions& writeOptions = WriteOptions()) {
+        if (batch.empty()) {
+            return true;
         }
-        walFile << key << " " << TOMBSTONE << "\n";
-        walFile.close();
-
-        // 2. Insert tombstone into memtable
-        memtable.insert(key, TOMBSTONE);
-        memtableSize += key.length() + TOMBSTONE.length();
-        cout << "Deleted key '" << key << "'. Current memtable size: " << memtableSize << " bytes." << endl;
+        auto start = high_resolution_clock::now();
 
-        if (memtableSize > MEMTABLE_THRESHOLD) {
-            flushToSSTable();
+        size_t size = applyBatch(batch, writeOptions);
+        if (size == 0) {
+            return false;
         }
+
+        auto end = high_resolution_clock::now();
+        duration<double, milli> duration = end - start;
+        LOG_DEBUG("Wrote batch", "entries", batch.count(), "ms", duration.count(), "memtable_bytes", size);
+        return true;
+    }
+
+    string getKey(const string& key, const ReadOptions& readOptions = ReadOptions()) {
+        PinnedValue value;
+        return getKey(key, value, readOptions) ? value.toString() : "Key not found.";
     }
 
-    string getKey(const string& key) {
-        // 1. Search in memtable
-        try {
-            string value = memtable.search(key);
-            if (value == TOMBSTONE) {
-                cout << "[INFO] Key '" << key << "' found in memtable as a tombstone." << endl;
-                return "Key not found.";
+    // Looks up key without copying its value: on success value points into the
+    // memtable or SSTable block that holds it, and keeps that alive. Returns
+    // false if the key is absent or deleted.
+    bool getKey(const string& key, PinnedValue& value, const ReadOptions& readOptions = ReadOptions()) {
+        uint64_t snapshot = readSequence(readOptions);
+
+        // 1. Search the active memtable, then the queued ones from newest to oldest
+        string_view found;
+        RecordType type;
+        shared_ptr<Memtable> active;
+        shared_ptr<const vector<ImmutableMemtable>> immutables;
+        {
+            shared_lock<shared_mutex> lock(memtableMutex);
+            active = memtable;
+            immutables = immutableMemtables;
+        }
+        shared_ptr<Memtable> holder = active;
+        bool inMemtable = active->search(key, snapshot, type, found);
+        for (auto it = immutables->rbegin(); !inMemtable && it != immutables->rend(); ++it) {
+            holder = it->table;
+            inMemtable = holder->search(key, snapshot, type, found);
+        }
+        if (inMemtable) {
+            if (type == RecordType::DELETION) {
+                LOG_DEBUG("Key found in memtable as a tombstone", "key", key);
+                return false;
             }
-            cout << "[INFO] Key '" << key << "' found in memtable." << endl;
-            return value;
-        } catch (const runtime_error& e) {
-            // Key not in memtable, proceed to search SSTables
+            LOG_DEBUG("Key found in memtable", "key", key);
+            value = PinnedValue(found, holder);
+            return true;
         }
 
-        cout << "[INFO] Key '" << key << "' not in memtable. Searching SSTables..." << endl;
+        LOG_DEBUG("Key not in memtable; searching SSTables", "key", key);
         auto start = high_resolution_clock::now();
 
-        // 2. Search in SSTables using the sparse index (from newest to oldest)
-        for (auto it = sstableIndices.rbegin(); it != sstableIndices.rend(); ++it) {
-            const auto& index = *it;
-            
-            // Find the latest key in the sparse index that is less than or equal to the target key
-            auto sparseIt = index.sparseIndex.upper_bound(key);
-            if (sparseIt != index.sparseIndex.begin()) {
-                --sparseIt; // This gives us the starting point for our scan
-            } else if (!index.sparseIndex.empty() && key < index.sparseIndex.begin()->first) {
-                // If the key is smaller than the first indexed key, it won't be in this file
+        // 2. Search the SSTables from newest to oldest: every level 0 table, then
+        // the one table per level whose range holds the key. Each checks its
+        // Bloom filter in memory, then reads at most one block, from the block
+        // cache if it is there.
+        shared_ptr<const Version> current = currentVersion();
+        vector<const SSTable*> candidates;
+        for (auto it = current->levels[0].rbegin(); it != current->levels[0].rend(); ++it) {
+            candidates.push_back(it->get());
+        }
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            if (const SSTable* table = current->findTable(level, key)) {
+                candidates.push_back(table);
+            }
+        }
+        for (const SSTable* table : candidates) {
+            LookupResult result = table->get(key, snapshot, value, &filterStats);
+            if (result == LookupResult::IO_ERROR) {
+                LOG_ERROR("Could not read SSTable file", "file", table->fileName());
                 continue;
             }
-
-
-            ifstream sstableFile(index.filename);
-            if (!sstableFile.is_open()) {
-                cerr << "[ERROR] Could not open SSTable file: " << index.filename << endl;
+            if (result == LookupResult::NOT_FOUND) {
                 continue;
             }
 
-            // Seek to the offset provided by the sparse index
-            if (sparseIt != index.sparseIndex.end()) {
-                sstableFile.seekg(sparseIt->second);
-            }
+            auto end = high_resolution_clock::now();
+            duration<double, milli> duration = end - start;
+            LOG_DEBUG("Key found in SSTables", "key", key, "ms", duration.count());
 
+            return result == LookupResult::FOUND;
+        }
+
+        auto end = high_resolution_clock::now();
+        duration<double, milli> duration = end - start;
+        LOG_DEBUG("Key not found in SSTables", "key", key, "ms", duration.count());
 
-            string line;
-            while (getline(sstableFile, line)) {
-                stringstream ss(line);
-                string fileKey, fileValue;
-                ss >> fileKey;
-                
-                if (sparseIt != index.sparseIndex.end()) {
-                    auto nextIt = next(sparseIt, 1);
-                    if (nextIt != index.sparseIndex.end() && fileKey >= nextIt->first) {
-                        // Optimization: if we've passed our key and are into the next indexed block, stop.
-                        break;
+        return false;
+    }
+
+    // Looks up many keys at once, returning one result per key in the order
+    // given: its pinned value, or nothing if it is absent or deleted. The keys
+    // are sorted and resolved from the memtables where possible; each SSTable
+    // that can hold any of the rest is then probed once for all of them. All
+    // keys are read at the same sequence number.
+    vector<optional<PinnedValue>> multiGet(const vector<string>& keys, const ReadOptions& readOptions = ReadOptions()) {
+        uint64_t snapshot = readSequence(readOptions);
+        vector<optional<PinnedValue>> results(keys.size());
+        vector<KeyLookup> lookups(keys.size());
+        vector<KeyLookup*> pending; // Unresolved, in key order
+        for (size_t i = 0; i < keys.size(); i++) {
+            lookups[i].key = keys[i];
+            pending.push_back(&lookups[i]);
+        }
+        sort(pending.begin(), pending.end(), [](const KeyLookup* a, const KeyLookup* b) { return a->key < b->key; });
+        auto resultFor = [&](const KeyLookup* lookup) -> optional<PinnedValue>& { return results[lookup - lookups.data()]; };
+
+        // 1. The memtables, newest first
+        vector<shared_ptr<Memtable>> memtables;
+        {
+            shared_lock<shared_mutex> lock(memtableMutex);
+            memtables.push_back(memtable);
+            for (auto it = immutableMemtables->rbegin(); it != immutableMemtables->rend(); ++it) {
+                memtables.push_back(it->table);
+            }
+        }
+        vector<KeyLookup*> unresolved;
+        for (KeyLookup* lookup : pending) {
+            bool found = false;
+            for (const auto& table : memtables) {
+                string_view value;
+                RecordType type;
+                if (table->search(keys[lookup - lookups.data()], snapshot, type, value)) {
+                    if (type == RecordType::PUT) {
+                        resultFor(lookup) = PinnedValue(value, table);
                     }
+                    found = true;
+                    break;
                 }
+            }
+            if (!found) {
+                unresolved.push_back(lookup);
+            }
+        }
+        pending.swap(unresolved);
 
-                getline(ss, fileValue);
-                // Remove leading space from value
-                if (!fileValue.empty() && fileValue[0] == ' ') {
-                    fileValue.erase(0, 1);
+        // 2. The SSTables, newest first, each with the pending keys its range
+        // can hold
+        shared_ptr<const Version> current = currentVersion();
+        auto probe = [&](const SSTable& table, const vector<KeyLookup*>& batch) {
+            table.multiGet(batch, snapshot, &filterStats);
+            for (KeyLookup* lookup : batch) {
+                if (lookup->result == LookupResult::IO_ERROR) {
+                    LOG_ERROR("Could not read SSTable file", "file", table.fileName());
+                } else if (lookup->result == LookupResult::FOUND) {
+                    resultFor(lookup) = move(lookup->value);
+                }
+            }
+            auto resolved = [](const KeyLookup* lookup) {
+                return lookup->result == LookupResult::FOUND || lookup->result == LookupResult::DELETED;
+            };
+            pending.erase(remove_if(pending.begin(), pending.end(), resolved), pending.end());
+        };
+        for (auto it = current->levels[0].rbegin(); it != current->levels[0].rend() && !pending.empty(); ++it) {
+            probe(**it, pending);
+        }
+        for (int level = 1; level < NUM_LEVELS && !pending.empty(); level++) {
+            // Tables of a level don't overlap, so each takes a contiguous run of keys
+            vector<pair<const SSTable*, vector<KeyLookup*>>> batches;
+            for (KeyLookup* lookup : pending) {
+                const SSTable* table = current->findTable(level, lookup->key);
+                if (!table) {
+                    continue;
+                }
+                if (batches.empty() || batches.back().first != table) {
+                    batches.emplace_back(table, vector<KeyLookup*>());
                 }
+                batches.back().second.push_back(lookup);
+            }
+            for (const auto& [table, batch] : batches) {
+                probe(*table, batch);
+            }
+        }
+        return results;
+    }
 
-                if (fileKey == key) {
-                    sstableFile.close();
-                    auto end = high_resolution_clock::now();
-                    duration<double, milli> duration = end - start;
-                    cout << "[PERF] SSTable read for '" << key << "' took " << duration.count() << " ms." << endl;
+    // Cursor over the live keys in order (see StoreIterator), at readOptions'
+    // snapshot or else at the writes visible when it is created, and
+    // restricted to a prefix if readOptions has one. With the red-black tree
+    // memtable it holds the memtables' read locks, so writes wait until it is
+    // destroyed: keep it short-lived, and don't write from the thread that
+    // holds it.
+    unique_ptr<EntryIterator> newIterator(const ReadOptions& readOptions = ReadOptions()) {
+        uint64_t snapshot = readSequence(readOptions);
+        vector<shared_ptr<Memtable>> memtables;
+        {
+            shared_lock<shared_mutex> lock(memtableMutex);
+            memtables.push_back(memtable);
+            for (const auto& immutable : *immutableMemtables) {
+                memtables.push_back(immutable.table);
+            }
+        }
+        // Taken after the memtables: a memtable flushed in between shows up
+        // twice, which the merge hides, rather than not at all
+        shared_ptr<const Version> current = currentVersion();
 
-                    if (fileValue == TOMBSTONE) {
-                        return "Key not found.";
-                    }
-                    return fileValue;
+        const string& prefix = readOptions.prefix;
+        auto mayHoldPrefix = [&](const SSTable& table) {
+            return prefix.empty() || table.mayContainPrefix(prefix, options.prefixExtractor.get(), &prefixFilterStats);
+        };
+        vector<unique_ptr<EntryIterator>> children;
+        for (const auto& table : memtables) {
+            children.push_back(table->newIterator());
+        }
+        for (const auto& table : current->levels[0]) {
+            if (mayHoldPrefix(*table)) {
+                children.push_back(table->newIterator());
+            }
+        }
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            vector<shared_ptr<SSTable>> tables;
+            for (const auto& table : current->levels[level]) {
+                if (mayHoldPrefix(*table)) {
+                    tables.push_back(table);
                 }
             }
-            sstableFile.close();
+            if (!tables.empty()) {
+                children.push_back(make_unique<LevelIterator>(move(tables)));
+            }
         }
+        return make_unique<StoreIterator>(move(memtables), move(current), move(children), snapshot, prefix);
+    }
 
-        auto end = high_resolution_clock::now();
-        duration<double, milli> duration = end - start;
-        cout << "[PERF] SSTable search for '" << key << "' (not found) took " << duration.count() << " ms." << endl;
+    // Calls visit on each live key in [start, end) in order, with its value,
+    // until limit keys have been visited or visit returns false. An empty end
+    // means no upper bound and a limit of 0 no limit; a prefix in readOptions
+    // narrows the range further. Returns false if an SSTable could not be read.
+    bool scan(const string& start, const string& end, size_t limit, const function<bool(string_view key, string_view value)>& visit,
+              const ReadOptions& readOptions = ReadOptions()) {
+        unique_ptr<EntryIterator> it = newIterator(readOptions);
+        size_t visited = 0;
+        for (it->seek(start); it->valid() && (end.empty() || it->key() < end); it->next()) {
+            if (!visit(it->key(), it->value()) || ++visited == limit) {
+                break;
+            }
+        }
+        if (it->failed()) {
+            LOG_ERROR("Could not read an SSTable during scan");
+            return false;
+        }
+        return true;
+    }
 
-        return "Key not found.";
+    // Pins the current state of the store: reads given the snapshot in their
+    // ReadOptions ignore every later write. The versions it reads are kept
+    // through flushes and compactions, so release it with releaseSnapshot()
+    // once done.
+    const Snapshot* getSnapshot() {
+        lock_guard<mutex> lock(snapshotMutex);
+        auto snapshot = new Snapshot(visibleSequence.load());
+        liveSnapshots.emplace(snapshot, snapshot->sequence());
+        return snapshot;
+    }
+
+    // Ignores null. A snapshot this store doesn't hold, such as one already
+    // released or taken from another store, is logged and left alone; it is
+    // looked up by address, so it is never dereferenced.
+    void releaseSnapshot(const Snapshot* snapshot) {
+        if (snapshot == nullptr) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(snapshotMutex);
+            if (liveSnapshots.erase(snapshot) == 0) {
+                LOG_ERROR("Released a snapshot the store does not hold");
+                return;
+            }
+        }
+        delete snapshot;
+    }
+
+    KVStoreStats getStats() const {
+        KVStoreStats stats;
+        stats.bloomHits = filterStats.hits.load(memory_order_relaxed);
+        stats.bloomMisses = filterStats.misses.load(memory_order_relaxed);
+        stats.bloomFalsePositives = filterStats.falsePositives.load(memory_order_relaxed);
+        stats.prefixBloomHits = prefixFilterStats.hits.load(memory_order_relaxed);
+        stats.prefixBloomMisses = prefixFilterStats.misses.load(memory_order_relaxed);
+        stats.flushBytesWritten = flushBytesWritten.load();
+        stats.compactionBytesRead = compactionBytesRead.load();
+        stats.compactionBytesWritten = compactionBytesWritten.load();
+        stats.compactions = compactionsCompleted.load();
+        stats.runningCompactions = compactionsRunning.load();
+        if (stats.flushBytesWritten > 0) {
+            stats.writeAmplification = static_cast<double>(stats.flushBytesWritten + stats.compactionBytesWritten) / stats.flushBytesWritten;
+        }
+        shared_ptr<const Version> current = currentVersion();
+        for (int level = 0; level < NUM_LEVELS; level++) {
+            LevelStats levelStats;
+            levelStats.tables = current->levels[level].size();
+            levelStats.bytes = current->levelBytes(level);
+            levelStats.score = compactionPicker->score(*current, level);
+            stats.levels.push_back(levelStats);
+        }
+        if (blockCache) {
+            stats.blockCache = blockCache->getStats();
+        }
+        if (tableCache) {
+            stats.tableCache = tableCache->getStats();
+        }
+        return stats;
     }
 };
\ No newline at end of file
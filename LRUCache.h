@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Counters reported by LRUCache::getStats()
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t inserts = 0;
+    uint64_t evictions = 0;
+    uint64_t usage = 0;    // Sum of the charges of the cached values
+    uint64_t capacity = 0;
+};
+
+// Capacity-bounded cache shared by many threads. It is split into shards by
+// key hash, each with its own lock and LRU list, so concurrent lookups rarely
+// contend. Every value has a charge (bytes for the block cache, 1 for the
+// table cache) and each shard holds about capacity / SHARD_COUNT of it.
+//
+// Values are handed out as shared pointers: evicting one only drops the
+// cache's reference, and a reader still using it keeps it alive.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LRUCache {
+private:
+    static const size_t SHARD_COUNT = 16;
+
+    struct Entry {
+        Key key;
+        std::shared_ptr<const Value> value;
+        size_t charge;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru; // Most recently used first
+        std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> entries;
+        size_t usage = 0;
+    };
+
+    size_t capacity;
+    size_t shardCapacity;
+    Shard shards[SHARD_COUNT];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> inserts{0};
+    std::atomic<uint64_t> evictions{0};
+
+    Shard& shardFor(const Key& key) { return shards[Hash()(key) % SHARD_COUNT]; }
+
+public:
+    explicit LRUCache(size_t capacity)
+        : capacity(capacity), shardCapacity((capacity + SHARD_COUNT - 1) / SHARD_COUNT) {}
+
+    LRUCache(const LRUCache&) = delete;
+    LRUCache& operator=(const LRUCache&) = delete;
+
+    // Returns the cached value, or null on a miss
+    std::shared_ptr<const Value> lookup(const Key& key);
+
+    // Adds a value, replacing any value cached under the same key, and evicts
+    // the shard's least recently used values until it fits again
+    void insert(const Key& key, std::shared_ptr<const Value> value, size_t charge);
+
+    // Drops the value cached under key, if any
+    void erase(const Key& key);
+
+    CacheStats getStats();
+};
+
+
+// ----------------------------------------------------------------------------
+// --- IMPLEMENTATIONS
+// ----------------------------------------------------------------------------
+
+template <typename Key, typename Value, typename Hash>
+std::shared_ptr<const Value> LRUCache<Key, Value, Hash>::lookup(const Key& key) {
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return it->second->value;
+}
+
+template <typename Key, typename Value, typename Hash>
+void LRUCache<Key, Value, Hash>::insert(const Key& key, std::shared_ptr<const Value> value, size_t charge) {
+    if (charge > shardCapacity) {
+        return; // Would evict everything else and still not fit
+    }
+
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto existing = shard.entries.find(key);
+    if (existing != shard.entries.end()) {
+        shard.usage -= existing->second->charge;
+        shard.lru.erase(existing->second);
+        shard.entries.erase(existing);
+    }
+    shard.lru.push_front(Entry{key, std::move(value), charge});
+    shard.entries[key] = shard.lru.begin();
+    shard.usage += charge;
+    inserts.fetch_add(1, std::memory_order_relaxed);
+
+    while (shard.usage > shardCapacity) {
+        Entry& victim = shard.lru.back();
+        shard.usage -= victim.charge;
+        shard.entries.erase(victim.key);
+        shard.lru.pop_back();
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+template <typename Key, typename Value, typename Hash>
+void LRUCache<Key, Value, Hash>::erase(const Key& key) {
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        shard.usage -= it->second->charge;
+        shard.lru.erase(it->second);
+        shard.entries.erase(it);
+    }
+}
+
+template <typename Key, typename Value, typename Hash>
+CacheStats LRUCache<Key, Value, Hash>::getStats() {
+    CacheStats stats;
+    stats.hits = hits.load(std::memory_order_relaxed);
+    stats.misses = misses.load(std::memory_order_relaxed);
+    stats.inserts = inserts.load(std::memory_order_relaxed);
+    stats.evictions = evictions.load(std::memory_order_relaxed);
+    stats.capacity = capacity;
+    for (Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        stats.usage += shard.usage;
+    }
+    return stats;
+}
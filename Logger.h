@@ -0,0 +1,491 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <unistd.h>
+
+// Asynchronous structured logging.
+//
+//   LOG_INFO("Memtable flushed", "file", filename, "entries", entries);
+//
+// logs an event with key/value fields. The event and the field names must be
+// string literals; values may be integers, floating point numbers, bools and
+// anything that converts to a string_view.
+//
+// A logging thread does no formatting, no locking and no I/O: it copies the
+// raw values into a record in its own ring buffer, a single-producer
+// single-consumer queue, and returns. A background thread sleeps until the
+// first record after its last drain wakes it, then drains every thread's
+// buffer, formats the records in timestamp order and writes them out with one
+// write() per drain. Later records see the wakeup already pending with one
+// relaxed load, so a busy logging thread rarely touches a mutex. If a thread's
+// buffer is full, its records are dropped rather than waited for, and the
+// drop is reported once there is room.
+//
+// Levels below FASTKV_LOG_MIN_LEVEL (0 DEBUG, 1 INFO, 2 WARN, 3 ERROR; default
+// 0) are removed at compile time, arguments and all. The rest can be filtered
+// at runtime with setLevel() or the FASTKV_LOG_LEVEL environment variable
+// (debug, info, warn, error or off; default info), at the cost of one relaxed
+// load per disabled call. Output goes to stdout as text lines by default;
+// FASTKV_LOG_FORMAT=json, or setFormat(), switches to one JSON object per line.
+
+enum class LogLevel : uint8_t { DEBUG = 0, INFO = 1, WARN = 2, ERROR = 3, OFF = 4 };
+
+enum class LogFormat { TEXT, JSON };
+
+#ifndef FASTKV_LOG_MIN_LEVEL
+#define FASTKV_LOG_MIN_LEVEL 0
+#endif
+
+constexpr LogLevel COMPILED_LOG_LEVEL = static_cast<LogLevel>(FASTKV_LOG_MIN_LEVEL);
+
+// Bytes of records each thread can have waiting for the background thread;
+// a power of two
+const size_t LOG_BUFFER_SIZE = 256 * 1024;
+// Longer string values are cut to this many bytes
+const size_t LOG_MAX_STRING = 1024;
+// The background thread drains at least this often even if never woken. A
+// record that races with the end of a drain, seeing the wakeup still pending
+// just as it is cleared, waits at most this long.
+const std::chrono::milliseconds LOG_IDLE_DRAIN{50};
+
+// One thread's queue of encoded records. Only its thread pushes and only the
+// background thread drains, so head and tail need no lock.
+class LogBuffer {
+private:
+    std::unique_ptr<char[]> data{new char[LOG_BUFFER_SIZE]};
+    alignas(64) std::atomic<uint64_t> head{0}; // Bytes ever pushed
+    alignas(64) std::atomic<uint64_t> tail{0}; // Bytes ever drained
+
+public:
+    const uint32_t thread;            // Shown in the output
+    std::atomic<uint64_t> dropped{0}; // Records that found the buffer full
+    std::atomic<bool> abandoned{false}; // Its thread has exited
+
+    explicit LogBuffer(uint32_t thread) : thread(thread) {}
+
+    void push(std::string_view record) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        uint64_t t = tail.load(std::memory_order_acquire);
+        if (record.size() > LOG_BUFFER_SIZE - (h - t)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        size_t offset = h & (LOG_BUFFER_SIZE - 1);
+        size_t first = std::min(record.size(), LOG_BUFFER_SIZE - offset);
+        memcpy(data.get() + offset, record.data(), first);
+        memcpy(data.get(), record.data() + first, record.size() - first);
+        head.store(h + record.size(), std::memory_order_release);
+    }
+
+    // Appends every pushed record to out
+    void drain(std::string& out) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        size_t offset = t & (LOG_BUFFER_SIZE - 1);
+        size_t first = std::min<size_t>(h - t, LOG_BUFFER_SIZE - offset);
+        out.append(data.get() + offset, first);
+        out.append(data.get(), h - t - first);
+        tail.store(h, std::memory_order_release);
+    }
+};
+
+// A decoded field of a record
+struct LogField {
+    const char* key = nullptr;
+    char type = 's'; // 'i' int64, 'u' uint64, 'd' double, 'b' bool, 's' string
+    int64_t i = 0;
+    uint64_t u = 0;
+    double d = 0;
+    std::string_view s;
+};
+
+class Logger {
+private:
+    std::atomic<LogLevel> level{LogLevel::INFO};
+    std::atomic<LogFormat> format{LogFormat::TEXT};
+    std::atomic<int> outputFd{STDOUT_FILENO};
+
+    std::mutex registryMutex;
+    std::vector<std::shared_ptr<LogBuffer>> buffers;
+    uint32_t nextThread = 1;
+
+    // Held while draining, so the background thread and flush() take turns
+    // as the buffers' one consumer
+    std::mutex drainMutex;
+    // The background thread waits on drainWake under wakeMutex until
+    // drainPending is set. Loggers set it once per drain and only then lock
+    // wakeMutex to notify, so a wakeup can't slip in before the wait.
+    std::mutex wakeMutex;
+    std::condition_variable drainWake;
+    std::atomic<bool> drainPending{false};
+    std::string drained;    // Raw records of the current drain
+    std::string formatted;  // Their output
+
+    template <typename T>
+    static void appendRaw(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static T readRaw(const char*& p) {
+        T value;
+        memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return value;
+    }
+
+    static void appendValue(std::string& out, std::string_view value) {
+        value = value.substr(0, LOG_MAX_STRING);
+        out.push_back('s');
+        appendRaw(out, static_cast<uint32_t>(value.size()));
+        out.append(value);
+    }
+
+    template <typename T>
+    static void appendValue(std::string& out, const T& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+            out.push_back('b');
+            out.push_back(value ? 1 : 0);
+        } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            out.push_back('i');
+            appendRaw(out, static_cast<int64_t>(value));
+        } else if constexpr (std::is_integral_v<T>) {
+            out.push_back('u');
+            appendRaw(out, static_cast<uint64_t>(value));
+        } else if constexpr (std::is_floating_point_v<T>) {
+            out.push_back('d');
+            appendRaw(out, static_cast<double>(value));
+        } else {
+            static_assert(std::is_convertible_v<const T&, std::string_view>, "log field values must be numbers, bools or strings");
+            appendValue(out, std::string_view(value));
+        }
+    }
+
+    static void appendFields(std::string&) {}
+
+    template <typename Value, typename... Rest>
+    static void appendFields(std::string& out, const char* key, const Value& value, const Rest&... rest) {
+        appendRaw(out, key);
+        appendValue(out, value);
+        appendFields(out, rest...);
+    }
+
+    // The calling thread's buffer, registered on its first record
+    LogBuffer& threadBuffer() {
+        thread_local struct Handle {
+            std::shared_ptr<LogBuffer> buffer;
+            ~Handle() {
+                if (buffer) {
+                    buffer->abandoned.store(true, std::memory_order_release);
+                }
+            }
+        } handle;
+        if (!handle.buffer) {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            handle.buffer = std::make_shared<LogBuffer>(nextThread++);
+            buffers.push_back(handle.buffer);
+        }
+        return *handle.buffer;
+    }
+
+    static const char* levelName(LogLevel level) {
+        switch (level) {
+        case LogLevel::DEBUG: return "DEBUG";
+        case LogLevel::INFO: return "INFO";
+        case LogLevel::WARN: return "WARN";
+        case LogLevel::ERROR: return "ERROR";
+        default: return "OFF";
+        }
+    }
+
+    static void appendTime(std::string& out, int64_t nanos, bool json) {
+        time_t seconds = nanos / 1000000000;
+        tm utc;
+        gmtime_r(&seconds, &utc);
+        char text[40];
+        size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(text + length, sizeof(text) - length, ".%06dZ", static_cast<int>(nanos % 1000000000 / 1000));
+        out.append(json ? "\"" : "").append(text).append(json ? "\"" : "");
+    }
+
+    // Text values are quoted only when they would not read back as one token
+    static void appendText(std::string& out, std::string_view value) {
+        bool plain = !value.empty() && std::all_of(value.begin(), value.end(), [](char c) {
+            return c > ' ' && c < 127 && c != '"' && c != '=' && c != '\\';
+        });
+        if (plain) {
+            out.append(value);
+            return;
+        }
+        out.push_back('"');
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                out.push_back('\\');
+                out.push_back(c);
+            } else if (c >= ' ' && c < 127) {
+                out.push_back(c);
+            } else {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\x%02x", c);
+                out.append(escaped);
+            }
+        }
+        out.push_back('"');
+    }
+
+    // Bytes that are not printable ASCII are escaped as \u00XX, so binary
+    // keys still give valid JSON
+    static void appendJSON(std::string& out, std::string_view value) {
+        out.push_back('"');
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                out.push_back('\\');
+                out.push_back(c);
+            } else if (c >= ' ' && c < 127) {
+                out.push_back(c);
+            } else {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out.append(escaped);
+            }
+        }
+        out.push_back('"');
+    }
+
+    void formatRecord(std::string& out, int64_t nanos, LogLevel recordLevel, uint32_t thread, const char* event, const std::vector<LogField>& fields) {
+        bool json = format.load(std::memory_order_relaxed) == LogFormat::JSON;
+        char number[32];
+        if (json) {
+            out.append("{\"time\":");
+            appendTime(out, nanos, true);
+            out.append(",\"level\":\"").append(levelName(recordLevel)).append("\",\"thread\":").append(std::to_string(thread));
+            out.append(",\"event\":");
+            appendJSON(out, event);
+        } else {
+            appendTime(out, nanos, false);
+            out.append(" ").append(levelName(recordLevel)).append(" [").append(std::to_string(thread)).append("] ").append(event);
+        }
+        for (const LogField& field : fields) {
+            if (json) {
+                out.append(",");
+                appendJSON(out, field.key);
+                out.append(":");
+            } else {
+                out.append(" ").append(field.key).append("=");
+            }
+            switch (field.type) {
+            case 'i': out.append(std::to_string(field.i)); break;
+            case 'u': out.append(std::to_string(field.u)); break;
+            case 'b': out.append(field.u ? "true" : "false"); break;
+            case 'd':
+                snprintf(number, sizeof(number), "%.6g", field.d);
+                out.append(number);
+                break;
+            default:
+                json ? appendJSON(out, field.s) : appendText(out, field.s);
+                break;
+            }
+        }
+        out.append(json ? "}\n" : "\n");
+    }
+
+    // Takes every waiting record from every buffer and writes them out in
+    // timestamp order. drainMutex must be held.
+    void drainLocked() {
+        std::vector<std::shared_ptr<LogBuffer>> current;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            current = buffers;
+        }
+        struct Record {
+            int64_t nanos;
+            size_t begin, end; // Of its formatted text
+        };
+        std::vector<Record> records;
+        std::string unordered;
+        std::vector<LogField> fields;
+        for (const auto& buffer : current) {
+            bool abandoned = buffer->abandoned.load(std::memory_order_acquire);
+            drained.clear();
+            buffer->drain(drained);
+            const char* p = drained.data();
+            const char* limit = p + drained.size();
+            while (p < limit) {
+                const char* next = p + readRaw<uint32_t>(p);
+                int64_t nanos = readRaw<int64_t>(p);
+                LogLevel recordLevel = static_cast<LogLevel>(*p++);
+                const char* event = readRaw<const char*>(p);
+                fields.clear();
+                while (p < next) {
+                    LogField field;
+                    field.key = readRaw<const char*>(p);
+                    field.type = *p++;
+                    switch (field.type) {
+                    case 'i': field.i = readRaw<int64_t>(p); break;
+                    case 'u': field.u = readRaw<uint64_t>(p); break;
+                    case 'd': field.d = readRaw<double>(p); break;
+                    case 'b': field.u = static_cast<uint8_t>(*p++); break;
+                    default: {
+                        uint32_t length = readRaw<uint32_t>(p);
+                        field.s = std::string_view(p, length);
+                        p += length;
+                        break;
+                    }
+                    }
+                    fields.push_back(field);
+                }
+                size_t begin = unordered.size();
+                formatRecord(unordered, nanos, recordLevel, buffer->thread, event, fields);
+                records.push_back({nanos, begin, unordered.size()});
+            }
+            if (uint64_t dropped = buffer->dropped.exchange(0, std::memory_order_relaxed)) {
+                LogField count;
+                count.key = "count";
+                count.type = 'u';
+                count.u = dropped;
+                int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+                size_t begin = unordered.size();
+                formatRecord(unordered, now, LogLevel::WARN, buffer->thread, "Log buffer full; records dropped", {count});
+                records.push_back({now, begin, unordered.size()});
+            }
+            if (abandoned) {
+                std::lock_guard<std::mutex> lock(registryMutex);
+                buffers.erase(std::find(buffers.begin(), buffers.end(), buffer));
+            }
+        }
+        if (records.empty()) {
+            return;
+        }
+
+        std::stable_sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.nanos < b.nanos; });
+        formatted.clear();
+        for (const Record& record : records) {
+            formatted.append(unordered, record.begin, record.end - record.begin);
+        }
+        int fd = outputFd.load(std::memory_order_relaxed);
+        for (size_t written = 0; written < formatted.size();) {
+            ssize_t n = ::write(fd, formatted.data() + written, formatted.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break; // Nowhere to report it
+            }
+            written += n;
+        }
+    }
+
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                drainWake.wait_for(lock, LOG_IDLE_DRAIN, [this] { return drainPending.load(std::memory_order_relaxed); });
+            }
+            // Cleared before draining: a record pushed from here on wakes the
+            // next round, one pushed before it is drained now
+            drainPending.store(false, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(drainMutex);
+            drainLocked();
+        }
+    }
+
+    void wakeDrain() {
+        if (drainPending.load(std::memory_order_relaxed) || drainPending.exchange(true, std::memory_order_relaxed)) {
+            return; // Already woken for this round
+        }
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        drainWake.notify_one();
+    }
+
+    Logger() {
+        if (const char* name = getenv("FASTKV_LOG_LEVEL")) {
+            std::string_view value(name);
+            level = value == "debug" ? LogLevel::DEBUG
+                  : value == "warn"  ? LogLevel::WARN
+                  : value == "error" ? LogLevel::ERROR
+                  : value == "off"   ? LogLevel::OFF
+                                     : LogLevel::INFO;
+        }
+        if (const char* name = getenv("FASTKV_LOG_FORMAT")) {
+            format = std::string_view(name) == "json" ? LogFormat::JSON : LogFormat::TEXT;
+        }
+        std::thread([this] { run(); }).detach();
+    }
+
+public:
+    // The process-wide logger. It is never destroyed, since other threads may
+    // still log while the process exits; what they logged before exit() is
+    // flushed by then.
+    static Logger& instance() {
+        static Logger* logger = new Logger();
+        static struct FlushAtExit {
+            ~FlushAtExit() { logger->flush(); }
+        } flushAtExit;
+        return *logger;
+    }
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    bool enabled(LogLevel recordLevel) const { return recordLevel >= level.load(std::memory_order_relaxed); }
+
+    LogLevel getLevel() const { return level.load(); }
+    void setLevel(LogLevel newLevel) { level = newLevel; }
+    void setFormat(LogFormat newFormat) { format = newFormat; }
+    // Where records are written; the caller keeps fd open
+    void setOutput(int fd) { outputFd = fd; }
+
+    // Queues a record on the calling thread's buffer. Use the LOG_* macros,
+    // which skip this for disabled levels.
+    template <typename... Fields>
+    void log(LogLevel recordLevel, const char* event, const Fields&... fields) {
+        static_assert(sizeof...(Fields) % 2 == 0, "log fields come in name, value pairs");
+        thread_local std::string record;
+        record.assign(sizeof(uint32_t), '\0'); // Length, filled in below
+        appendRaw(record, static_cast<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count()));
+        record.push_back(static_cast<char>(recordLevel));
+        appendRaw(record, event);
+        appendFields(record, fields...);
+        uint32_t length = static_cast<uint32_t>(record.size());
+        memcpy(record.data(), &length, sizeof(length));
+        threadBuffer().push(record);
+        wakeDrain();
+    }
+
+    // Writes out every record queued so far
+    void flush() {
+        std::lock_guard<std::mutex> lock(drainMutex);
+        drainLocked();
+    }
+};
+
+#define FASTKV_LOG(recordLevel, ...)                                                   \
+    do {                                                                              \
+        if constexpr ((recordLevel) >= COMPILED_LOG_LEVEL) {                          \
+            if (Logger::instance().enabled(recordLevel)) {                            \
+                Logger::instance().log((recordLevel), __VA_ARGS__);                   \
+            }                                                                         \
+        }                                                                             \
+    } while (0)
+
+#define LOG_DEBUG(...) FASTKV_LOG(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) FASTKV_LOG(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) FASTKV_LOG(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) FASTKV_LOG(LogLevel::ERROR, __VA_ARGS__)
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Coding.h"
+
+// Persistent record of which SSTables make up a store.
+//
+// A MANIFEST-<n> file is a log of VersionEdits, each describing one atomic
+// change to the table set: tables added and removed, plus the counters that
+// must survive a restart. An edit is appended and synced before the change it
+// describes takes effect (before obsolete WAL or table files are deleted), so
+// after a crash the manifest never references less than what is on disk. The
+// tables an edit adds are synced, directory entries included, before it is
+// logged, so it never references more either.
+//
+// The CURRENT file names the live manifest. Every open writes a new manifest
+// whose first edit is a snapshot of the whole state, then switches CURRENT to
+// it with an atomic rename, so the log does not grow across restarts.
+//
+// Records are framed like WAL records:
+//   crc32c fixed32 (of the payload) | length varint32 | payload
+// and the payload is a list of tagged fields (see VersionEdit::encode). A torn
+// record at the end is ignored: its edit never took effect. A bad record
+// anywhere else makes the manifest unreadable, since the edits after it did.
+
+// One change to the table set
+struct VersionEdit {
+    std::vector<std::pair<int, uint64_t>> addedTables; // (level, table number)
+    std::vector<uint64_t> removedTables;
+    std::optional<uint64_t> nextTableNumber;
+    std::optional<uint64_t> logNumber;    // WAL files numbered below this are already in tables
+    std::optional<uint64_t> lastSequence; // Highest sequence number stored in a table
+
+    std::string encode() const;
+    bool decode(std::string_view payload);
+};
+
+// The table set and counters described by a manifest
+struct ManifestState {
+    std::map<uint64_t, int> tables; // Table number -> level
+    uint64_t nextTableNumber = 0;
+    uint64_t logNumber = 0;
+    uint64_t lastSequence = 0;
+
+    void apply(const VersionEdit& edit);
+    VersionEdit snapshot() const;
+};
+
+class Manifest {
+private:
+    std::string directory;
+    int fd = -1;
+    uint64_t number = 0; // Of the live MANIFEST file
+    std::mutex mutex;
+
+    std::string manifestPath(uint64_t manifestNumber) const {
+        return directory + "/MANIFEST-" + std::to_string(manifestNumber);
+    }
+
+    bool writeRecord(const VersionEdit& edit);
+    bool syncDirectory() const;
+
+public:
+    explicit Manifest(const std::string& directory) : directory(directory) {}
+    ~Manifest();
+
+    Manifest(const Manifest&) = delete;
+    Manifest& operator=(const Manifest&) = delete;
+
+    // Reads the state from the manifest named by CURRENT. Sets found to false,
+    // leaving state untouched, if the store has no manifest yet. Returns false
+    // if a manifest exists but cannot be fully read; state is then partial and
+    // must not be used.
+    bool load(ManifestState& state, bool& found);
+
+    // Starts a new manifest holding state, points CURRENT at it and deletes the
+    // previous one
+    bool create(const ManifestState& state);
+
+    // Appends an edit and syncs it, after syncing the directory if the edit
+    // adds tables, so no edit names a table file a crash could lose. Safe to
+    // call from several threads.
+    bool logEdit(const VersionEdit& edit);
+};
+
+
+// ----------------------------------------------------------------------------
+// --- IMPLEMENTATIONS
+// ----------------------------------------------------------------------------
+
+namespace manifest_tags {
+const uint32_t ADD_TABLE = 1;         // level varint32, number varint64
+const uint32_t REMOVE_TABLE = 2;      // number varint64
+const uint32_t NEXT_TABLE_NUMBER = 3; // varint64
+const uint32_t LOG_NUMBER = 4;        // varint64
+const uint32_t LAST_SEQUENCE = 5;     // varint64
+}
+
+inline std::string VersionEdit::encode() const {
+    std::string payload;
+    for (const auto& [level, tableNumber] : addedTables) {
+        appendVarint32(payload, manifest_tags::ADD_TABLE);
+        appendVarint32(payload, static_cast<uint32_t>(level));
+        appendVarint64(payload, tableNumber);
+    }
+    for (uint64_t tableNumber : removedTables) {
+        appendVarint32(payload, manifest_tags::REMOVE_TABLE);
+        appendVarint64(payload, tableNumber);
+    }
+    if (nextTableNumber) {
+        appendVarint32(payload, manifest_tags::NEXT_TABLE_NUMBER);
+        appendVarint64(payload, *nextTableNumber);
+    }
+    if (logNumber) {
+        appendVarint32(payload, manifest_tags::LOG_NUMBER);
+        appendVarint64(payload, *logNumber);
+    }
+    if (lastSequence) {
+        appendVarint32(payload, manifest_tags::LAST_SEQUENCE);
+        appendVarint64(payload, *lastSequence);
+    }
+    return payload;
+}
+
+inline bool VersionEdit::decode(std::string_view payload) {
+    const char* p = payload.data();
+    const char* limit = p + payload.size();
+    while (p < limit) {
+        uint32_t tag, level;
+        uint64_t value;
+        if (!decodeVarint32(p, limit, tag)) {
+            return false;
+        }
+        switch (tag) {
+            case manifest_tags::ADD_TABLE:
+                if (!decodeVarint32(p, limit, level) || !decodeVarint64(p, limit, value)) return false;
+                addedTables.emplace_back(static_cast<int>(level), value);
+                break;
+            case manifest_tags::REMOVE_TABLE:
+                if (!decodeVarint64(p, limit, value)) return false;
+                removedTables.push_back(value);
+                break;
+            case manifest_tags::NEXT_TABLE_NUMBER:
+                if (!decodeVarint64(p, limit, value)) return false;
+                nextTableNumber = value;
+                break;
+            case manifest_tags::LOG_NUMBER:
+                if (!decodeVarint64(p, limit, value)) return false;
+                logNumber = value;
+                break;
+            case manifest_tags::LAST_SEQUENCE:
+                if (!decodeVarint64(p, limit, value)) return false;
+                lastSequence = value;
+                break;
+            default:
+                return false; // Unknown tags can't be skipped without a length
+        }
+    }
+    return true;
+}
+
+inline void ManifestState::apply(const VersionEdit& edit) {
+    for (uint64_t tableNumber : edit.removedTables) {
+        tables.erase(tableNumber);
+    }
+    for (const auto& [level, tableNumber] : edit.addedTables) {
+        tables[tableNumber] = level;
+    }
+    if (edit.nextTableNumber) nextTableNumber = std::max(nextTableNumber, *edit.nextTableNumber);
+    if (edit.logNumber) logNumber = std::max(logNumber, *edit.logNumber);
+    if (edit.lastSequence) lastSequence = std::max(lastSequence, *edit.lastSequence);
+}
+
+inline VersionEdit ManifestState::snapshot() const {
+    VersionEdit edit;
+    for (const auto& [tableNumber, level] : tables) {
+        edit.addedTables.emplace_back(level, tableNumber);
+    }
+    edit.nextTableNumber = nextTableNumber;
+    edit.logNumber = logNumber;
+    edit.lastSequence = lastSequence;
+    return edit;
+}
+
+inline Manifest::~Manifest() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+inline bool Manifest::writeRecord(const VersionEdit& edit) {
+    std::string payload = edit.encode();
+    std::string record;
+    appendFixed32(record, crc32c::value(payload.data(), payload.size()));
+    appendVarint32(record, static_cast<uint32_t>(payload.size()));
+    record += payload;
+
+    const char* data = record.data();
+    size_t size = record.size();
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+#if defined(__APPLE__)
+    return ::fsync(fd) == 0;
+#else
+    return ::fdatasync(fd) == 0;
+#endif
+}
+
+// Makes renames and new files in a directory durable: a file's own fsync does
+// not cover its directory entry
+inline bool syncDirectory(const std::string& path) {
+    int dirFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dirFd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(dirFd) == 0;
+    ::close(dirFd);
+    return ok;
+}
+
+inline bool Manifest::syncDirectory() const {
+    return ::syncDirectory(directory);
+}
+
+inline bool Manifest::load(ManifestState& state, bool& found) {
+    std::ifstream current(directory + "/CURRENT");
+    found = current.is_open();
+    if (!found) {
+        return true;
+    }
+    std::string name;
+    if (!std::getline(current, name) || name.size() <= 9 || name.rfind("MANIFEST-", 0) != 0 ||
+        name.find_first_not_of("0123456789", 9) != std::string::npos) {
+        return false; // CURRENT exists, so the tables on disk belong to some manifest
+    }
+    number = std::stoull(name.substr(9));
+
+    std::ifstream file(manifestPath(number), std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const char* p = contents.data();
+    const char* limit = p + contents.size();
+    while (p < limit) {
+        std::string_view payload;
+        VersionEdit edit;
+        if (limit - p < 4) {
+            break; // Torn record
+        }
+        uint32_t expectedCrc = decodeFixed32(p);
+        const char* cursor = p + 4;
+        if (!decodeLengthPrefixed(cursor, limit, payload)) {
+            break; // Torn record: runs past the end of the file
+        }
+        if (crc32c::value(payload.data(), payload.size()) != expectedCrc) {
+            if (cursor == limit) {
+                break; // Torn record: the last one, cut short by a crash
+            }
+            return false; // Corrupt, with edits after it that did take effect
+        }
+        if (!edit.decode(payload)) {
+            return false; // Intact but unreadable: written by a newer version?
+        }
+        state.apply(edit);
+        p = cursor;
+    }
+    return true;
+}
+
+inline bool Manifest::create(const ManifestState& state) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t previous = number;
+    uint64_t next = number + 1;
+    int newFd = ::open(manifestPath(next).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (newFd < 0) {
+        return false;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = newFd;
+    number = next;
+    if (!writeRecord(state.snapshot())) {
+        return false;
+    }
+
+    // Switch CURRENT atomically: write a temporary file, then rename over it
+    std::string tempPath = directory + "/CURRENT.tmp";
+    {
+        std::ofstream current(tempPath, std::ios::trunc);
+        current << "MANIFEST-" << number << "\n";
+        if (!current.flush()) {
+            return false;
+        }
+    }
+    int tempFd = ::open(tempPath.c_str(), O_RDONLY | O_CLOEXEC);
+    bool synced = tempFd >= 0 && ::fsync(tempFd) == 0;
+    if (tempFd >= 0) {
+        ::close(tempFd);
+    }
+    if (!synced || std::rename(tempPath.c_str(), (directory + "/CURRENT").c_str()) != 0 || !syncDirectory()) {
+        return false;
+    }
+    if (previous > 0) {
+        std::remove(manifestPath(previous).c_str());
+    }
+    return true;
+}
+
+inline bool Manifest::logEdit(const VersionEdit& edit) {
+    if (!edit.addedTables.empty() && !syncDirectory()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return fd >= 0 && writeRecord(edit);
+}
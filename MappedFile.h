@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory map of a whole file. The mapping stays valid for the life of
+// the object even if the file is renamed or deleted meanwhile.
+class MappedFile {
+private:
+    const char* base = nullptr;
+    size_t length = 0;
+    bool opened = false;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) == 0) {
+            length = static_cast<size_t>(info.st_size);
+            if (length == 0) {
+                opened = true; // mmap() rejects empty mappings
+            } else {
+                void* mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    base = static_cast<const char*>(mapped);
+                    opened = true;
+                }
+            }
+        }
+        ::close(fd); // The mapping keeps its own reference to the file
+    }
+
+    ~MappedFile() {
+        if (base != nullptr) {
+            ::munmap(const_cast<char*>(base), length);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return opened; }
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+    std::string_view contents() const { return std::string_view(base, length); }
+
+    // Tells the kernel how the mapping will be read (POSIX_MADV_SEQUENTIAL etc.)
+    void advise(int advice) const {
+        if (base != nullptr) {
+            ::posix_madvise(const_cast<char*>(base), length, advice);
+        }
+    }
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include "Arena.h"
+#include "Format.h"
+#include "Iterator.h"
+#include "RBTree.h"
+#include "SkipList.h"
+#include "WriteBatch.h"
+
+// Which data structure backs a KVStore's memtable.
+//  - RBTREE: the red-black tree behind a reader/writer lock. Inserts serialize.
+//  - SKIPLIST: a lock-free skiplist. Inserts from many threads proceed in
+//    parallel and readers never block.
+// Either way, nodes and the bytes of every key and value live in an Arena owned
+// by the memtable, which is released in one step when the memtable is dropped.
+enum class MemtableType { RBTREE, SKIPLIST };
+
+// Common interface of the memtable implementations, so KVStore can hold either.
+// All methods are safe to call from multiple threads at once.
+class Memtable {
+public:
+    virtual ~Memtable() = default;
+
+    // Adds a version of key; a DELETION is stored as a tombstone. seq is the
+    // write's position in the WAL. Older versions are kept for reads at a
+    // snapshot, ordered by seq, so concurrent writers to the same key end up in
+    // log order no matter which one reaches the memtable first.
+    virtual void insert(uint64_t seq, RecordType type, std::string_view key, std::string_view value) = 0;
+
+    // Inserts every entry of batch, the first with sequence number seq and the
+    // rest following on. By default the entries go in one at a time, so a
+    // concurrent reader may see some of them before the rest.
+    virtual void insertBatch(uint64_t seq, const WriteBatch& batch) {
+        batch.forEach([&](RecordType type, std::string_view key, std::string_view value) { insert(seq++, type, key, value); });
+    }
+
+    // Looks up the newest write to key with a seq no higher than snapshot.
+    // Returns false if there is none; otherwise sets type, and for a PUT points
+    // value at its bytes in the arena, which stay put until the memtable is
+    // dropped.
+    virtual bool search(const std::string& key, uint64_t snapshot, RecordType& type, std::string_view& value) const = 0;
+
+    virtual bool empty() const = 0;
+
+    // Bytes of memory held by the memtable: everything its arena has allocated
+    virtual size_t memoryUsage() const = 0;
+
+    // Ordered cursor over every version of every key, newest first within a
+    // key. Must not outlive the memtable.
+    virtual std::unique_ptr<EntryIterator> newIterator() const = 0;
+};
+
+
+// ----------------------------------------------------------------------------
+// --- RED-BLACK TREE MEMTABLE
+// ----------------------------------------------------------------------------
+
+// One version of a key. The tree holds the newest; older ones hang off it,
+// newest first, in the arena.
+struct SequencedValue {
+    uint64_t seq;
+    RecordType type;
+    std::string_view value;
+    const SequencedValue* older;
+};
+
+class RBTreeMemtable : public Memtable {
+private:
+    Arena arena;
+    mutable RBTree<std::string_view, SequencedValue> tree{&arena};
+    mutable std::shared_mutex mutex;
+
+    // Holds a shared lock for as long as it lives, so writers wait for it.
+    class Iterator : public EntryIterator {
+    public:
+        explicit Iterator(const RBTreeMemtable* table) : table(table), lock(table->mutex), node(nullptr), version(nullptr) {}
+
+        bool valid() const override { return node != nullptr; }
+        void seekToFirst() override { moveTo(table->tree.first()); }
+        void seek(std::string_view target) override { moveTo(table->tree.lowerBound(target)); }
+        void next() override {
+            version = version->older;
+            if (version == nullptr) {
+                moveTo(RBTree<std::string_view, SequencedValue>::successor(node));
+            }
+        }
+        std::string_view key() const override { return node->key; }
+        std::string_view value() const override { return version->value; }
+        uint64_t seq() const override { return version->seq; }
+        RecordType type() const override { return version->type; }
+
+    private:
+        const RBTreeMemtable* table;
+        std::shared_lock<std::shared_mutex> lock;
+        Node<std::string_view, SequencedValue>* node;
+        const SequencedValue* version;
+
+        void moveTo(Node<std::string_view, SequencedValue>* target) {
+            node = target;
+            version = node ? &node->value : nullptr;
+        }
+    };
+
+    // A copy of version in the arena, to hang off the chain
+    const SequencedValue* keep(const SequencedValue& version) {
+        return new (arena.allocateAligned(sizeof(SequencedValue))) SequencedValue(version);
+    }
+
+    // Caller must hold mutex exclusively
+    void insertLocked(uint64_t seq, RecordType type, std::string_view key, std::string_view value) {
+        SequencedValue* existing = tree.find(key);
+        if (existing == nullptr) {
+            tree.insert(arena.copy(key), SequencedValue{seq, type, arena.copy(value), nullptr});
+        } else if (existing->seq < seq) {
+            // The newest version lives in the tree node; move the old one down
+            *existing = SequencedValue{seq, type, arena.copy(value), keep(*existing)};
+        } else {
+            // A later write already landed; slot this one in behind it
+            SequencedValue* newer = existing;
+            while (newer->older != nullptr && newer->older->seq > seq) {
+                newer = const_cast<SequencedValue*>(newer->older);
+            }
+            newer->older = keep(SequencedValue{seq, type, arena.copy(value), newer->older});
+        }
+    }
+
+public:
+    void insert(uint64_t seq, RecordType type, std::string_view key, std::string_view value) override {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        insertLocked(seq, type, key, value);
+    }
+
+    // Under one lock, so readers see all of the batch or none of it
+    void insertBatch(uint64_t seq, const WriteBatch& batch) override {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        batch.forEach([&](RecordType type, std::string_view key, std::string_view value) { insertLocked(seq++, type, key, value); });
+    }
+
+    bool search(const std::string& key, uint64_t snapshot, RecordType& type, std::string_view& value) const override {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const SequencedValue* version = tree.find(key);
+        while (version != nullptr && version->seq > snapshot) {
+            version = version->older;
+        }
+        if (version == nullptr) {
+            return false;
+        }
+        type = version->type;
+        value = version->value;
+        return true;
+    }
+
+    bool empty() const override {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return tree.empty();
+    }
+
+    size_t memoryUsage() const override { return arena.memoryUsage(); }
+
+    std::unique_ptr<EntryIterator> newIterator() const override {
+        return std::make_unique<Iterator>(this);
+    }
+};
+
+
+// ----------------------------------------------------------------------------
+// --- SKIPLIST MEMTABLE
+// ----------------------------------------------------------------------------
+
+struct TypedValue {
+    RecordType type;
+    std::string_view value;
+};
+
+class SkipListMemtable : public Memtable {
+private:
+    Arena arena;
+    SkipList<std::string_view, TypedValue> list{arena};
+
+    class Iterator : public EntryIterator {
+    public:
+        explicit Iterator(const SkipList<std::string_view, TypedValue>* list) : it(list) {}
+
+        bool valid() const override { return it.valid(); }
+        void seekToFirst() override { it.seekToFirst(); }
+        void seek(std::string_view target) override { it.seek(target); }
+        void next() override { it.next(); }
+        std::string_view key() const override { return it.key(); }
+        std::string_view value() const override { return it.value().value; }
+        uint64_t seq() const override { return it.seq(); }
+        RecordType type() const override { return it.value().type; }
+
+    private:
+        SkipList<std::string_view, TypedValue>::Iterator it;
+    };
+
+public:
+    void insert(uint64_t seq, RecordType type, std::string_view key, std::string_view value) override {
+        // On an overwrite the key copy goes unused; the skiplist keeps the first one
+        list.insert(arena.copy(key), TypedValue{type, arena.copy(value)}, seq);
+    }
+
+    bool search(const std::string& key, uint64_t snapshot, RecordType& type, std::string_view& value) const override {
+        TypedValue found;
+        if (!list.search(key, snapshot, found)) {
+            return false;
+        }
+        type = found.type;
+        value = found.value;
+        return true;
+    }
+
+    bool empty() const override { return list.empty(); }
+
+    size_t memoryUsage() const override { return arena.memoryUsage(); }
+
+    std::unique_ptr<EntryIterator> newIterator() const override {
+        return std::make_unique<Iterator>(&list);
+    }
+};
+
+inline std::shared_ptr<Memtable> newMemtable(MemtableType type) {
+    if (type == MemtableType::SKIPLIST) {
+        return std::make_shared<SkipListMemtable>();
+    }
+    return std::make_shared<RBTreeMemtable>();
+}
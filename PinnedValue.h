@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// A value handed out without copying it. The view points at the bytes where
+// they already live (a memtable's arena, a cached block, a mapped SSTable) and
+// the pin keeps their owner alive for as long as the PinnedValue is held.
+class PinnedValue {
+private:
+    std::string_view bytes;
+    std::shared_ptr<const void> pin;
+
+public:
+    PinnedValue() = default;
+    PinnedValue(std::string_view bytes, std::shared_ptr<const void> pin) : bytes(bytes), pin(std::move(pin)) {}
+
+    std::string_view view() const { return bytes; }
+    const char* data() const { return bytes.data(); }
+    size_t size() const { return bytes.size(); }
+    std::string toString() const { return std::string(bytes); }
+
+    void reset() {
+        bytes = std::string_view();
+        pin.reset();
+    }
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Maps a key to the prefix that queries group it by, such as "tenant:object:"
+// for "tenant:object:field". Every SSTable holds a Bloom filter over the
+// prefixes of its keys, so a prefix scan skips tables without a match. Keys
+// outside the extractor's domain (too short, say) are left out of the filter.
+//
+// A table records the name of the extractor that built its filter, and the
+// filter is only consulted when the store's extractor has the same name, so a
+// store may change extractors between opens. Names must change whenever the
+// mapping does.
+class PrefixExtractor {
+public:
+    virtual ~PrefixExtractor() = default;
+
+    virtual std::string name() const = 0;
+    virtual bool inDomain(std::string_view key) const = 0;
+    // The prefix of a key in the domain; a prefix of the key itself
+    virtual std::string_view transform(std::string_view key) const = 0;
+
+    // True if prefix is exactly what transform() makes of its keys, so the
+    // filters can answer whether any key starts with it
+    bool isFullPrefix(std::string_view prefix) const { return inDomain(prefix) && transform(prefix) == prefix; }
+};
+
+// The first length bytes of a key
+class FixedPrefixExtractor : public PrefixExtractor {
+private:
+    size_t length;
+
+public:
+    explicit FixedPrefixExtractor(size_t length) : length(length) {}
+
+    std::string name() const override { return "fixed:" + std::to_string(length); }
+    bool inDomain(std::string_view key) const override { return key.size() >= length; }
+    std::string_view transform(std::string_view key) const override { return key.substr(0, length); }
+};
+
+// Everything up to and including the count-th delimiter, so with ':' and 2
+// "tenant:object:field" maps to "tenant:object:"
+class DelimitedPrefixExtractor : public PrefixExtractor {
+private:
+    char delimiter;
+    size_t count;
+
+    // Length of the prefix, or npos if key has fewer than count delimiters
+    size_t prefixLength(std::string_view key) const {
+        size_t end = 0;
+        for (size_t seen = 0; seen < count; seen++) {
+            size_t found = key.find(delimiter, end);
+            if (found == std::string_view::npos) {
+                return std::string_view::npos;
+            }
+            end = found + 1;
+        }
+        return end;
+    }
+
+public:
+    DelimitedPrefixExtractor(char delimiter, size_t count) : delimiter(delimiter), count(count) {}
+
+    std::string name() const override {
+        return "delimited:" + std::to_string(static_cast<unsigned char>(delimiter)) + ":" + std::to_string(count);
+    }
+    bool inDomain(std::string_view key) const override { return prefixLength(key) != std::string_view::npos; }
+    std::string_view transform(std::string_view key) const override { return key.substr(0, prefixLength(key)); }
+};
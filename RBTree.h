@@ -4,6 +4,9 @@
 #include <vector>
 #include <stdexcept>
 #include <utility> // For std::pair
+#include <new>
+#include <type_traits>
+#include "Arena.h"
 
 // Define the color of nodes
 enum Color { RED, BLACK };
@@ -23,6 +26,7 @@ template <typename K, typename V>
 class RBTree {
 private:
     Node<K, V>* root;
+    Arena* arena; // If set, nodes are carved out of it instead of the heap
 
     // Helper functions for rotations and balancing
     void leftRotate(Node<K, V>* x);
@@ -33,9 +37,11 @@ private:
     void deleteNodeHelper(Node<K, V>* node, K key);
     Node<K, V>* minimum(Node<K, V>* node);
     void destroyTree(Node<K, V>* node); // Helper for clear()
+    Node<K, V>* newNode(const K& key, const V& value);
+    void freeNode(Node<K, V>* node);
 
 public:
-    RBTree() : root(nullptr) {}
+    explicit RBTree(Arena* arena = nullptr) : root(nullptr), arena(arena) {}
     ~RBTree() { clear(); } // Destructor to prevent memory leaks
 
     // Insert key-value pair into the RB tree
@@ -44,6 +50,15 @@ public:
     // Search for a value by key
     V search(K key);
 
+    // Pointer to the value stored under key, or nullptr if the key is absent
+    V* find(const K& key);
+
+    // Ordered iteration: first node, first node with key >= target, and the
+    // in-order successor of a node (nullptr past the end)
+    Node<K, V>* first() const;
+    Node<K, V>* lowerBound(const K& target) const;
+    static Node<K, V>* successor(Node<K, V>* node);
+
     // Check if the tree is empty
     bool empty() const { return root == nullptr; }
     
@@ -166,7 +181,7 @@ void RBTree<K, V>::insert(K key, V value) {
         }
     }
 
-    Node<K, V>* z = new Node<K, V>(key, value);
+    Node<K, V>* z = newNode(key, value);
     z->parent = y;
     if (y == nullptr) {
         root = z;
@@ -195,6 +210,66 @@ V RBTree<K, V>::search(K key) {
     throw std::runtime_error("Key not found");
 }
 
+// Find the value stored under a key without throwing on a miss
+template <typename K, typename V>
+V* RBTree<K, V>::find(const K& key) {
+    Node<K, V>* node = root;
+    while (node != nullptr) {
+        if (key == node->key) {
+            return &node->value;
+        } else if (key < node->key) {
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return nullptr;
+}
+
+// Leftmost node of the tree
+template <typename K, typename V>
+Node<K, V>* RBTree<K, V>::first() const {
+    Node<K, V>* node = root;
+    while (node != nullptr && node->left != nullptr) {
+        node = node->left;
+    }
+    return node;
+}
+
+// First node whose key is not less than target
+template <typename K, typename V>
+Node<K, V>* RBTree<K, V>::lowerBound(const K& target) const {
+    Node<K, V>* node = root;
+    Node<K, V>* candidate = nullptr;
+    while (node != nullptr) {
+        if (node->key < target) {
+            node = node->right;
+        } else {
+            candidate = node;
+            node = node->left;
+        }
+    }
+    return candidate;
+}
+
+// Next node in key order, found through parent pointers
+template <typename K, typename V>
+Node<K, V>* RBTree<K, V>::successor(Node<K, V>* node) {
+    if (node->right != nullptr) {
+        node = node->right;
+        while (node->left != nullptr) {
+            node = node->left;
+        }
+        return node;
+    }
+    Node<K, V>* parent = node->parent;
+    while (parent != nullptr && node == parent->right) {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
+
 // In-order traversal (for visualization or debugging)
 template <typename K, typename V>
 void RBTree<K, V>::inorderTraversal(Node<K, V>* node) {
@@ -266,7 +341,7 @@ void RBTree<K, V>::deleteNodeHelper(Node<K, V>* node, K key) {
         y->left = z->left;
         y->left->parent = y;
     }
-    delete z;
+    freeNode(z);
 }
 
 // Find the minimum node in a subtree
@@ -293,19 +368,41 @@ void RBTree<K, V>::transplant(Node<K, V>* u, Node<K, V>* v) {
     }
 }
 
+// Allocate a node from the arena if there is one, otherwise from the heap
+template <typename K, typename V>
+Node<K, V>* RBTree<K, V>::newNode(const K& key, const V& value) {
+    if (arena != nullptr) {
+        return new (arena->allocateAligned(sizeof(Node<K, V>))) Node<K, V>(key, value);
+    }
+    return new Node<K, V>(key, value);
+}
+
+// Arena-backed nodes are only destroyed; their memory goes when the arena does
+template <typename K, typename V>
+void RBTree<K, V>::freeNode(Node<K, V>* node) {
+    if (arena != nullptr) {
+        node->~Node<K, V>();
+    } else {
+        delete node;
+    }
+}
+
 // Helper to recursively delete all nodes
 template <typename K, typename V>
 void RBTree<K, V>::destroyTree(Node<K, V>* node) {
     if (node != nullptr) {
         destroyTree(node->left);
         destroyTree(node->right);
-        delete node;
+        freeNode(node);
     }
 }
 
 // Clears the entire tree to prevent memory leaks
 template <typename K, typename V>
 void RBTree<K, V>::clear() {
-    destroyTree(root);
+    // Nothing to do per node when the arena owns the memory and no destructor has work
+    if (arena == nullptr || !std::is_trivially_destructible<Node<K, V>>::value) {
+        destroyTree(root);
+    }
     root = nullptr;
 }
\ No newline at end of file
@@ -0,0 +1,614 @@
+#include "KVStore.cpp"
+#include "Socket.h"
+#include <charconv>
+#include <unordered_map>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+// Settings of the RESP (Redis protocol) front end
+struct RespServerOptions {
+    string host = "127.0.0.1";
+    uint16_t port = 6379;
+    // Event loops, each a thread with its own epoll instance and its own
+    // listening socket on the shared port; the kernel spreads new connections
+    // over them.
+    unsigned eventLoops = max(1u, thread::hardware_concurrency());
+};
+
+// Limits that keep a malformed or hostile client from growing a connection's
+// buffers without bound. A violation is a protocol error and closes it.
+const size_t RESP_MAX_ARGUMENTS = 1024 * 1024;
+const size_t RESP_MAX_BULK_LENGTH = 512 * 1024 * 1024;
+const size_t RESP_MAX_INLINE_LENGTH = 64 * 1024;
+
+// Bytes asked of the socket per read
+const size_t RESP_READ_SIZE = 64 * 1024;
+// A connection stops reading commands while this many reply bytes are unsent,
+// so a client that pipelines without reading replies can't exhaust memory
+const size_t RESP_OUTPUT_LIMIT = 4 * 1024 * 1024;
+
+// SCAN cursors a connection keeps open; opening one more drops the oldest
+const size_t RESP_MAX_CURSORS = 16;
+// Keys a SCAN examines when the client gives no COUNT
+const size_t RESP_DEFAULT_SCAN_COUNT = 10;
+
+// One client connection, owned by the event loop that accepted it
+struct RespConnection {
+    int fd = -1;
+    string input;         // Received bytes not yet parsed into commands
+    string output;        // Replies, of which the first sent bytes are on the wire
+    size_t sent = 0;
+    // Edge-triggered epoll reports new data only once, so this stays set until
+    // a read finds the socket drained
+    bool readable = false;
+    // The peer shut down its side, or sent a malformed command; the connection
+    // closes once its replies are sent
+    bool closing = false;
+    // Open SCAN cursors: the key each resumes from, by the number handed out
+    map<uint64_t, string> cursors;
+    uint64_t nextCursor = 1;
+};
+
+// Writes parsed from one read of a connection, applied together: a run of
+// pipelined SET, DEL and MSET commands costs one WriteBatch, one WAL append
+// and one sync instead of one per command
+struct RespPendingWrites {
+    WriteBatch batch;
+    vector<string> replies; // One per command, sent once the batch is applied
+    // Whether each key the batch writes exists after it, for DEL's reply
+    unordered_map<string, bool> present;
+};
+
+// Outcome of parsing the next command out of a connection's input
+enum class RespParseResult { COMPLETE, INCOMPLETE, MALFORMED };
+
+void appendRespSimple(string& out, string_view status) {
+    out.append("+").append(status).append("\r\n");
+}
+
+void appendRespError(string& out, string_view message) {
+    out.append("-").append(message).append("\r\n");
+}
+
+void appendRespInteger(string& out, long long value) {
+    out.append(":").append(to_string(value)).append("\r\n");
+}
+
+void appendRespBulk(string& out, string_view value) {
+    out.append("$").append(to_string(value.size())).append("\r\n").append(value).append("\r\n");
+}
+
+void appendRespNull(string& out) {
+    out.append("$-1\r\n");
+}
+
+void appendRespArray(string& out, size_t length) {
+    out.append("*").append(to_string(length)).append("\r\n");
+}
+
+bool parseRespInteger(string_view text, long long& value) {
+    auto [end, error] = from_chars(text.data(), text.data() + text.size(), value);
+    return error == errc() && end == text.data() + text.size();
+}
+
+bool equalsIgnoreCase(string_view a, string_view b) {
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y));
+    });
+}
+
+// Parses the command at input[pos] into args, which point into input. Both
+// RESP arrays of bulk strings, as client libraries send, and space-separated
+// inline commands, as typed into telnet, are accepted. On COMPLETE pos moves
+// past the command; an empty args is a command to ignore. On MALFORMED error
+// says why.
+RespParseResult parseRespCommand(string_view input, size_t& pos, vector<string_view>& args, string& error) {
+    args.clear();
+    if (input[pos] != '*') {
+        size_t lineEnd = input.find('\n', pos);
+        if (lineEnd == string_view::npos) {
+            if (input.size() - pos > RESP_MAX_INLINE_LENGTH) {
+                error = "Protocol error: too big inline request";
+                return RespParseResult::MALFORMED;
+            }
+            return RespParseResult::INCOMPLETE;
+        }
+        string_view line = input.substr(pos, lineEnd - pos);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        while (!line.empty()) {
+            size_t start = line.find_first_not_of(" \t");
+            if (start == string_view::npos) {
+                break;
+            }
+            size_t end = min(line.find_first_of(" \t", start), line.size());
+            args.push_back(line.substr(start, end - start));
+            line.remove_prefix(end);
+        }
+        pos = lineEnd + 1;
+        return RespParseResult::COMPLETE;
+    }
+
+    // Reads the integer on the header line starting at p, after its type byte
+    size_t p = pos;
+    auto readHeader = [&](long long& value, long long limit, const char* what) {
+        size_t lineEnd = input.find("\r\n", p);
+        if (lineEnd == string_view::npos) {
+            if (input.size() - p > RESP_MAX_INLINE_LENGTH) {
+                error = string("Protocol error: too big ") + what;
+                return RespParseResult::MALFORMED;
+            }
+            return RespParseResult::INCOMPLETE;
+        }
+        if (!parseRespInteger(input.substr(p + 1, lineEnd - p - 1), value) || value > limit) {
+            error = string("Protocol error: invalid ") + what;
+            return RespParseResult::MALFORMED;
+        }
+        p = lineEnd + 2;
+        return RespParseResult::COMPLETE;
+    };
+
+    long long count;
+    RespParseResult result = readHeader(count, RESP_MAX_ARGUMENTS, "multibulk length");
+    if (result != RespParseResult::COMPLETE) {
+        return result;
+    }
+    for (long long i = 0; i < count; i++) {
+        if (p >= input.size()) {
+            return RespParseResult::INCOMPLETE;
+        }
+        if (input[p] != '$') {
+            error = string("Protocol error: expected '$', got '") + input[p] + "'";
+            return RespParseResult::MALFORMED;
+        }
+        long long length;
+        result = readHeader(length, RESP_MAX_BULK_LENGTH, "bulk length");
+        if (result != RespParseResult::COMPLETE) {
+            return result;
+        }
+        if (length < 0) {
+            error = "Protocol error: invalid bulk length";
+            return RespParseResult::MALFORMED;
+        }
+        if (input.size() - p < static_cast<size_t>(length) + 2) {
+            return RespParseResult::INCOMPLETE;
+        }
+        if (input.compare(p + length, 2, "\r\n") != 0) {
+            error = "Protocol error: bulk string not terminated by CRLF";
+            return RespParseResult::MALFORMED;
+        }
+        args.push_back(input.substr(p, length));
+        p += length + 2;
+    }
+    pos = p;
+    return RespParseResult::COMPLETE;
+}
+
+// Redis glob matching for SCAN's MATCH: '*', '?', '[...]' with ranges and '^'
+// negation, and '\' escapes
+bool respGlobMatch(string_view pattern, string_view text) {
+    size_t p = 0, t = 0;
+    size_t starP = string_view::npos, starT = 0; // Where to retry after the last '*'
+    while (t < text.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            starP = ++p;
+            starT = t;
+            continue;
+        }
+        bool matched = false;
+        size_t next = p + 1;
+        if (p < pattern.size()) {
+            if (pattern[p] == '?') {
+                matched = true;
+            } else if (pattern[p] == '[') {
+                size_t q = p + 1;
+                bool negate = q < pattern.size() && pattern[q] == '^';
+                if (negate) {
+                    q++;
+                }
+                bool inSet = false;
+                while (q < pattern.size() && pattern[q] != ']') {
+                    if (pattern[q] == '\\' && q + 1 < pattern.size()) {
+                        q++;
+                        inSet |= pattern[q] == text[t];
+                    } else if (q + 2 < pattern.size() && pattern[q + 1] == '-' && pattern[q + 2] != ']') {
+                        char low = min(pattern[q], pattern[q + 2]);
+                        char high = max(pattern[q], pattern[q + 2]);
+                        inSet |= low <= text[t] && text[t] <= high;
+                        q += 2;
+                    } else {
+                        inSet |= pattern[q] == text[t];
+                    }
+                    q++;
+                }
+                matched = inSet != negate;
+                next = min(q + 1, pattern.size());
+            } else if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+                matched = pattern[p + 1] == text[t];
+                next = p + 2;
+            } else {
+                matched = pattern[p] == text[t];
+            }
+        }
+        if (matched) {
+            p = next;
+            t++;
+        } else if (starP != string_view::npos) {
+            p = starP;
+            t = ++starT;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+// The literal text a glob starts with; every key it matches has this prefix
+string_view respGlobPrefix(string_view pattern) {
+    return pattern.substr(0, min(pattern.find_first_of("*?[\\"), pattern.size()));
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count]. The store is ordered, so a cursor
+// stands for the key to resume from; clients expect a number, so each
+// connection hands out numbers for the keys it resumes from. Cursors are only
+// valid on the connection that returned them.
+void executeRespScan(KVStore& store, RespConnection& conn, const vector<string_view>& args) {
+    long long cursor;
+    if (!parseRespInteger(args[1], cursor) || cursor < 0) {
+        appendRespError(conn.output, "ERR invalid cursor");
+        return;
+    }
+    string_view pattern;
+    long long count = RESP_DEFAULT_SCAN_COUNT;
+    for (size_t i = 2; i < args.size(); i += 2) {
+        if (i + 1 == args.size()) {
+            appendRespError(conn.output, "ERR syntax error");
+            return;
+        }
+        if (equalsIgnoreCase(args[i], "MATCH")) {
+            pattern = args[i + 1];
+        } else if (equalsIgnoreCase(args[i], "COUNT")) {
+            if (!parseRespInteger(args[i + 1], count) || count < 1) {
+                appendRespError(conn.output, "ERR value is not an integer or out of range");
+                return;
+            }
+        } else {
+            appendRespError(conn.output, "ERR syntax error");
+            return;
+        }
+    }
+
+    string start;
+    if (cursor != 0) {
+        auto it = conn.cursors.find(cursor);
+        if (it == conn.cursors.end()) {
+            appendRespError(conn.output, "ERR invalid cursor");
+            return;
+        }
+        start = move(it->second);
+        conn.cursors.erase(it);
+    }
+
+    // Only keys under the pattern's literal prefix can match, so the scan is
+    // narrowed to them and may skip SSTables by prefix filter
+    ReadOptions readOptions;
+    readOptions.prefix = respGlobPrefix(pattern);
+    vector<string> keys;
+    string lastKey;
+    size_t examined = 0;
+    bool ok = store.scan(start, "", count, [&](string_view key, string_view) {
+        if (pattern.empty() || respGlobMatch(pattern, key)) {
+            keys.emplace_back(key);
+        }
+        lastKey.assign(key.data(), key.size());
+        examined++;
+        return true;
+    }, readOptions);
+    if (!ok) {
+        appendRespError(conn.output, "ERR could not read an SSTable");
+        return;
+    }
+
+    uint64_t next = 0; // 0 tells the client the scan is over
+    if (examined == static_cast<size_t>(count)) {
+        next = conn.nextCursor++;
+        conn.cursors.emplace(next, lastKey + '\0'); // The smallest key after lastKey
+        if (conn.cursors.size() > RESP_MAX_CURSORS) {
+            conn.cursors.erase(conn.cursors.begin());
+        }
+    }
+    appendRespArray(conn.output, 2);
+    appendRespBulk(conn.output, to_string(next));
+    appendRespArray(conn.output, keys.size());
+    for (const string& key : keys) {
+        appendRespBulk(conn.output, key);
+    }
+}
+
+// Applies the pending writes as one batch and appends their replies to the
+// connection's output
+void applyRespWrites(KVStore& store, RespConnection& conn, RespPendingWrites& pending) {
+    if (pending.replies.empty()) {
+        return;
+    }
+    bool ok = store.write(pending.batch);
+    for (const string& reply : pending.replies) {
+        if (ok) {
+            conn.output += reply;
+        } else {
+            appendRespError(conn.output, "ERR could not write to the WAL");
+        }
+    }
+    pending.batch.clear();
+    pending.replies.clear();
+    pending.present.clear();
+}
+
+// Runs one command and appends its reply to the connection's output. A valid
+// SET, DEL or MSET joins the pending writes instead; any other command first
+// applies them, so replies stay in order and reads see the writes before them.
+void executeRespCommand(KVStore& store, RespConnection& conn, RespPendingWrites& pending, const vector<string_view>& args) {
+    string& out = conn.output;
+    string_view command = args[0];
+    auto arityError = [&] {
+        applyRespWrites(store, conn, pending);
+        string name(command);
+        transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return tolower(c); });
+        appendRespError(out, "ERR wrong number of arguments for '" + name + "' command");
+    };
+    if (!equalsIgnoreCase(command, "SET") && !equalsIgnoreCase(command, "DEL") && !equalsIgnoreCase(command, "MSET")) {
+        applyRespWrites(store, conn, pending);
+    }
+
+    if (equalsIgnoreCase(command, "GET")) {
+        if (args.size() != 2) {
+            return arityError();
+        }
+        PinnedValue value;
+        if (store.getKey(string(args[1]), value)) {
+            appendRespBulk(out, value.view());
+        } else {
+            appendRespNull(out);
+        }
+    } else if (equalsIgnoreCase(command, "SET")) {
+        if (args.size() < 3) {
+            return arityError();
+        }
+        if (args.size() > 3) {
+            // Expiry and conditional options need state the store doesn't keep
+            applyRespWrites(store, conn, pending);
+            return appendRespError(out, "ERR syntax error");
+        }
+        pending.batch.put(args[1], args[2]);
+        pending.present[string(args[1])] = true;
+        appendRespSimple(pending.replies.emplace_back(), "OK");
+    } else if (equalsIgnoreCase(command, "DEL")) {
+        if (args.size() < 2) {
+            return arityError();
+        }
+        // Replies with how many of the keys existed, counting the pending
+        // writes to them
+        int64_t existed = 0;
+        vector<string> lookups;
+        for (size_t i = 1; i < args.size(); i++) {
+            string key(args[i]);
+            auto it = pending.present.find(key);
+            if (it == pending.present.end()) {
+                lookups.push_back(key);
+            } else if (it->second) {
+                existed++;
+            }
+            pending.present[key] = false;
+            pending.batch.remove(args[i]);
+        }
+        vector<optional<PinnedValue>> values = store.multiGet(lookups);
+        existed += count_if(values.begin(), values.end(), [](const optional<PinnedValue>& value) { return value.has_value(); });
+        appendRespInteger(pending.replies.emplace_back(), existed);
+    } else if (equalsIgnoreCase(command, "MGET")) {
+        if (args.size() < 2) {
+            return arityError();
+        }
+        vector<string> keys(args.begin() + 1, args.end());
+        vector<optional<PinnedValue>> values = store.multiGet(keys);
+        appendRespArray(out, values.size());
+        for (const auto& value : values) {
+            if (value) {
+                appendRespBulk(out, value->view());
+            } else {
+                appendRespNull(out);
+            }
+        }
+    } else if (equalsIgnoreCase(command, "MSET")) {
+        if (args.size() < 3 || args.size() % 2 == 0) {
+            return arityError();
+        }
+        // Atomic, as MSET is in Redis: the pending writes go in one batch
+        for (size_t i = 1; i < args.size(); i += 2) {
+            pending.batch.put(args[i], args[i + 1]);
+            pending.present[string(args[i])] = true;
+        }
+        appendRespSimple(pending.replies.emplace_back(), "OK");
+    } else if (equalsIgnoreCase(command, "SCAN")) {
+        if (args.size() < 2) {
+            return arityError();
+        }
+        executeRespScan(store, conn, args);
+    } else if (equalsIgnoreCase(command, "PING")) {
+        if (args.size() > 2) {
+            return arityError();
+        }
+        if (args.size() == 2) {
+            appendRespBulk(out, args[1]);
+        } else {
+            appendRespSimple(out, "PONG");
+        }
+    } else {
+        string name(command.substr(0, 128));
+        appendRespError(out, "ERR unknown command '" + name + "'");
+    }
+}
+
+// Runs every complete command in the connection's input, in order, so a
+// pipelined burst is answered from one read, with each run of writes applied
+// as one batch. Stops early once the replies reach RESP_OUTPUT_LIMIT.
+void processRespInput(KVStore& store, RespConnection& conn) {
+    size_t pos = 0;
+    vector<string_view> args;
+    string error;
+    RespPendingWrites pending;
+    while (pos < conn.input.size() && conn.output.size() - conn.sent < RESP_OUTPUT_LIMIT) {
+        RespParseResult result = parseRespCommand(conn.input, pos, args, error);
+        if (result == RespParseResult::INCOMPLETE) {
+            break;
+        }
+        if (result == RespParseResult::MALFORMED) {
+            applyRespWrites(store, conn, pending);
+            appendRespError(conn.output, "ERR " + error);
+            conn.closing = true;
+            pos = conn.input.size();
+            break;
+        }
+        if (!args.empty()) {
+            executeRespCommand(store, conn, pending, args);
+        }
+    }
+    applyRespWrites(store, conn, pending);
+    conn.input.erase(0, pos);
+}
+
+// Handles the epoll events of a connection: reads until the socket is drained
+// or the client has too many replies unread, running the commands and sending
+// the replies as it goes. Returns false once the connection should be closed.
+bool handleRespEvents(KVStore& store, RespConnection& conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        return false;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        conn.readable = true;
+    }
+    while (true) {
+        processRespInput(store, conn); // Commands held back by a full output
+        if (!sendPending(conn.fd, conn.output, conn.sent)) {
+            return false;
+        }
+        if (conn.output.size() - conn.sent >= RESP_OUTPUT_LIMIT || !conn.readable || conn.closing) {
+            break;
+        }
+        size_t used = conn.input.size();
+        conn.input.resize(used + RESP_READ_SIZE);
+        ssize_t received = recv(conn.fd, conn.input.data() + used, RESP_READ_SIZE, 0);
+        conn.input.resize(used + max<ssize_t>(received, 0));
+        if (received == 0) {
+            conn.closing = true; // Still answer what the peer sent before shutting down
+            conn.readable = false;
+        } else if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn.readable = false;
+                break;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+    return !(conn.closing && conn.output.empty());
+}
+
+// One event loop: accepts connections on its own listener and serves them
+// until the process exits. Commands run on the loop's thread, so a batch of
+// writes waiting for its WAL sync holds up the loop's other connections; a
+// pipeline waits for one sync per read rather than one per command, and group
+// commit shares each sync between the loops.
+void runRespEventLoop(KVStore& store, int listenFd) {
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        LOG_ERROR("Could not create an epoll instance", "error", strerror(errno));
+        return;
+    }
+    epoll_event listenEvent{};
+    listenEvent.events = EPOLLIN | EPOLLET;
+    listenEvent.data.ptr = nullptr; // Marks the listener
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+
+    unordered_map<int, unique_ptr<RespConnection>> connections;
+    vector<epoll_event> events(256);
+    while (true) {
+        int ready = epoll_wait(epollFd, events.data(), events.size(), -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("epoll_wait failed", "error", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            auto conn = static_cast<RespConnection*>(events[i].data.ptr);
+            if (conn == nullptr) {
+                // Edge-triggered: accept every pending connection now
+                while (true) {
+                    int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (fd < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            LOG_ERROR("Could not accept a RESP connection", "error", strerror(errno));
+                        }
+                        break;
+                    }
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    auto accepted = make_unique<RespConnection>();
+                    accepted->fd = fd;
+                    epoll_event event{};
+                    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    event.data.ptr = accepted.get();
+                    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                        close(fd);
+                        continue;
+                    }
+                    connections.emplace(fd, move(accepted));
+                }
+            } else if (!handleRespEvents(store, *conn, events[i].events)) {
+                int fd = conn->fd;
+                close(fd); // Also removes it from the epoll set
+                connections.erase(fd);
+            }
+        }
+    }
+    close(epollFd);
+}
+
+// Serves the store over RESP2, the Redis protocol, so Redis clients and tools
+// such as redis-benchmark can use it. Supports GET, SET, DEL, MGET, MSET, SCAN
+// and PING, with any number of pipelined commands per connection. Blocks
+// until the event loops exit.
+void start_resp_server(KVStore& store, const RespServerOptions& options = RespServerOptions()) {
+    vector<int> listeners;
+    for (unsigned i = 0; i < max(1u, options.eventLoops); i++) {
+        int fd = openTcpListener(options.host, options.port);
+        if (fd < 0) {
+            for (int listener : listeners) {
+                close(listener);
+            }
+            return;
+        }
+        listeners.push_back(fd);
+    }
+
+    LOG_INFO("Starting RESP server", "host", options.host, "port", options.port, "event_loops", listeners.size());
+    vector<thread> loops;
+    for (int fd : listeners) {
+        loops.emplace_back([&store, fd] {
+            runRespEventLoop(store, fd);
+            close(fd);
+        });
+    }
+    for (auto& loop : loops) {
+        loop.join();
+    }
+}
@@ -0,0 +1,1130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <climits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "BlockCache.h"
+#include "BloomFilter.h"
+#include "Coding.h"
+#include "Format.h"
+#include "Iterator.h"
+#include "PinnedValue.h"
+#include "PrefixExtractor.h"
+
+// On-disk layout of an SSTable file (sstable_<n>.sst):
+//
+//   data block 0
+//   ...
+//   data block N-1
+//   filter block (optional)
+//   prefix filter block (optional)
+//   index block
+//   metadata block
+//   footer
+//
+// Every block is followed by a fixed32 CRC32C of its contents.
+//  - Data blocks hold entries in key order, and the versions of a key newest
+//    first. A block is cut once it reaches the builder's block size (4 KB by
+//    default), but never between versions of one key. Each entry is
+//      type 1 byte | seq varint64 | key length-prefixed | value length-prefixed
+//  - The filter block is a Bloom filter over every key in the table (see
+//    BloomFilter.h). Its location is stored in the metadata block.
+//  - The prefix filter block is a Bloom filter over the prefixes of the keys,
+//    as cut by the store's PrefixExtractor, whose name is stored alongside its
+//    location in the metadata block.
+//  - The index block has one entry per data block:
+//      last key length-prefixed | offset varint64 | size varint64
+//  - The metadata block holds named properties (see SSTableProperties):
+//      name length-prefixed | value length-prefixed
+//    Readers skip names they don't know, so properties can be added freely.
+//  - The footer has a fixed size, so a reader can find it from the file size:
+//      index offset fixed64 | index size fixed64 |
+//      metadata offset fixed64 | metadata size fixed64 |
+//      version fixed32 | magic fixed64
+//
+// A point read checks the filter, binary-searches the index for the one block
+// that can hold the key, and reads only that block, taking the newest version
+// the read's snapshot can see. Blocks are parsed once into
+// a Block (see BlockCache.h) and kept in the store's block cache, so a hot key
+// is served from memory with one binary search over the block's entries. The
+// file stays open in the store's table cache and is read with pread, or, in
+// mmap mode, mapped whole so blocks are verified and parsed in place without
+// being copied. Either way a found value is handed out pinned to its block.
+
+const uint64_t SSTABLE_MAGIC = 0x5453564b54534146ull; // "FASTKVST" in little-endian
+const uint32_t SSTABLE_VERSION = 1;
+const size_t SSTABLE_FOOTER_SIZE = 4 * 8 + 4 + 8;
+const size_t BLOCK_TRAILER_SIZE = 4;
+// Adjacent data blocks a batched lookup needs are fetched with one read of at
+// most this many bytes
+const size_t MAX_COALESCED_READ = 256 * 1024;
+
+// Location of a block in the file. size excludes the CRC trailer.
+struct BlockHandle {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+// One entry of a data block. The views point into the block's contents.
+struct SSTableEntry {
+    RecordType type;
+    uint64_t seq;
+    std::string_view key;
+    std::string_view value;
+};
+
+// Decodes the entry at p and advances past it. Returns false if it is malformed.
+inline bool decodeSSTableEntry(const char*& p, const char* limit, SSTableEntry& entry) {
+    if (p >= limit || !isValidRecordType(static_cast<uint8_t>(*p))) {
+        return false;
+    }
+    entry.type = static_cast<RecordType>(*p++);
+    return decodeVarint64(p, limit, entry.seq) && decodeLengthPrefixed(p, limit, entry.key) &&
+           decodeLengthPrefixed(p, limit, entry.value);
+}
+
+// Summary of a table, stored in its metadata block
+struct SSTableProperties {
+    uint64_t entries = 0;
+    uint64_t tombstones = 0;
+    std::string minKey;
+    std::string maxKey;
+    uint64_t minSeq = 0;
+    uint64_t maxSeq = 0;
+    BlockHandle filter; // size is 0 if the table has no filter
+    BlockHandle prefixFilter; // size is 0 if the table has no prefix filter
+    std::string prefixExtractor; // Name of the extractor that built prefixFilter
+
+    std::string encode() const;
+    bool decode(std::string_view contents);
+};
+
+// How new tables are laid out
+struct SSTableOptions {
+    size_t blockSize = 4096;  // Target size of a data block, the unit of a disk read
+    int bloomBitsPerKey = 10; // Bloom filter size; 0 writes no filter
+    std::shared_ptr<const PrefixExtractor> prefixExtractor; // Null writes no prefix filter
+};
+
+// Writes a new SSTable from entries added in increasing key order, with the
+// versions of a key in decreasing seq order.
+// Nothing is readable until finish() has written the footer and synced the file.
+class SSTableBuilder {
+private:
+    int fd = -1;
+    SSTableOptions options;
+    uint64_t offset = 0;      // Bytes written so far
+    std::vector<uint64_t> keyHashes; // For the filter
+    std::vector<uint64_t> prefixHashes; // For the prefix filter, one per distinct prefix
+    std::string lastPrefix;
+    std::string dataBlock;    // Entries of the block being filled
+    std::string indexBlock;
+    std::string lastKey;
+    SSTableProperties props;
+    bool failed = false;
+
+    bool writeAll(const char* data, size_t size);
+    BlockHandle writeBlock(const std::string& contents);
+    void finishDataBlock();
+
+public:
+    explicit SSTableBuilder(const std::string& path, const SSTableOptions& options = SSTableOptions());
+    ~SSTableBuilder();
+
+    SSTableBuilder(const SSTableBuilder&) = delete;
+    SSTableBuilder& operator=(const SSTableBuilder&) = delete;
+
+    bool isOpen() const { return fd >= 0; }
+    void add(std::string_view key, uint64_t seq, RecordType type, std::string_view value);
+    // Writes the filter, index, metadata and footer and syncs the file. Returns
+    // false if any write failed.
+    bool finish();
+
+    const SSTableProperties& properties() const { return props; }
+    uint64_t fileSize() const { return offset; }
+};
+
+enum class LookupResult { NOT_FOUND, FOUND, DELETED, IO_ERROR };
+
+// One key of a batched lookup (see SSTable::multiGet)
+struct KeyLookup {
+    std::string_view key;
+    LookupResult result = LookupResult::NOT_FOUND;
+    PinnedValue value; // Set on FOUND
+};
+
+// Read-only file read with pread, so any number of threads can share one
+// descriptor without racing on a seek position
+class TableFile {
+private:
+    int fd = -1;
+
+public:
+    explicit TableFile(const std::string& path) : fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {}
+    ~TableFile() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    TableFile(const TableFile&) = delete;
+    TableFile& operator=(const TableFile&) = delete;
+
+    bool isOpen() const { return fd >= 0; }
+
+    uint64_t size() const {
+        struct stat st;
+        return ::fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    }
+
+    // Reads exactly n bytes at offset. Returns false on an error or short file.
+    bool read(uint64_t offset, size_t n, char* out) const {
+        while (n > 0) {
+            ssize_t got = ::pread(fd, out, n, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            out += got;
+            offset += static_cast<uint64_t>(got);
+            n -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    // Fills buffers in order from consecutive bytes at offset, with one preadv
+    // unless the kernel returns short. Returns false on an error or short file.
+    bool read(uint64_t offset, std::vector<struct iovec> buffers) const {
+        size_t first = 0;
+        while (first < buffers.size()) {
+            int count = static_cast<int>(std::min<size_t>(buffers.size() - first, IOV_MAX));
+            ssize_t got = ::preadv(fd, &buffers[first], count, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            offset += static_cast<uint64_t>(got);
+            size_t left = static_cast<size_t>(got);
+            while (first < buffers.size() && buffers[first].iov_len <= left) {
+                left -= buffers[first].iov_len;
+                first++;
+            }
+            if (left > 0) {
+                buffers[first].iov_base = static_cast<char*>(buffers[first].iov_base) + left;
+                buffers[first].iov_len -= left;
+            }
+        }
+        return true;
+    }
+};
+
+// What reading a table needs beyond its properties: the open file (or its
+// mapping), plus its index and filter blocks unless those are left to the
+// block cache
+struct OpenTable {
+    std::unique_ptr<TableFile> file;           // Null in mmap mode
+    std::shared_ptr<const MappedFile> mapped;  // Null unless in mmap mode
+    std::shared_ptr<const Block> index;  // Null if left to the block cache
+    std::shared_ptr<const Block> filter; // Null if left to the block cache, or the table has none
+    std::shared_ptr<const Block> prefixFilter; // Likewise
+};
+
+// Open tables of a store by table number, bounded by how many are open. An
+// evicted table's file is closed once no reader is using it, and reopened on
+// its next read.
+using TableCache = LRUCache<uint64_t, OpenTable>;
+
+// How an SSTable is read
+struct SSTableReadOptions {
+    std::shared_ptr<BlockCache> blockCache; // Null reads every data block from the file
+    std::shared_ptr<TableCache> tableCache; // Null keeps every table open
+    // Keep the index and filter blocks with the open table. If false they are
+    // loaded through blockCache like data blocks, bounding the memory of many
+    // open tables at the cost of extra reads. Ignored without a block cache.
+    bool pinIndexAndFilter = true;
+    // Map the file instead of reading it with pread. Blocks then point into the
+    // mapping rather than holding a copy, which suits tables that fit in the
+    // page cache; an I/O error on a mapped page raises SIGBUS instead of
+    // failing the read.
+    bool mmapReads = false;
+};
+
+// Read-only handle on a finished SSTable. open() validates the file and loads
+// its metadata block, which stays in memory; the file itself, with the index
+// and filter blocks, is held in the table cache and reopened if evicted. Data
+// blocks are read on demand.
+//
+// Handles are shared by every reader holding a view of the table set. When
+// compaction replaces a table it calls markObsolete(), and the file is deleted
+// once the last handle is dropped, so no reader ever loses it mid-lookup.
+class SSTable {
+private:
+    enum class BlockKind { DATA, INDEX, FILTER };
+    class Iterator;
+
+    std::string path;
+    uint64_t tableNumber = 0;
+    SSTableProperties props;
+    uint64_t size = 0;
+    BlockHandle indexHandle;
+    std::shared_ptr<BlockCache> cache;
+    std::shared_ptr<TableCache> tableCache;
+    bool pinIndexAndFilter = true;
+    bool mmapReads = false;
+    std::shared_ptr<const OpenTable> residentTable; // Only without a table cache
+    std::atomic<bool> obsolete{false};
+
+    static bool readBlock(const TableFile& file, const BlockHandle& handle, std::string& contents);
+    // Records where each entry of a verified block starts, checking every one
+    // decodes. Returns false if the block is malformed.
+    static bool indexEntries(Block& block, BlockKind kind);
+    // Reads, verifies and indexes one block, in place if the table is mapped.
+    // Returns null if it is unreadable.
+    static std::shared_ptr<const Block> readParsedBlock(const OpenTable& table, const BlockHandle& handle, BlockKind kind);
+    // Reads data blocks that are adjacent in the file with a single preadv and
+    // parses each. An entry is null if its block is unreadable.
+    static std::vector<std::shared_ptr<const Block>> readParsedDataBlocks(const TableFile& file, const std::vector<BlockHandle>& handles);
+    // Finds the newest version of key no newer than snapshot in a data block.
+    // On FOUND, value is pinned to the block.
+    static LookupResult searchBlock(const std::shared_ptr<const Block>& block, std::string_view key, uint64_t snapshot, PinnedValue& value);
+    static SSTableEntry entryAt(const Block& block, size_t i);
+    static BlockHandle blockHandleAt(const Block& index, size_t i);
+    // First index entry whose last key is >= key, or the entry count if none
+    static size_t findBlock(const Block& index, std::string_view key);
+
+    // Opens (or maps) the file and loads the blocks kept with it, reusing file
+    // if it is already open. Null on an I/O error.
+    std::shared_ptr<const OpenTable> loadTable(std::unique_ptr<TableFile> file = nullptr) const;
+    // The open table, from the table cache or freshly opened
+    std::shared_ptr<const OpenTable> openTable() const;
+
+    // Returns a block from the cache, or reads it and caches it if fillCache
+    // is set. Null on an I/O error.
+    std::shared_ptr<const Block> loadBlock(const OpenTable& table, const BlockHandle& handle, BlockKind kind, bool fillCache) const;
+    std::shared_ptr<const Block> indexBlock(const OpenTable& table) const;
+    std::shared_ptr<const Block> filterBlock(const OpenTable& table) const;
+    std::shared_ptr<const Block> prefixFilterBlock(const OpenTable& table) const;
+
+public:
+    ~SSTable() {
+        if (tableCache) {
+            tableCache->erase(tableNumber);
+        }
+        if (obsolete.load()) {
+            std::remove(path.c_str());
+        }
+    }
+
+    // Returns nullptr if the file is missing or is not a valid SSTable
+    static std::shared_ptr<SSTable> open(const std::string& path, uint64_t number,
+                                         const SSTableReadOptions& readOptions = SSTableReadOptions());
+
+    const std::string& fileName() const { return path; }
+    uint64_t number() const { return tableNumber; }
+    const SSTableProperties& properties() const { return props; }
+    uint64_t fileSize() const { return size; }
+
+    // Deletes the file once the last handle on it is gone
+    void markObsolete() { obsolete = true; }
+
+    // True if [smallest, largest] intersects the table's key range
+    bool overlaps(std::string_view smallest, std::string_view largest) const {
+        return props.entries > 0 && !(largest < props.minKey || smallest > props.maxKey);
+    }
+
+    // False if no key of the table can start with prefix, judged by its key
+    // range and, when it was built by the same extractor and prefix is a full
+    // prefix, its prefix filter. If filterStats is given, records how the
+    // prefix filter did: a hit is a table let through, a miss one ruled out.
+    bool mayContainPrefix(std::string_view prefix, const PrefixExtractor* extractor,
+                          BloomFilterStats* filterStats = nullptr) const;
+
+    // Cursor over every entry, reading one data block at a time. A full scan
+    // (such as a compaction's) should pass fillCache = false so it doesn't
+    // push hot blocks out of the cache.
+    std::unique_ptr<EntryIterator> newIterator(bool fillCache = true) const;
+
+    // Looks up the newest version of key with a seq no higher than snapshot.
+    // On FOUND, value points at its value inside the block that holds it,
+    // which value keeps alive. If filterStats is given, records how the
+    // table's Bloom filter did.
+    LookupResult get(std::string_view key, uint64_t snapshot, PinnedValue& value, BloomFilterStats* filterStats = nullptr) const;
+
+    // Looks up a batch of keys in increasing order, setting each one's result
+    // as get() would. The table is opened and its index searched once for the
+    // batch, each data block is read once however many of the keys it holds,
+    // and adjacent blocks missing from the cache are read together.
+    void multiGet(const std::vector<KeyLookup*>& lookups, uint64_t snapshot, BloomFilterStats* filterStats = nullptr) const;
+};
+
+
+// ----------------------------------------------------------------------------
+// --- IMPLEMENTATIONS
+// ----------------------------------------------------------------------------
+
+inline std::string SSTableProperties::encode() const {
+    std::string contents;
+    auto addNumber = [&contents](std::string_view name, uint64_t value) {
+        std::string encoded;
+        appendVarint64(encoded, value);
+        appendLengthPrefixed(contents, name);
+        appendLengthPrefixed(contents, encoded);
+    };
+    auto addString = [&contents](std::string_view name, std::string_view value) {
+        appendLengthPrefixed(contents, name);
+        appendLengthPrefixed(contents, value);
+    };
+    addNumber("entries", entries);
+    addNumber("tombstones", tombstones);
+    addString("min-key", minKey);
+    addString("max-key", maxKey);
+    addNumber("min-seq", minSeq);
+    addNumber("max-seq", maxSeq);
+    if (filter.size > 0) {
+        addNumber("filter-offset", filter.offset);
+        addNumber("filter-size", filter.size);
+    }
+    if (prefixFilter.size > 0) {
+        addNumber("prefix-filter-offset", prefixFilter.offset);
+        addNumber("prefix-filter-size", prefixFilter.size);
+        addString("prefix-extractor", prefixExtractor);
+    }
+    return contents;
+}
+
+inline bool SSTableProperties::decode(std::string_view contents) {
+    const char* p = contents.data();
+    const char* limit = p + contents.size();
+    while (p < limit) {
+        std::string_view name, value;
+        if (!decodeLengthPrefixed(p, limit, name) || !decodeLengthPrefixed(p, limit, value)) {
+            return false;
+        }
+        uint64_t number = 0;
+        const char* v = value.data();
+        bool isNumber = decodeVarint64(v, value.data() + value.size(), number);
+        if (name == "entries" && isNumber) entries = number;
+        else if (name == "tombstones" && isNumber) tombstones = number;
+        else if (name == "min-key") minKey = std::string(value);
+        else if (name == "max-key") maxKey = std::string(value);
+        else if (name == "min-seq" && isNumber) minSeq = number;
+        else if (name == "max-seq" && isNumber) maxSeq = number;
+        else if (name == "filter-offset" && isNumber) filter.offset = number;
+        else if (name == "filter-size" && isNumber) filter.size = number;
+        else if (name == "prefix-filter-offset" && isNumber) prefixFilter.offset = number;
+        else if (name == "prefix-filter-size" && isNumber) prefixFilter.size = number;
+        else if (name == "prefix-extractor") prefixExtractor = std::string(value);
+    }
+    return true;
+}
+
+inline SSTableBuilder::SSTableBuilder(const std::string& path, const SSTableOptions& options) : options(options) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+inline SSTableBuilder::~SSTableBuilder() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+inline bool SSTableBuilder::writeAll(const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+inline BlockHandle SSTableBuilder::writeBlock(const std::string& contents) {
+    BlockHandle handle{offset, contents.size()};
+    std::string trailer;
+    appendFixed32(trailer, crc32c::value(contents.data(), contents.size()));
+    if (!writeAll(contents.data(), contents.size()) || !writeAll(trailer.data(), trailer.size())) {
+        failed = true;
+    }
+    offset += contents.size() + trailer.size();
+    return handle;
+}
+
+inline void SSTableBuilder::finishDataBlock() {
+    if (dataBlock.empty()) {
+        return;
+    }
+    BlockHandle handle = writeBlock(dataBlock);
+    appendLengthPrefixed(indexBlock, lastKey);
+    appendVarint64(indexBlock, handle.offset);
+    appendVarint64(indexBlock, handle.size);
+    dataBlock.clear();
+}
+
+inline void SSTableBuilder::add(std::string_view key, uint64_t seq, RecordType type, std::string_view value) {
+    // 1. Cut the block once it is full, between keys so that a point read
+    // finds every version of its key in one block
+    bool newKey = props.entries == 0 || key != lastKey;
+    if (newKey && dataBlock.size() >= options.blockSize) {
+        finishDataBlock();
+    }
+
+    // 2. Append the entry to the current block
+    dataBlock.push_back(static_cast<char>(type));
+    appendVarint64(dataBlock, seq);
+    appendLengthPrefixed(dataBlock, key);
+    appendLengthPrefixed(dataBlock, value);
+
+    // 3. Update the table's summary
+    if (props.entries == 0) {
+        props.minKey = std::string(key);
+        props.minSeq = seq;
+    }
+    props.entries++;
+    props.maxKey = std::string(key);
+    props.minSeq = std::min(props.minSeq, seq);
+    props.maxSeq = std::max(props.maxSeq, seq);
+    if (type == RecordType::DELETION) {
+        props.tombstones++;
+    }
+    lastKey.assign(key.data(), key.size());
+    if (newKey && options.bloomBitsPerKey > 0) {
+        keyHashes.push_back(bloomHash(key));
+        // Keys arrive sorted, so equal prefixes are adjacent
+        const PrefixExtractor* extractor = options.prefixExtractor.get();
+        if (extractor && extractor->inDomain(key)) {
+            std::string_view prefix = extractor->transform(key);
+            if (prefixHashes.empty() || prefix != lastPrefix) {
+                prefixHashes.push_back(bloomHash(prefix));
+                lastPrefix.assign(prefix.data(), prefix.size());
+            }
+        }
+    }
+}
+
+inline bool SSTableBuilder::finish() {
+    finishDataBlock();
+    if (!keyHashes.empty()) {
+        props.filter = writeBlock(buildBloomFilter(keyHashes, options.bloomBitsPerKey));
+    }
+    if (!prefixHashes.empty()) {
+        props.prefixFilter = writeBlock(buildBloomFilter(prefixHashes, options.bloomBitsPerKey));
+        props.prefixExtractor = options.prefixExtractor->name();
+    }
+    BlockHandle indexHandle = writeBlock(indexBlock);
+    BlockHandle metadataHandle = writeBlock(props.encode());
+
+    std::string footer;
+    appendFixed64(footer, indexHandle.offset);
+    appendFixed64(footer, indexHandle.size);
+    appendFixed64(footer, metadataHandle.offset);
+    appendFixed64(footer, metadataHandle.size);
+    appendFixed32(footer, SSTABLE_VERSION);
+    appendFixed64(footer, SSTABLE_MAGIC);
+    if (!writeAll(footer.data(), footer.size())) {
+        failed = true;
+    }
+    offset += footer.size();
+
+    // The table must be on disk before the WAL files it replaces are deleted
+#if defined(__APPLE__)
+    bool synced = ::fsync(fd) == 0;
+#else
+    bool synced = ::fdatasync(fd) == 0;
+#endif
+    return !failed && synced;
+}
+
+inline bool SSTable::readBlock(const TableFile& file, const BlockHandle& handle, std::string& contents) {
+    contents.resize(handle.size + BLOCK_TRAILER_SIZE);
+    if (!file.read(handle.offset, contents.size(), &contents[0])) {
+        return false;
+    }
+    uint32_t expectedCrc = decodeFixed32(contents.data() + handle.size);
+    contents.resize(handle.size);
+    return crc32c::value(contents.data(), contents.size()) == expectedCrc;
+}
+
+inline std::shared_ptr<const Block> SSTable::readParsedBlock(const OpenTable& table, const BlockHandle& handle, BlockKind kind) {
+    auto block = std::make_shared<Block>();
+    if (table.mapped) {
+        const MappedFile& mapped = *table.mapped;
+        if (handle.offset + handle.size + BLOCK_TRAILER_SIZE > mapped.size()) {
+            return nullptr;
+        }
+        const char* start = mapped.data() + handle.offset;
+        if (crc32c::value(start, handle.size) != decodeFixed32(start + handle.size)) {
+            return nullptr;
+        }
+        block->contents = std::string_view(start, handle.size);
+        block->mapping = table.mapped;
+    } else {
+        if (!readBlock(*table.file, handle, block->data)) {
+            return nullptr;
+        }
+        block->contents = block->data;
+    }
+    if (!indexEntries(*block, kind)) {
+        return nullptr;
+    }
+    return block;
+}
+
+inline std::vector<std::shared_ptr<const Block>> SSTable::readParsedDataBlocks(const TableFile& file, const std::vector<BlockHandle>& handles) {
+    std::vector<std::shared_ptr<const Block>> parsed(handles.size());
+    if (handles.empty()) {
+        return parsed;
+    }
+    std::vector<std::shared_ptr<Block>> blocks;
+    std::vector<struct iovec> buffers;
+    for (const BlockHandle& handle : handles) {
+        auto block = std::make_shared<Block>();
+        block->data.resize(handle.size + BLOCK_TRAILER_SIZE);
+        buffers.push_back(iovec{&block->data[0], block->data.size()});
+        blocks.push_back(std::move(block));
+    }
+    if (!file.read(handles.front().offset, std::move(buffers))) {
+        return parsed;
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        Block& block = *blocks[i];
+        uint32_t expectedCrc = decodeFixed32(block.data.data() + handles[i].size);
+        block.data.resize(handles[i].size);
+        block.contents = block.data;
+        if (crc32c::value(block.data.data(), block.data.size()) == expectedCrc && indexEntries(block, BlockKind::DATA)) {
+            parsed[i] = std::move(blocks[i]);
+        }
+    }
+    return parsed;
+}
+
+inline bool SSTable::indexEntries(Block& block, BlockKind kind) {
+    if (kind == BlockKind::FILTER) {
+        return true;
+    }
+    const char* base = block.contents.data();
+    const char* p = base;
+    const char* limit = p + block.contents.size();
+    while (p < limit) {
+        block.offsets.push_back(static_cast<uint32_t>(p - base));
+        bool ok;
+        if (kind == BlockKind::DATA) {
+            SSTableEntry entry;
+            ok = decodeSSTableEntry(p, limit, entry);
+        } else {
+            std::string_view lastKey;
+            uint64_t offset, blockSize;
+            ok = decodeLengthPrefixed(p, limit, lastKey) && decodeVarint64(p, limit, offset) && decodeVarint64(p, limit, blockSize);
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    block.offsets.shrink_to_fit();
+    return true;
+}
+
+inline SSTableEntry SSTable::entryAt(const Block& block, size_t i) {
+    const char* p = block.contents.data() + block.offsets[i];
+    SSTableEntry entry;
+    decodeSSTableEntry(p, block.contents.data() + block.contents.size(), entry); // Checked when parsed
+    return entry;
+}
+
+inline BlockHandle SSTable::blockHandleAt(const Block& index, size_t i) {
+    const char* p = index.contents.data() + index.offsets[i];
+    const char* limit = index.contents.data() + index.contents.size();
+    std::string_view lastKey;
+    BlockHandle handle;
+    decodeLengthPrefixed(p, limit, lastKey); // Checked when parsed
+    decodeVarint64(p, limit, handle.offset);
+    decodeVarint64(p, limit, handle.size);
+    return handle;
+}
+
+inline size_t SSTable::findBlock(const Block& index, std::string_view key) {
+    const char* limit = index.contents.data() + index.contents.size();
+    size_t low = 0;
+    size_t high = index.offsets.size();
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const char* p = index.contents.data() + index.offsets[mid];
+        std::string_view lastKey;
+        decodeLengthPrefixed(p, limit, lastKey);
+        if (lastKey < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+inline std::shared_ptr<const OpenTable> SSTable::loadTable(std::unique_ptr<TableFile> file) const {
+    auto table = std::make_shared<OpenTable>();
+    if (mmapReads) {
+        auto mapped = std::make_shared<MappedFile>(path);
+        if (!mapped->isOpen() || mapped->size() != size) {
+            return nullptr;
+        }
+        // A point read touches one block, so readahead would only evict other
+        // tables' pages
+        mapped->advise(POSIX_MADV_RANDOM);
+        table->mapped = std::move(mapped);
+    } else {
+        if (!file) {
+            file = std::make_unique<TableFile>(path);
+        }
+        if (!file->isOpen()) {
+            return nullptr;
+        }
+        table->file = std::move(file);
+    }
+    if (pinIndexAndFilter || !cache) {
+        table->index = readParsedBlock(*table, indexHandle, BlockKind::INDEX);
+        if (!table->index) {
+            return nullptr;
+        }
+        if (props.filter.size > 0) {
+            table->filter = readParsedBlock(*table, props.filter, BlockKind::FILTER);
+            if (!table->filter) {
+                return nullptr;
+            }
+        }
+        if (props.prefixFilter.size > 0) {
+            table->prefixFilter = readParsedBlock(*table, props.prefixFilter, BlockKind::FILTER);
+            if (!table->prefixFilter) {
+                return nullptr;
+            }
+        }
+    }
+    return table;
+}
+
+inline std::shared_ptr<const OpenTable> SSTable::openTable() const {
+    if (residentTable) {
+        return residentTable;
+    }
+    if (std::shared_ptr<const OpenTable> cached = tableCache->lookup(tableNumber)) {
+        return cached;
+    }
+    // Two threads may both miss and open the file; the later insert wins
+    std::shared_ptr<const OpenTable> table = loadTable();
+    if (table) {
+        tableCache->insert(tableNumber, table, 1);
+    }
+    return table;
+}
+
+inline std::shared_ptr<const Block> SSTable::loadBlock(const OpenTable& table, const BlockHandle& handle, BlockKind kind, bool fillCache) const {
+    BlockCacheKey key{tableNumber, handle.offset};
+    if (cache) {
+        if (std::shared_ptr<const Block> cached = cache->lookup(key)) {
+            return cached;
+        }
+    }
+    std::shared_ptr<const Block> block = readParsedBlock(table, handle, kind);
+    if (block && cache && fillCache) {
+        cache->insert(key, block, block->charge());
+    }
+    return block;
+}
+
+inline std::shared_ptr<const Block> SSTable::indexBlock(const OpenTable& table) const {
+    return table.index ? table.index : loadBlock(table, indexHandle, BlockKind::INDEX, true);
+}
+
+inline std::shared_ptr<const Block> SSTable::filterBlock(const OpenTable& table) const {
+    if (table.filter || props.filter.size == 0) {
+        return table.filter;
+    }
+    return loadBlock(table, props.filter, BlockKind::FILTER, true);
+}
+
+inline std::shared_ptr<const Block> SSTable::prefixFilterBlock(const OpenTable& table) const {
+    if (table.prefixFilter || props.prefixFilter.size == 0) {
+        return table.prefixFilter;
+    }
+    return loadBlock(table, props.prefixFilter, BlockKind::FILTER, true);
+}
+
+inline std::shared_ptr<SSTable> SSTable::open(const std::string& path, uint64_t number, const SSTableReadOptions& readOptions) {
+    auto file = std::make_unique<TableFile>(path);
+    if (!file->isOpen()) {
+        return nullptr;
+    }
+    auto table = std::make_shared<SSTable>();
+    table->path = path;
+    table->tableNumber = number;
+    table->cache = readOptions.blockCache;
+    table->pinIndexAndFilter = readOptions.pinIndexAndFilter;
+    table->mmapReads = readOptions.mmapReads;
+    table->size = file->size();
+    if (table->size < SSTABLE_FOOTER_SIZE) {
+        return nullptr;
+    }
+
+    // 1. Footer
+    char footer[SSTABLE_FOOTER_SIZE];
+    if (!file->read(table->size - SSTABLE_FOOTER_SIZE, SSTABLE_FOOTER_SIZE, footer) ||
+        decodeFixed64(footer + 36) != SSTABLE_MAGIC || decodeFixed32(footer + 32) != SSTABLE_VERSION) {
+        return nullptr;
+    }
+    table->indexHandle = BlockHandle{decodeFixed64(footer), decodeFixed64(footer + 8)};
+    BlockHandle metadataHandle{decodeFixed64(footer + 16), decodeFixed64(footer + 24)};
+    if (table->indexHandle.offset + table->indexHandle.size + BLOCK_TRAILER_SIZE > table->size ||
+        metadataHandle.offset + metadataHandle.size + BLOCK_TRAILER_SIZE > table->size) {
+        return nullptr;
+    }
+
+    // 2. Metadata block
+    std::string contents;
+    if (!readBlock(*file, metadataHandle, contents) || !table->props.decode(contents)) {
+        return nullptr;
+    }
+    for (const BlockHandle& filterHandle : {table->props.filter, table->props.prefixFilter}) {
+        if (filterHandle.size > 0 && filterHandle.offset + filterHandle.size + BLOCK_TRAILER_SIZE > table->size) {
+            return nullptr;
+        }
+    }
+
+    // 3. Index and filter blocks, unless the block cache will hold them. The
+    // open file goes to the table cache, so the first read needn't reopen it.
+    std::shared_ptr<const OpenTable> opened = table->loadTable(std::move(file));
+    if (!opened) {
+        return nullptr;
+    }
+    if (readOptions.tableCache) {
+        readOptions.tableCache->insert(number, opened, 1);
+        table->tableCache = readOptions.tableCache;
+    } else {
+        table->residentTable = opened;
+    }
+    return table;
+}
+
+inline LookupResult SSTable::get(std::string_view key, uint64_t snapshot, PinnedValue& value, BloomFilterStats* filterStats) const {
+    if (props.entries == 0 || key < props.minKey || key > props.maxKey) {
+        return LookupResult::NOT_FOUND;
+    }
+
+    std::shared_ptr<const OpenTable> table = openTable();
+    if (!table) {
+        return LookupResult::IO_ERROR;
+    }
+
+    // 1. Rule the table out if the filter can. An unreadable filter rules
+    // nothing out; the data block read below will report the damage.
+    std::shared_ptr<const Block> filter = filterBlock(*table);
+    if (filter && !bloomMayContain(filter->contents, bloomHash(key))) {
+        if (filterStats) {
+            filterStats->misses.fetch_add(1, std::memory_order_relaxed);
+        }
+        return LookupResult::NOT_FOUND;
+    }
+    LookupResult result = LookupResult::NOT_FOUND;
+
+    // 2. The first block whose last key is >= key is the only one that can hold it
+    std::shared_ptr<const Block> index = indexBlock(*table);
+    if (!index) {
+        return LookupResult::IO_ERROR;
+    }
+    size_t blockIndex = findBlock(*index, key);
+    if (blockIndex < index->offsets.size()) {
+        // 3. Binary-search that block's entries
+        std::shared_ptr<const Block> block = loadBlock(*table, blockHandleAt(*index, blockIndex), BlockKind::DATA, true);
+        if (!block) {
+            return LookupResult::IO_ERROR;
+        }
+        result = searchBlock(block, key, snapshot, value);
+    }
+
+    if (filterStats && filter) {
+        if (result == LookupResult::NOT_FOUND) {
+            filterStats->falsePositives.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            filterStats->hits.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+inline LookupResult SSTable::searchBlock(const std::shared_ptr<const Block>& block, std::string_view key, uint64_t snapshot, PinnedValue& value) {
+    size_t low = 0;
+    size_t high = block->offsets.size();
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entryAt(*block, mid).key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // Versions follow newest first; skip those written after the snapshot
+    SSTableEntry entry;
+    for (; low < block->offsets.size(); low++) {
+        entry = entryAt(*block, low);
+        if (entry.key != key) {
+            return LookupResult::NOT_FOUND;
+        }
+        if (entry.seq <= snapshot) {
+            break;
+        }
+    }
+    if (low == block->offsets.size()) {
+        return LookupResult::NOT_FOUND;
+    }
+    if (entry.type == RecordType::DELETION) {
+        return LookupResult::DELETED;
+    }
+    value = PinnedValue(entry.value, block);
+    return LookupResult::FOUND;
+}
+
+inline void SSTable::multiGet(const std::vector<KeyLookup*>& lookups, uint64_t snapshot, BloomFilterStats* filterStats) const {
+    // 1. Rule out the keys the key range and filter can, and find the one
+    // block that can hold each of the others. Keys come sorted, so probes are
+    // in block order.
+    std::shared_ptr<const OpenTable> table;
+    std::shared_ptr<const Block> filter;
+    std::shared_ptr<const Block> index;
+    std::vector<KeyLookup*> passedFilter;
+    std::vector<std::pair<size_t, KeyLookup*>> probes; // Block index, lookup
+    for (KeyLookup* lookup : lookups) {
+        lookup->result = LookupResult::NOT_FOUND;
+        if (props.entries == 0 || lookup->key < props.minKey || lookup->key > props.maxKey) {
+            continue;
+        }
+        if (!table) {
+            table = openTable();
+            filter = table ? filterBlock(*table) : nullptr;
+            index = table ? indexBlock(*table) : nullptr;
+        }
+        if (!index) {
+            lookup->result = LookupResult::IO_ERROR;
+            continue;
+        }
+        if (filter && !bloomMayContain(filter->contents, bloomHash(lookup->key))) {
+            if (filterStats) {
+                filterStats->misses.fetch_add(1, std::memory_order_relaxed);
+            }
+            continue;
+        }
+        passedFilter.push_back(lookup);
+        size_t blockIndex = findBlock(*index, lookup->key);
+        if (blockIndex < index->offsets.size()) {
+            probes.emplace_back(blockIndex, lookup);
+        }
+    }
+
+    // 2. Load each block once: from the cache, in place if mapped, or else
+    // with one read per run of adjacent blocks the cache doesn't have
+    std::vector<size_t> blockIndexes;
+    for (const auto& probe : probes) {
+        if (blockIndexes.empty() || blockIndexes.back() != probe.first) {
+            blockIndexes.push_back(probe.first);
+        }
+    }
+    std::vector<std::shared_ptr<const Block>> blocks(blockIndexes.size());
+    std::vector<size_t> missing; // Positions in blocks
+    for (size_t i = 0; i < blockIndexes.size(); i++) {
+        if (cache) {
+            blocks[i] = cache->lookup(BlockCacheKey{tableNumber, blockHandleAt(*index, blockIndexes[i]).offset});
+        }
+        if (!blocks[i]) {
+            missing.push_back(i);
+        }
+    }
+    auto cacheBlock = [&](const BlockHandle& handle, const std::shared_ptr<const Block>& block) {
+        if (block && cache) {
+            cache->insert(BlockCacheKey{tableNumber, handle.offset}, block, block->charge());
+        }
+    };
+    for (size_t start = 0; start < missing.size();) {
+        BlockHandle first = blockHandleAt(*index, blockIndexes[missing[start]]);
+        if (table->mapped) {
+            blocks[missing[start]] = readParsedBlock(*table, first, BlockKind::DATA);
+            cacheBlock(first, blocks[missing[start]]);
+            start++;
+            continue;
+        }
+        std::vector<BlockHandle> run{first};
+        uint64_t runBytes = first.size + BLOCK_TRAILER_SIZE;
+        size_t end = start + 1;
+        for (; end < missing.size(); end++) {
+            BlockHandle next = blockHandleAt(*index, blockIndexes[missing[end]]);
+            const BlockHandle& last = run.back();
+            if (next.offset != last.offset + last.size + BLOCK_TRAILER_SIZE || runBytes + next.size + BLOCK_TRAILER_SIZE > MAX_COALESCED_READ) {
+                break;
+            }
+            run.push_back(next);
+            runBytes += next.size + BLOCK_TRAILER_SIZE;
+        }
+        std::vector<std::shared_ptr<const Block>> read = readParsedDataBlocks(*table->file, run);
+        for (size_t i = 0; i < run.size(); i++) {
+            blocks[missing[start + i]] = read[i];
+            cacheBlock(run[i], read[i]);
+        }
+        start = end;
+    }
+
+    // 3. Binary-search each key's block
+    size_t blockPosition = 0;
+    for (const auto& [blockIndex, lookup] : probes) {
+        while (blockIndexes[blockPosition] != blockIndex) {
+            blockPosition++;
+        }
+        const std::shared_ptr<const Block>& block = blocks[blockPosition];
+        lookup->result = block ? searchBlock(block, lookup->key, snapshot, lookup->value) : LookupResult::IO_ERROR;
+    }
+
+    if (filterStats && filter) {
+        for (const KeyLookup* lookup : passedFilter) {
+            if (lookup->result == LookupResult::NOT_FOUND) {
+                filterStats->falsePositives.fetch_add(1, std::memory_order_relaxed);
+            } else if (lookup->result != LookupResult::IO_ERROR) {
+                filterStats->hits.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+inline bool SSTable::mayContainPrefix(std::string_view prefix, const PrefixExtractor* extractor, BloomFilterStats* filterStats) const {
+    // 1. Every key starting with prefix sorts between prefix and the first
+    // larger key that doesn't
+    if (props.entries == 0 || props.maxKey < prefix ||
+        (props.minKey > prefix && props.minKey.compare(0, prefix.size(), prefix) != 0)) {
+        return false;
+    }
+
+    // 2. The prefix filter, if it can answer for this prefix. An unreadable
+    // filter rules nothing out; the scan will report the damage.
+    if (props.prefixFilter.size == 0 || !extractor || extractor->name() != props.prefixExtractor ||
+        !extractor->isFullPrefix(prefix)) {
+        return true;
+    }
+    std::shared_ptr<const OpenTable> table = openTable();
+    std::shared_ptr<const Block> filter = table ? prefixFilterBlock(*table) : nullptr;
+    if (!filter) {
+        return true;
+    }
+    bool mayContain = bloomMayContain(filter->contents, bloomHash(prefix));
+    if (filterStats) {
+        (mayContain ? filterStats->hits : filterStats->misses).fetch_add(1, std::memory_order_relaxed);
+    }
+    return mayContain;
+}
+
+class SSTable::Iterator : public EntryIterator {
+private:
+    const SSTable* table;
+    bool fillCache;
+    std::shared_ptr<const OpenTable> open; // Kept open for the iterator's life, even if evicted
+    std::shared_ptr<const Block> index;
+    size_t blockIndex = 0;              // Block loaded into block
+    std::shared_ptr<const Block> block;
+    size_t entryIndex = 0;              // Next entry in block
+    SSTableEntry entry;
+    bool isValid = false;
+    bool error = false;
+
+    bool loadIndex() {
+        if (!index) {
+            open = table->openTable();
+            index = open ? table->indexBlock(*open) : nullptr;
+            error = !index;
+            if (open && open->mapped && !fillCache) {
+                // A full scan reads the file front to back, so let the kernel
+                // read ahead until it is done
+                open->mapped->advise(POSIX_MADV_SEQUENTIAL);
+            }
+        }
+        return index != nullptr;
+    }
+
+    bool loadBlock(size_t i) {
+        blockIndex = i;
+        entryIndex = 0;
+        block = table->loadBlock(*open, blockHandleAt(*index, i), BlockKind::DATA, fillCache);
+        error = !block;
+        return !error;
+    }
+
+    // Decodes the next entry, moving on to the following blocks as needed
+    void advance() {
+        isValid = false;
+        while (!error && block) {
+            if (entryIndex < block->offsets.size()) {
+                entry = entryAt(*block, entryIndex++);
+                isValid = true;
+                return;
+            }
+            if (blockIndex + 1 >= index->offsets.size() || !loadBlock(blockIndex + 1)) {
+                return;
+            }
+        }
+    }
+
+public:
+    Iterator(const SSTable* table, bool fillCache) : table(table), fillCache(fillCache) {}
+
+    ~Iterator() override {
+        if (open && open->mapped && !fillCache) {
+            open->mapped->advise(POSIX_MADV_RANDOM);
+        }
+    }
+
+    bool valid() const override { return isValid; }
+
+    void seekToFirst() override {
+        block.reset();
+        isValid = false;
+        if (loadIndex() && !index->offsets.empty() && loadBlock(0)) {
+            advance();
+        }
+    }
+
+    void seek(std::string_view target) override {
+        block.reset();
+        isValid = false;
+        if (!loadIndex()) {
+            return;
+        }
+        size_t i = findBlock(*index, target);
+        if (i >= index->offsets.size() || !loadBlock(i)) {
+            return;
+        }
+        for (advance(); isValid && entry.key < target; advance()) {
+        }
+    }
+
+    void next() override { advance(); }
+    std::string_view key() const override { return entry.key; }
+    std::string_view value() const override { return entry.value; }
+    uint64_t seq() const override { return entry.seq; }
+    RecordType type() const override { return entry.type; }
+    bool failed() const override { return error; }
+};
+
+inline std::unique_ptr<EntryIterator> SSTable::newIterator(bool fillCache) const {
+    return std::make_unique<Iterator>(this, fillCache);
+}
@@ -0,0 +1,324 @@
+#include "KVStore.cpp"
+
+// Construction-time settings of a ShardedKVStore
+struct ShardedKVStoreOptions {
+    // Shards the keys are spread over. Fixed when the store is created: a
+    // store reopened with another count keeps the one it was created with, or
+    // its keys would be looked for on the wrong shard.
+    unsigned shards = max(1u, thread::hardware_concurrency());
+    // Settings of every shard. Its directory is the root of the sharded store,
+    // which holds one subdirectory per shard. The block cache and table cache
+    // budgets are split evenly between the shards; everything else, such as
+    // the memtable size and compaction threads, applies to each shard.
+    KVStoreOptions shard;
+};
+
+// A store split into independent KVStore shards by key hash, behind the same
+// API. Each shard has its own WAL, memtables, table set and background
+// threads, so writes to different shards share no lock, no WAL file and no
+// fdatasync, and write throughput scales with the shard count up to the number
+// of cores (or, with synced writes, the disk's sync rate).
+//
+// A key lives on exactly one shard, so point reads and writes touch one shard.
+// Scans merge a cursor from every shard. What sharding gives up:
+//  - A WriteBatch is atomic within each shard, not across shards.
+//  - A snapshot from getSnapshot() holds one snapshot per shard, taken in
+//    turn, so a write to another shard landing meanwhile may or may not be
+//    in it. Each shard's own view is consistent.
+class ShardedKVStore {
+private:
+    vector<unique_ptr<KVStore>> shards;
+    mutable mutex snapshotMutex;
+    set<const Snapshot*> liveSnapshots; // From getSnapshot(), not yet released
+
+    // A hash of its own rather than the Bloom filter hash, so the keys of one
+    // shard still spread evenly over its filters' bits
+    size_t shardFor(string_view key) const {
+        uint64_t h = bloomHash(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return static_cast<size_t>(h % shards.size());
+    }
+
+    KVStore& shardOf(string_view key) { return *shards[shardFor(key)]; }
+
+    // The shard count recorded in the SHARDS file, written on first open like
+    // CURRENT is: to a temporary file that is synced and renamed into place.
+    // Returns 0 if the count can't be read or written.
+    static unsigned loadShardCount(const string& directory, unsigned requested) {
+        string path = directory + "/SHARDS";
+        ifstream in(path);
+        if (in.is_open()) {
+            unsigned recorded = 0;
+            if (!(in >> recorded) || recorded == 0) {
+                LOG_ERROR("Could not read shard count", "file", path);
+                return 0;
+            }
+            if (recorded != requested) {
+                LOG_INFO("Store was created with another shard count; ignoring the requested one", "shards", recorded, "requested", requested);
+            }
+            return recorded;
+        }
+        // Without the count, existing shards can't be told apart from a store
+        // created with another one, and keys would be looked for on the wrong shard
+        for (const auto& entry : filesystem::directory_iterator(directory)) {
+            if (entry.path().filename().string().rfind("shard_", 0) == 0) {
+                LOG_ERROR("Shard directories exist but the shard count is missing", "file", path);
+                return 0;
+            }
+        }
+
+        string tempPath = path + ".tmp";
+        {
+            ofstream out(tempPath, ios::trunc);
+            out << requested << "\n";
+            if (!out.flush()) {
+                LOG_ERROR("Could not write shard count", "file", tempPath);
+                return 0;
+            }
+        }
+        int tempFd = ::open(tempPath.c_str(), O_RDONLY | O_CLOEXEC);
+        bool synced = tempFd >= 0 && ::fsync(tempFd) == 0;
+        if (tempFd >= 0) {
+            ::close(tempFd);
+        }
+        if (!synced || rename(tempPath.c_str(), path.c_str()) != 0 || !syncDirectory(directory)) {
+            LOG_ERROR("Could not write shard count", "file", path);
+            return 0;
+        }
+        return requested;
+    }
+
+    // False, logging it, if readOptions carries a snapshot that is not a live
+    // one from this store's getSnapshot()
+    bool holdsSnapshot(const ReadOptions& readOptions) const {
+        if (!readOptions.snapshot) {
+            return true;
+        }
+        lock_guard<mutex> lock(snapshotMutex);
+        if (liveSnapshots.count(readOptions.snapshot)) {
+            return true;
+        }
+        LOG_ERROR("Read at a snapshot not taken from this sharded store");
+        return false;
+    }
+
+    // readOptions for one shard, with that shard's part of the snapshot
+    static ReadOptions forShard(const ReadOptions& readOptions, size_t shard) {
+        ReadOptions shardOptions = readOptions;
+        if (readOptions.snapshot) {
+            shardOptions.snapshot = readOptions.snapshot->shardSnapshots[shard];
+        }
+        return shardOptions;
+    }
+
+public:
+    explicit ShardedKVStore(const ShardedKVStoreOptions& options = ShardedKVStoreOptions()) {
+        filesystem::create_directories(options.shard.directory);
+        unsigned count = loadShardCount(options.shard.directory, max(1u, options.shards));
+        if (count == 0) {
+            return; // Left with no shards: isOpen() is false and every write fails
+        }
+
+        // Shards open in parallel; each replays its own WAL
+        shards.resize(count);
+        vector<thread> openers;
+        for (unsigned i = 0; i < count; i++) {
+            openers.emplace_back([&, i] {
+                KVStoreOptions shardOptions = options.shard;
+                shardOptions.directory = options.shard.directory + "/shard_" + to_string(i);
+                shardOptions.blockCacheCapacity = options.shard.blockCacheCapacity / count;
+                if (options.shard.maxOpenTables > 0) {
+                    shardOptions.maxOpenTables = max<size_t>(1, options.shard.maxOpenTables / count);
+                }
+                shards[i] = make_unique<KVStore>(shardOptions);
+            });
+        }
+        for (auto& opener : openers) {
+            opener.join();
+        }
+        LOG_INFO("Opened shards", "shards", count);
+    }
+
+    ShardedKVStore(const ShardedKVStore&) = delete;
+    ShardedKVStore& operator=(const ShardedKVStore&) = delete;
+
+    size_t shardCount() const { return shards.size(); }
+
+    // False if the shard count or any shard could not be read
+    bool isOpen() const {
+        return !shards.empty() && all_of(shards.begin(), shards.end(), [](const unique_ptr<KVStore>& shard) { return shard->isOpen(); });
+    }
+
+    bool insertKey(const string& key, const string& value, const WriteOptions& writeOptions = WriteOptions()) {
+        return !shards.empty() && shardOf(key).insertKey(key, value, writeOptions);
+    }
+
+    bool deleteKey(const string& key, const WriteOptions& writeOptions = WriteOptions()) {
+        return !shards.empty() && shardOf(key).deleteKey(key, writeOptions);
+    }
+
+    string getKey(const string& key, const ReadOptions& readOptions = ReadOptions()) {
+        PinnedValue value;
+        return getKey(key, value, readOptions) ? value.toString() : "Key not found.";
+    }
+
+    bool getKey(const string& key, PinnedValue& value, const ReadOptions& readOptions = ReadOptions()) {
+        if (shards.empty() || !holdsSnapshot(readOptions)) {
+            return false;
+        }
+        size_t shard = shardFor(key);
+        return shards[shard]->getKey(key, value, forShard(readOptions, shard));
+    }
+
+    // A snapshot across all shards, for ReadOptions::snapshot on this store
+    // only; pass it to releaseSnapshot() when done
+    const Snapshot* getSnapshot() {
+        Snapshot* snapshot = new Snapshot(0);
+        for (const auto& shard : shards) {
+            snapshot->shardSnapshots.push_back(shard->getSnapshot());
+        }
+        lock_guard<mutex> lock(snapshotMutex);
+        liveSnapshots.insert(snapshot);
+        return snapshot;
+    }
+
+    // Releases every shard's part; a null or unknown snapshot is ignored
+    void releaseSnapshot(const Snapshot* snapshot) {
+        if (!snapshot) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(snapshotMutex);
+            if (liveSnapshots.erase(snapshot) == 0) {
+                LOG_ERROR("Released a snapshot not held by this sharded store");
+                return;
+            }
+        }
+        for (size_t i = 0; i < shards.size(); i++) {
+            shards[i]->releaseSnapshot(snapshot->shardSnapshots[i]);
+        }
+        delete snapshot;
+    }
+
+    // Splits batch by shard and writes each part as one write on its shard.
+    // Returns false if any part could not be logged; the other parts are
+    // applied regardless.
+    bool write(const WriteBatch& batch, const WriteOptions& writeOptions = WriteOptions()) {
+        if (shards.empty()) {
+            return false;
+        }
+        vector<WriteBatch> parts(shards.size());
+        batch.forEach([&](RecordType type, string_view key, string_view value) {
+            WriteBatch& part = parts[shardFor(key)];
+            if (type == RecordType::PUT) {
+                part.put(key, value);
+            } else {
+                part.remove(key);
+            }
+        });
+        bool ok = true;
+        for (size_t i = 0; i < shards.size(); i++) {
+            ok = shards[i]->write(parts[i], writeOptions) && ok;
+        }
+        return ok;
+    }
+
+    // Like KVStore::multiGet, with each shard looking up its own keys in one batch
+    vector<optional<PinnedValue>> multiGet(const vector<string>& keys, const ReadOptions& readOptions = ReadOptions()) {
+        if (shards.empty() || !holdsSnapshot(readOptions)) {
+            return vector<optional<PinnedValue>>(keys.size());
+        }
+        vector<vector<string>> shardKeys(shards.size());
+        vector<vector<size_t>> positions(shards.size()); // Of each shard's keys in keys
+        for (size_t i = 0; i < keys.size(); i++) {
+            size_t shard = shardFor(keys[i]);
+            shardKeys[shard].push_back(keys[i]);
+            positions[shard].push_back(i);
+        }
+        vector<optional<PinnedValue>> results(keys.size());
+        for (size_t shard = 0; shard < shards.size(); shard++) {
+            if (shardKeys[shard].empty()) {
+                continue;
+            }
+            vector<optional<PinnedValue>> found = shards[shard]->multiGet(shardKeys[shard], forShard(readOptions, shard));
+            for (size_t i = 0; i < found.size(); i++) {
+                results[positions[shard][i]] = move(found[i]);
+            }
+        }
+        return results;
+    }
+
+    // Cursor over the live keys of every shard in key order. Each shard's
+    // cursor already hides shadowed and deleted versions, and a key is on one
+    // shard only, so merging them needs no further filtering. Empty if
+    // readOptions carries a snapshot this store does not hold.
+    unique_ptr<EntryIterator> newIterator(const ReadOptions& readOptions = ReadOptions()) {
+        vector<unique_ptr<EntryIterator>> children;
+        if (holdsSnapshot(readOptions)) {
+            for (size_t shard = 0; shard < shards.size(); shard++) {
+                children.push_back(shards[shard]->newIterator(forShard(readOptions, shard)));
+            }
+        }
+        return make_unique<MergingIterator>(move(children));
+    }
+
+    // Like KVStore::scan, over the merged shards
+    bool scan(const string& start, const string& end, size_t limit, const function<bool(string_view key, string_view value)>& visit,
+              const ReadOptions& readOptions = ReadOptions()) {
+        if (!holdsSnapshot(readOptions)) {
+            return false;
+        }
+        unique_ptr<EntryIterator> it = newIterator(readOptions);
+        size_t visited = 0;
+        for (it->seek(start); it->valid() && (end.empty() || it->key() < end); it->next()) {
+            if (!visit(it->key(), it->value()) || ++visited == limit) {
+                break;
+            }
+        }
+        if (it->failed()) {
+            LOG_ERROR("Could not read an SSTable during scan");
+            return false;
+        }
+        return true;
+    }
+
+    // The shards' counters added up; a level's score is the highest of any shard
+    KVStoreStats getStats() const {
+        KVStoreStats total;
+        auto addCache = [](CacheStats& sum, const CacheStats& shard) {
+            sum.hits += shard.hits;
+            sum.misses += shard.misses;
+            sum.inserts += shard.inserts;
+            sum.evictions += shard.evictions;
+            sum.usage += shard.usage;
+            sum.capacity += shard.capacity;
+        };
+        for (const auto& shard : shards) {
+            KVStoreStats stats = shard->getStats();
+            total.bloomHits += stats.bloomHits;
+            total.bloomMisses += stats.bloomMisses;
+            total.bloomFalsePositives += stats.bloomFalsePositives;
+            total.prefixBloomHits += stats.prefixBloomHits;
+            total.prefixBloomMisses += stats.prefixBloomMisses;
+            total.flushBytesWritten += stats.flushBytesWritten;
+            total.compactionBytesRead += stats.compactionBytesRead;
+            total.compactionBytesWritten += stats.compactionBytesWritten;
+            total.compactions += stats.compactions;
+            total.runningCompactions += stats.runningCompactions;
+            total.levels.resize(stats.levels.size());
+            for (size_t level = 0; level < stats.levels.size(); level++) {
+                total.levels[level].tables += stats.levels[level].tables;
+                total.levels[level].bytes += stats.levels[level].bytes;
+                total.levels[level].score = max(total.levels[level].score, stats.levels[level].score);
+            }
+            addCache(total.blockCache, stats.blockCache);
+            addCache(total.tableCache, stats.tableCache);
+        }
+        if (total.flushBytesWritten > 0) {
+            total.writeAmplification = static_cast<double>(total.flushBytesWritten + total.compactionBytesWritten) / total.flushBytesWritten;
+        }
+        return total;
+    }
+};
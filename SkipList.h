@@ -0,0 +1,249 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <random>
+#include <type_traits>
+#include "Arena.h"
+
+// Concurrent skiplist used as a memtable.
+//
+// - insert() may be called from many threads at once. A new node is linked in
+//   with compare-and-swap one level at a time, bottom up, so it becomes visible
+//   to readers as soon as its level-0 link is published.
+// - search() and iteration take no locks and never wait on writers.
+// - Nothing is unlinked or freed while the list is alive. Writing a key that is
+//   already present pushes a new version onto its node, ordered by sequence
+//   number, so concurrent writers to one key resolve in the order they were
+//   logged and a reader that already loaded a version keeps a valid pointer.
+// - Nodes and versions live in an Arena supplied by the owner and are released
+//   together with it, so K and V must not need destructors (e.g. string_view
+//   into the same arena).
+template <typename K, typename V>
+class SkipList {
+private:
+    static_assert(std::is_trivially_destructible<K>::value && std::is_trivially_destructible<V>::value,
+                  "SkipList memory is released by its Arena without running destructors");
+
+    static const int MAX_HEIGHT = 12;
+    static const unsigned BRANCHING = 4; // Each level holds ~1/4 of the nodes below it
+
+    struct Version {
+        uint64_t seq;
+        V value;
+        std::atomic<Version*> older;
+
+        Version(uint64_t seq, const V& value) : seq(seq), value(value), older(nullptr) {}
+    };
+
+    struct SkipNode {
+        K key;
+        std::atomic<Version*> newest;
+        std::atomic<SkipNode*> next[1]; // Really next[height], allocated past the end of the struct
+
+        explicit SkipNode(const K& key) : key(key), newest(nullptr) {}
+
+        SkipNode* getNext(int level) const { return next[level].load(std::memory_order_acquire); }
+    };
+
+    Arena& arena;
+    SkipNode* head;
+    std::atomic<int> maxHeight;
+
+    SkipNode* newNode(const K& key, int height);
+    static int randomHeight();
+
+    // Pushes a version onto a node, keeping the chain ordered newest first
+    void addVersion(SkipNode* node, const V& value, uint64_t seq);
+
+    // Starting at before (whose key is < key), walks one level and returns the
+    // last node with key < target in prev and its successor in next
+    void findSpliceForLevel(const K& key, SkipNode* before, int level, SkipNode** prev, SkipNode** next) const;
+
+    // First node whose key is >= key, or nullptr
+    SkipNode* findGreaterOrEqual(const K& key) const;
+
+public:
+    explicit SkipList(Arena& arena);
+
+    SkipList(const SkipList&) = delete;
+    SkipList& operator=(const SkipList&) = delete;
+
+    // Insert a key-value pair written at sequence number seq. Returns false if the
+    // key was already present and the write was added as a new version instead.
+    bool insert(const K& key, const V& value, uint64_t seq);
+
+    // Copy the newest value of key written at or before sequence number
+    // snapshot into value. Returns false if the key has no such version.
+    bool search(const K& key, uint64_t snapshot, V& value) const;
+
+    bool empty() const { return head->getNext(0) == nullptr; }
+
+    // Forward iterator over every version of every key, in key order and
+    // newest first within a key. Safe to use while other threads insert; it
+    // may or may not see their writes.
+    class Iterator {
+    public:
+        explicit Iterator(const SkipList* list) : list(list), node(nullptr), version(nullptr) {}
+
+        bool valid() const { return node != nullptr; }
+        const K& key() const { return node->key; }
+        const V& value() const { return version->value; }
+        uint64_t seq() const { return version->seq; }
+        void next() {
+            version = version->older.load(std::memory_order_acquire);
+            if (version == nullptr) {
+                moveTo(node->getNext(0));
+            }
+        }
+        void seek(const K& target) { moveTo(list->findGreaterOrEqual(target)); }
+        void seekToFirst() { moveTo(list->head->getNext(0)); }
+
+    private:
+        const SkipList* list;
+        SkipNode* node;
+        Version* version;
+
+        void moveTo(SkipNode* target) {
+            node = target;
+            version = node ? node->newest.load(std::memory_order_acquire) : nullptr;
+        }
+    };
+};
+
+
+// ----------------------------------------------------------------------------
+// --- IMPLEMENTATIONS
+// ----------------------------------------------------------------------------
+
+template <typename K, typename V>
+SkipList<K, V>::SkipList(Arena& arena) : arena(arena), head(newNode(K(), MAX_HEIGHT)), maxHeight(1) {}
+
+// Nodes are allocated with room for height next pointers
+template <typename K, typename V>
+typename SkipList<K, V>::SkipNode* SkipList<K, V>::newNode(const K& key, int height) {
+    char* memory = arena.allocateAligned(sizeof(SkipNode) + sizeof(std::atomic<SkipNode*>) * (height - 1));
+    SkipNode* node = new (memory) SkipNode(key);
+    for (int level = 0; level < height; level++) {
+        new (&node->next[level]) std::atomic<SkipNode*>(nullptr);
+    }
+    return node;
+}
+
+template <typename K, typename V>
+int SkipList<K, V>::randomHeight() {
+    thread_local std::minstd_rand rng(std::random_device{}());
+    int height = 1;
+    while (height < MAX_HEIGHT && rng() % BRANCHING == 0) {
+        height++;
+    }
+    return height;
+}
+
+template <typename K, typename V>
+void SkipList<K, V>::addVersion(SkipNode* node, const V& value, uint64_t seq) {
+    Version* version = new (arena.allocateAligned(sizeof(Version))) Version(seq, value);
+    std::atomic<Version*>* link = &node->newest;
+    Version* current = link->load(std::memory_order_acquire);
+    while (true) {
+        if (current != nullptr && current->seq > seq) {
+            // A later write already landed; slot ours in behind it
+            link = &current->older;
+            current = link->load(std::memory_order_acquire);
+            continue;
+        }
+        version->older.store(current, std::memory_order_relaxed);
+        if (link->compare_exchange_weak(current, version, std::memory_order_release, std::memory_order_acquire)) {
+            return;
+        }
+    }
+}
+
+template <typename K, typename V>
+void SkipList<K, V>::findSpliceForLevel(const K& key, SkipNode* before, int level, SkipNode** prev, SkipNode** next) const {
+    while (true) {
+        SkipNode* candidate = before->getNext(level);
+        if (candidate == nullptr || !(candidate->key < key)) {
+            *prev = before;
+            *next = candidate;
+            return;
+        }
+        before = candidate;
+    }
+}
+
+template <typename K, typename V>
+typename SkipList<K, V>::SkipNode* SkipList<K, V>::findGreaterOrEqual(const K& key) const {
+    SkipNode* node = head;
+    SkipNode* next = nullptr;
+    for (int level = maxHeight.load(std::memory_order_relaxed) - 1; level >= 0; level--) {
+        findSpliceForLevel(key, node, level, &node, &next);
+    }
+    return next;
+}
+
+template <typename K, typename V>
+bool SkipList<K, V>::insert(const K& key, const V& value, uint64_t seq) {
+    SkipNode* prev[MAX_HEIGHT];
+    SkipNode* next[MAX_HEIGHT];
+
+    // 1. Find the splice at every level that is currently in use
+    int listHeight = maxHeight.load(std::memory_order_relaxed);
+    SkipNode* before = head;
+    for (int level = listHeight - 1; level >= 0; level--) {
+        findSpliceForLevel(key, before, level, &prev[level], &next[level]);
+        before = prev[level];
+    }
+    if (next[0] != nullptr && next[0]->key == key) {
+        addVersion(next[0], value, seq);
+        return false;
+    }
+
+    // 2. Raise the list height if this node is taller than anything so far
+    int height = randomHeight();
+    int current = maxHeight.load(std::memory_order_relaxed);
+    while (height > current && !maxHeight.compare_exchange_weak(current, height, std::memory_order_relaxed)) {
+    }
+    for (int level = listHeight; level < height; level++) {
+        findSpliceForLevel(key, head, level, &prev[level], &next[level]);
+    }
+
+    // 3. Link the node in bottom up. A failed CAS means another writer linked a
+    // node between prev and next; rescan from prev, which is still < key.
+    SkipNode* node = newNode(key, height);
+    addVersion(node, value, seq);
+    for (int level = 0; level < height; level++) {
+        while (true) {
+            node->next[level].store(next[level], std::memory_order_relaxed);
+            if (prev[level]->next[level].compare_exchange_strong(next[level], node, std::memory_order_release, std::memory_order_acquire)) {
+                break;
+            }
+            findSpliceForLevel(key, prev[level], level, &prev[level], &next[level]);
+            if (level == 0 && next[0] != nullptr && next[0]->key == key) {
+                // The same key was inserted concurrently; ours becomes a version of
+                // it and the unlinked node is left to the arena
+                addVersion(next[0], value, seq);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename K, typename V>
+bool SkipList<K, V>::search(const K& key, uint64_t snapshot, V& value) const {
+    SkipNode* node = findGreaterOrEqual(key);
+    if (node == nullptr || !(node->key == key)) {
+        return false;
+    }
+    Version* version = node->newest.load(std::memory_order_acquire);
+    while (version != nullptr && version->seq > snapshot) {
+        version = version->older.load(std::memory_order_acquire);
+    }
+    if (version == nullptr) {
+        return false;
+    }
+    value = version->value;
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "Logger.h"
+
+// TCP helpers shared by the event-loop front ends
+
+// Opens a non-blocking listening socket on host:port. SO_REUSEPORT lets every
+// event loop of a server open its own socket on the same port, with the kernel
+// spreading new connections over them. Returns -1 on failure.
+inline int openTcpListener(const std::string& host, uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("Could not create a socket", "error", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        LOG_ERROR("Host is not an IPv4 address", "host", host);
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        LOG_ERROR("Could not listen", "host", host, "port", port, "error", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends as much of output, from sent on, as a non-blocking socket takes, and
+// clears output once all of it is sent. Returns false if the connection is
+// broken.
+inline bool sendPending(int fd, std::string& output, size_t& sent) {
+    while (sent < output.size()) {
+        ssize_t written = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK; // Resumed on EPOLLOUT
+        }
+        sent += written;
+    }
+    output.clear();
+    sent = 0;
+    return true;
+}
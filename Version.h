@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "SSTable.h"
+
+const int NUM_LEVELS = 7;
+
+// Immutable view of a store's SSTables, organized in levels. A new Version is
+// built for every change and published whole, so readers holding one never see
+// a half-applied compaction.
+//  - Level 0 holds flush outputs, oldest first. Their key ranges may overlap,
+//    so a read checks every one of them, newest first.
+//  - Levels 1 and up are sorted by key and never overlap within a level, so a
+//    read checks at most one table per level.
+struct Version {
+    std::vector<std::shared_ptr<SSTable>> levels[NUM_LEVELS];
+
+    uint64_t levelBytes(int level) const {
+        uint64_t bytes = 0;
+        for (const auto& table : levels[level]) {
+            bytes += table->fileSize();
+        }
+        return bytes;
+    }
+
+    size_t tableCount() const {
+        size_t count = 0;
+        for (const auto& level : levels) {
+            count += level.size();
+        }
+        return count;
+    }
+
+    // Tables of level whose key range intersects [smallest, largest]
+    std::vector<std::shared_ptr<SSTable>> overlapping(int level, std::string_view smallest, std::string_view largest) const {
+        std::vector<std::shared_ptr<SSTable>> result;
+        for (const auto& table : levels[level]) {
+            if (table->overlaps(smallest, largest)) {
+                result.push_back(table);
+            }
+        }
+        return result;
+    }
+
+    // The only table of a sorted level (1 and up) that can hold key, or null
+    const SSTable* findTable(int level, std::string_view key) const {
+        const auto& tables = levels[level];
+        auto it = std::lower_bound(tables.begin(), tables.end(), key,
+                                   [](const std::shared_ptr<SSTable>& t, std::string_view k) { return t->properties().maxKey < k; });
+        if (it == tables.end() || key < (*it)->properties().minKey) {
+            return nullptr;
+        }
+        return it->get();
+    }
+
+    // A copy with the removed tables dropped and the added ones placed
+    std::shared_ptr<Version> withEdit(const std::vector<uint64_t>& removed,
+                                      const std::vector<std::pair<int, std::shared_ptr<SSTable>>>& added) const {
+        auto next = std::make_shared<Version>();
+        std::set<uint64_t> removedSet(removed.begin(), removed.end());
+        for (int level = 0; level < NUM_LEVELS; level++) {
+            for (const auto& table : levels[level]) {
+                if (removedSet.count(table->number()) == 0) {
+                    next->levels[level].push_back(table);
+                }
+            }
+        }
+        for (const auto& [level, table] : added) {
+            next->levels[level].push_back(table);
+        }
+        next->sortLevels();
+        return next;
+    }
+
+    // Level 0 by age (newest data last), the others by key
+    void sortLevels() {
+        std::sort(levels[0].begin(), levels[0].end(), [](const auto& a, const auto& b) {
+            return a->properties().maxSeq != b->properties().maxSeq ? a->properties().maxSeq < b->properties().maxSeq
+                                                                    : a->number() < b->number();
+        });
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            std::sort(levels[level].begin(), levels[level].end(),
+                      [](const auto& a, const auto& b) { return a->properties().minKey < b->properties().minKey; });
+        }
+    }
+};
+
+// Cursor over a sorted level (1 and up) as a single run. Its tables never
+// overlap, so only the one holding the current key has an iterator open; the
+// next is opened when it runs out.
+class LevelIterator : public EntryIterator {
+private:
+    std::vector<std::shared_ptr<SSTable>> tables;
+    bool fillCache;
+    size_t tableIndex = 0;
+    std::unique_ptr<EntryIterator> current; // Null past the last table
+
+    void openTable(size_t i) {
+        tableIndex = i;
+        current = i < tables.size() ? tables[i]->newIterator(fillCache) : nullptr;
+    }
+
+    // Moves on to the next table while the current one is exhausted
+    void skipExhaustedTables() {
+        while (current && !current->valid() && !current->failed()) {
+            openTable(tableIndex + 1);
+            if (current) {
+                current->seekToFirst();
+            }
+        }
+    }
+
+public:
+    LevelIterator(std::vector<std::shared_ptr<SSTable>> tables, bool fillCache = true)
+        : tables(std::move(tables)), fillCache(fillCache) {}
+
+    bool valid() const override { return current && current->valid(); }
+
+    void seekToFirst() override {
+        openTable(0);
+        if (current) {
+            current->seekToFirst();
+        }
+        skipExhaustedTables();
+    }
+
+    void seek(std::string_view target) override {
+        auto it = std::lower_bound(tables.begin(), tables.end(), target,
+                                   [](const std::shared_ptr<SSTable>& t, std::string_view k) { return t->properties().maxKey < k; });
+        openTable(static_cast<size_t>(it - tables.begin()));
+        if (current) {
+            current->seek(target);
+        }
+        skipExhaustedTables();
+    }
+
+    void next() override {
+        current->next();
+        skipExhaustedTables();
+    }
+
+    std::string_view key() const override { return current->key(); }
+    std::string_view value() const override { return current->value(); }
+    uint64_t seq() const override { return current->seq(); }
+    RecordType type() const override { return current->type(); }
+    bool failed() const override { return current && current->failed(); }
+};
@@ -0,0 +1,486 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "Coding.h"
+#include "Format.h"
+#include "MappedFile.h"
+#include "WriteBatch.h"
+
+// When a write is acknowledged relative to its WAL record reaching disk.
+//  - PER_WRITE: each write syncs the WAL itself before returning.
+//  - GROUP: each write is synced before returning, but writers that arrive
+//    together share one write and one sync (group commit).
+//  - INTERVAL: writes return once their record is in the OS page cache; a
+//    background thread syncs the WAL every few milliseconds. A crash of the
+//    process loses nothing, a power failure loses at most one interval.
+//  - NONE: no WAL at all, for cache-style tables. Writes live only in the
+//    memtable until it is flushed. Only a whole store can run without a WAL,
+//    so NONE is a store setting, never a per-write one.
+enum class WALSyncMode { PER_WRITE, GROUP, INTERVAL, NONE };
+
+// Parses the names used on the HTTP API: per-write, group, interval, none
+inline std::optional<WALSyncMode> parseWALSyncMode(const std::string& name) {
+    if (name == "per-write") return WALSyncMode::PER_WRITE;
+    if (name == "group") return WALSyncMode::GROUP;
+    if (name == "interval") return WALSyncMode::INTERVAL;
+    if (name == "none") return WALSyncMode::NONE;
+    return std::nullopt;
+}
+
+// ----------------------------------------------------------------------------
+// --- RECORD FORMAT
+// ----------------------------------------------------------------------------
+//
+// A WAL file starts with the 7-byte WAL_MAGIC and a version byte, followed by
+// records:
+//
+//   crc32c   fixed32   CRC32C of everything after it in the record
+//   type     1 byte    RecordType, or WAL_BATCH_TYPE
+//   seq      varint64  Sequence number of the write (not in version 1)
+//   keyLen   varint32
+//   valueLen varint32
+//   key      keyLen bytes
+//   value    valueLen bytes
+//
+// A WriteBatch is one record of type WAL_BATCH_TYPE with an empty key and the
+// batch's encoded entries as its value (see WriteBatch.h). Its entries take
+// sequence numbers seq, seq + 1, ... in order, and since one CRC covers them
+// all, a torn batch is dropped whole. Batch records first appear in version 3.
+//
+// Keys and values are raw bytes, so spaces, newlines and binary data are all
+// safe. Files without the magic are text logs from older versions
+// ("key value\n" per line) and are still readable, as are version 1 files,
+// whose records get sequence numbers in file order.
+
+const std::string_view WAL_MAGIC("FASTKVW", 7);
+const uint8_t WAL_VERSION = 3;
+const uint8_t WAL_BATCH_TYPE = 3;
+
+// Magic and version, written at the start of every new WAL file
+inline std::string walFileHeader() {
+    std::string header(WAL_MAGIC);
+    header.push_back(static_cast<char>(WAL_VERSION));
+    return header;
+}
+
+struct WALRecord {
+    RecordType type;
+    uint64_t seq;
+    std::string_view key;
+    std::string_view value;
+};
+
+inline std::string encodeWALRecord(uint8_t type, uint64_t seq, std::string_view key, std::string_view value) {
+    std::string record(4, '\0'); // Room for the CRC
+    record.push_back(static_cast<char>(type));
+    appendVarint64(record, seq);
+    appendVarint32(record, static_cast<uint32_t>(key.size()));
+    appendVarint32(record, static_cast<uint32_t>(value.size()));
+    record.append(key.data(), key.size());
+    record.append(value.data(), value.size());
+    uint32_t crc = crc32c::value(record.data() + 4, record.size() - 4);
+    std::string header;
+    appendFixed32(header, crc);
+    record.replace(0, 4, header);
+    return record;
+}
+
+inline std::string encodeWALRecord(RecordType type, uint64_t seq, std::string_view key, std::string_view value) {
+    return encodeWALRecord(static_cast<uint8_t>(type), seq, key, value);
+}
+
+// One record for a whole batch whose first entry has sequence number seq
+inline std::string encodeWALBatch(uint64_t seq, const WriteBatch& batch) {
+    return encodeWALRecord(WAL_BATCH_TYPE, seq, std::string_view(), batch.contents());
+}
+
+// Finds where the record at p ends from its length fields alone, without
+// checking the CRC. Returns false if the header or payload runs past limit.
+inline bool skipWALRecord(const char*& p, const char* limit, bool hasSequence) {
+    const char* cursor = p + 5;
+    uint64_t seq;
+    uint32_t keyLength, valueLength;
+    if (limit - p < 5 || (hasSequence && !decodeVarint64(cursor, limit, seq)) ||
+        !decodeVarint32(cursor, limit, keyLength) || !decodeVarint32(cursor, limit, valueLength) ||
+        static_cast<uint64_t>(limit - cursor) < static_cast<uint64_t>(keyLength) + valueLength) {
+        return false;
+    }
+    p = cursor + keyLength + valueLength;
+    return true;
+}
+
+// Decodes the record at p and appends the writes it holds to records: one, or
+// every entry of a batch. Returns false, appending nothing, if it runs past
+// limit or its CRC does not match, which is what a write torn by a crash looks
+// like. Version 1 records carry no sequence number; seq is left at 0.
+inline bool decodeWALRecord(const char*& p, const char* limit, bool hasSequence, std::vector<WALRecord>& records) {
+    const char* cursor = p;
+    if (limit - cursor < 5) {
+        return false;
+    }
+    uint32_t expectedCrc = decodeFixed32(cursor);
+    cursor += 4;
+    const char* covered = cursor;
+    uint8_t rawType = static_cast<uint8_t>(*cursor++);
+    uint64_t seq = 0;
+    uint32_t keyLength, valueLength;
+    if ((hasSequence && !decodeVarint64(cursor, limit, seq)) ||
+        !decodeVarint32(cursor, limit, keyLength) || !decodeVarint32(cursor, limit, valueLength) ||
+        static_cast<uint64_t>(limit - cursor) < static_cast<uint64_t>(keyLength) + valueLength) {
+        return false;
+    }
+    const char* end = cursor + keyLength + valueLength;
+    if (crc32c::value(covered, end - covered) != expectedCrc) {
+        return false;
+    }
+    std::string_view key(cursor, keyLength);
+    std::string_view value(cursor + keyLength, valueLength);
+    if (rawType == WAL_BATCH_TYPE && hasSequence) {
+        size_t first = records.size();
+        bool ok = WriteBatch::forEach(value, [&](RecordType type, std::string_view entryKey, std::string_view entryValue) {
+            records.push_back(WALRecord{type, seq + (records.size() - first), entryKey, entryValue});
+        });
+        if (!ok) {
+            records.resize(first);
+            return false;
+        }
+    } else if (isValidRecordType(rawType)) {
+        records.push_back(WALRecord{static_cast<RecordType>(rawType), seq, key, value});
+    } else {
+        return false;
+    }
+    p = end;
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------
+// --- REPLAY
+// ----------------------------------------------------------------------------
+
+struct WALReplayStats {
+    size_t recordsRead = 0;    // Writes in the valid records of the file, counting each batch entry
+    size_t recordsApplied = 0; // Records passed to apply, after dropping overwritten ones
+    uint64_t maxSequence = 0;  // Highest sequence number seen
+    bool torn = false;         // The file had bytes past the last valid record
+};
+
+// Replays one WAL file, calling apply(const WALRecord&) for the newest record
+// of each key, in key order, from the calling thread.
+//
+// The file is memory-mapped and cut into one chunk per thread. A cheap
+// sequential pass finds record boundaries from the length fields; then each
+// thread checks CRCs and decodes its chunk into a run sorted by key, newest
+// first. The runs are merged, and for every key only the record with the
+// highest sequence number is applied, so the last writer wins no matter which
+// chunk held it. Replay stops cleanly at the first torn or corrupt record:
+// everything before it is applied, nothing after it.
+//
+// Version 1 and text files have no sequence numbers. They are read by one
+// thread and numbered in file order starting at firstSequence.
+template <typename Apply>
+WALReplayStats replayWALFile(const std::string& path, unsigned threads, uint64_t firstSequence, Apply&& apply) {
+    const size_t MIN_CHUNK_SIZE = 1024 * 1024; // Not worth a thread below this
+
+    WALReplayStats stats;
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        return stats;
+    }
+    std::string_view contents = file.contents();
+
+    if (contents.compare(0, WAL_MAGIC.size(), WAL_MAGIC) != 0 || contents.size() <= WAL_MAGIC.size()) {
+        // Text log from an older version
+        std::stringstream lines{std::string(contents)};
+        std::string line;
+        while (std::getline(lines, line)) {
+            std::stringstream ss(line);
+            std::string key, value;
+            ss >> key;
+            std::getline(ss, value);
+            if (!value.empty() && value[0] == ' ') {
+                value.erase(0, 1);
+            }
+            // Text logs marked deletes with this value
+            RecordType type = (value == "---DELETED---") ? RecordType::DELETION : RecordType::PUT;
+            stats.maxSequence = firstSequence + stats.recordsRead++;
+            apply(WALRecord{type, stats.maxSequence, key, value});
+        }
+        stats.recordsApplied = stats.recordsRead;
+        return stats;
+    }
+
+    bool hasSequence = static_cast<uint8_t>(contents[WAL_MAGIC.size()]) >= 2;
+    const char* begin = contents.data() + WAL_MAGIC.size() + 1;
+    const char* limit = contents.data() + contents.size();
+    file.advise(POSIX_MADV_SEQUENTIAL);
+
+    // 1. Cut the file into chunks at record boundaries
+    size_t chunkSize = std::max(MIN_CHUNK_SIZE, static_cast<size_t>(limit - begin) / std::max(1u, threads));
+    if (!hasSequence) {
+        chunkSize = SIZE_MAX;
+    }
+    std::vector<const char*> boundaries{begin};
+    const char* p = begin;
+    while (p < limit && skipWALRecord(p, limit, hasSequence)) {
+        if (static_cast<size_t>(p - boundaries.back()) >= chunkSize) {
+            boundaries.push_back(p);
+        }
+    }
+    if (boundaries.back() != p) {
+        boundaries.push_back(p);
+    }
+    stats.torn = p < limit;
+
+    // 2. Decode and sort each chunk on its own thread
+    size_t chunks = boundaries.size() - 1;
+    std::vector<std::vector<WALRecord>> runs(chunks);
+    std::vector<char> chunkComplete(chunks, 0);
+    auto decodeChunk = [&](size_t chunk) {
+        std::vector<WALRecord>& run = runs[chunk];
+        const char* cursor = boundaries[chunk];
+        const char* end = boundaries[chunk + 1];
+        while (cursor < end && decodeWALRecord(cursor, end, hasSequence, run)) {
+            if (!hasSequence) {
+                run.back().seq = firstSequence + run.size() - 1;
+            }
+        }
+        chunkComplete[chunk] = (cursor == end);
+        std::sort(run.begin(), run.end(), [](const WALRecord& a, const WALRecord& b) {
+            return a.key != b.key ? a.key < b.key : a.seq > b.seq;
+        });
+    };
+    std::vector<std::thread> workers;
+    for (size_t chunk = 1; chunk < chunks; chunk++) {
+        workers.emplace_back(decodeChunk, chunk);
+    }
+    if (chunks > 0) {
+        decodeChunk(0);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // A bad record ends the log: drop every chunk after the first one with one
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        if (!chunkComplete[chunk]) {
+            runs.resize(chunk + 1);
+            stats.torn = true;
+            break;
+        }
+    }
+
+    // 3. Merge the runs, keeping the newest record of each key
+    using Head = std::pair<size_t, size_t>; // (run, position)
+    auto newerFirst = [&runs](const Head& a, const Head& b) {
+        const WALRecord& x = runs[a.first][a.second];
+        const WALRecord& y = runs[b.first][b.second];
+        return x.key != y.key ? x.key > y.key : x.seq < y.seq;
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(newerFirst)> heads(newerFirst);
+    for (size_t run = 0; run < runs.size(); run++) {
+        stats.recordsRead += runs[run].size();
+        if (!runs[run].empty()) {
+            heads.push({run, 0});
+        }
+    }
+    const WALRecord* previous = nullptr;
+    while (!heads.empty()) {
+        auto [run, position] = heads.top();
+        heads.pop();
+        const WALRecord& record = runs[run][position];
+        stats.maxSequence = std::max(stats.maxSequence, record.seq);
+        if (previous == nullptr || previous->key != record.key) {
+            apply(record);
+            stats.recordsApplied++;
+            previous = &record;
+        }
+        if (position + 1 < runs[run].size()) {
+            heads.push({run, position + 1});
+        }
+    }
+    return stats;
+}
+
+
+// ----------------------------------------------------------------------------
+// --- WRITER
+// ----------------------------------------------------------------------------
+
+// Long-lived, append-only handle on one WAL file with group commit.
+//
+// Appending is split in two so the caller can fix the order of records in the
+// file while holding its own lock, then wait for them without it:
+//  1. submit() queues a record and returns a ticket. Records reach the file in
+//     submit() order.
+//  2. commit(ticket, mode) returns once that record is as durable as the
+//     WALSyncMode asks for.
+// The first committer to find no write in progress becomes the leader: it takes
+// the queued records, writes them with one writev(), issues one fdatasync() if
+// needed, then wakes everyone in the batch. Writers that queue up while a
+// leader is busy form the next batch, so the cost is shared.
+class WALWriter {
+private:
+    int fd = -1;
+    std::mutex mutex;
+    std::condition_variable batchDone;
+    std::vector<std::string> pending; // Queued records not yet handed to a leader
+    uint64_t nextTicket = 1;          // Ticket of the next submitted record
+    uint64_t writtenTicket = 0;       // Every ticket up to this one is in the file
+    uint64_t durableTicket = 0;       // Every ticket up to this one is synced
+    bool writing = false;             // A leader is writing a batch
+    bool failed = false;              // A write or sync failed; the file is unusable
+
+    // Writes the whole batch. Handles short writes and the IOV_MAX limit on the
+    // number of buffers per writev() call.
+    bool writeBatch(const std::vector<std::string>& batch) {
+        const size_t MAX_IOVECS = 1024;
+        size_t record = 0;  // First record not fully written
+        size_t offset = 0;  // Bytes of that record already written
+        while (record < batch.size()) {
+            iovec iov[MAX_IOVECS];
+            size_t count = 0;
+            for (size_t i = record; i < batch.size() && count < MAX_IOVECS; i++, count++) {
+                size_t skip = (i == record) ? offset : 0;
+                iov[count].iov_base = const_cast<char*>(batch[i].data() + skip);
+                iov[count].iov_len = batch[i].size() - skip;
+            }
+            ssize_t written = ::writev(fd, iov, static_cast<int>(count));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            // Advance past whatever the kernel accepted
+            size_t remaining = static_cast<size_t>(written);
+            while (record < batch.size() && remaining >= batch[record].size() - offset) {
+                remaining -= batch[record].size() - offset;
+                offset = 0;
+                record++;
+            }
+            offset += remaining;
+        }
+        return true;
+    }
+
+    bool sync() {
+#if defined(__APPLE__)
+        return ::fsync(fd) == 0; // macOS has no fdatasync()
+#else
+        return ::fdatasync(fd) == 0;
+#endif
+    }
+
+    // Blocks until ticket is written (and synced, if needSync). A leader takes
+    // every queued record if shareBatch, or only those up to its own ticket.
+    bool waitFor(uint64_t ticket, bool needSync, bool shareBatch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while ((needSync ? durableTicket : writtenTicket) < ticket) {
+            if (failed) {
+                return false;
+            }
+            if (writing) {
+                batchDone.wait(lock);
+                continue;
+            }
+
+            // Become the leader. pending holds tickets writtenTicket+1 onwards.
+            writing = true;
+            uint64_t lastInBatch = shareBatch ? nextTicket - 1 : std::max(ticket, writtenTicket);
+            std::vector<std::string> batch;
+            size_t take = static_cast<size_t>(lastInBatch - writtenTicket);
+            batch.assign(std::make_move_iterator(pending.begin()), std::make_move_iterator(pending.begin() + take));
+            pending.erase(pending.begin(), pending.begin() + take);
+            lock.unlock();
+            bool ok = writeBatch(batch) && (!needSync || sync());
+            lock.lock();
+            writing = false;
+            if (ok) {
+                writtenTicket = lastInBatch;
+                if (needSync) {
+                    durableTicket = lastInBatch;
+                }
+            } else {
+                failed = true;
+            }
+            batchDone.notify_all();
+        }
+        return true;
+    }
+
+public:
+    explicit WALWriter(const std::string& path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat info;
+        if (fd >= 0 && ::fstat(fd, &info) == 0 && info.st_size == 0) {
+            // A new file: stamp the format. Synced together with the first batch.
+            std::string header = walFileHeader();
+            if (::write(fd, header.data(), header.size()) != static_cast<ssize_t>(header.size())) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    ~WALWriter() {
+        if (fd >= 0) {
+            if (!failed && writtenTicket > durableTicket) {
+                sync(); // Don't leave INTERVAL writes unsynced when rotating away
+            }
+            ::close(fd);
+        }
+    }
+
+    WALWriter(const WALWriter&) = delete;
+    WALWriter& operator=(const WALWriter&) = delete;
+
+    bool isOpen() const { return fd >= 0; }
+
+    // Queues an encoded record for the next batch and returns its ticket
+    uint64_t submit(std::string record) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(record));
+        return nextTicket++;
+    }
+
+    // Blocks until the record with this ticket is as durable as mode asks for,
+    // writing a batch itself if no other thread is. Returns false if the WAL
+    // could not be written. mode must not be NONE.
+    bool commit(uint64_t ticket, WALSyncMode mode) {
+        switch (mode) {
+            case WALSyncMode::PER_WRITE:
+                return waitFor(ticket, true, false);
+            case WALSyncMode::INTERVAL:
+                return waitFor(ticket, false, true);
+            default:
+                return waitFor(ticket, true, true);
+        }
+    }
+
+    // Writes and syncs everything submitted so far. Used by the interval syncer.
+    bool syncAll() {
+        uint64_t last;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            last = nextTicket - 1;
+        }
+        return waitFor(last, true, true);
+    }
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "Coding.h"
+#include "Format.h"
+
+// A group of puts and deletes applied as one write by KVStore::write(). The
+// whole batch goes to the WAL as a single record, so after a crash either all
+// of it is recovered or none of it, and its entries take consecutive sequence
+// numbers in the order they were added. A later entry for a key overrides an
+// earlier one in the same batch.
+//
+// The entries are kept encoded, each as
+//
+//   type     1 byte    RecordType
+//   key      varint32 length + bytes
+//   value    varint32 length + bytes (empty for a DELETION)
+//
+// which is also how they are stored in the WAL record.
+class WriteBatch {
+private:
+    std::string rep;
+    size_t entries = 0;
+
+    void add(RecordType type, std::string_view key, std::string_view value) {
+        rep.push_back(static_cast<char>(type));
+        appendLengthPrefixed(rep, key);
+        appendLengthPrefixed(rep, value);
+        entries++;
+    }
+
+public:
+    void put(std::string_view key, std::string_view value) { add(RecordType::PUT, key, value); }
+    void remove(std::string_view key) { add(RecordType::DELETION, key, std::string_view()); }
+
+    // Adds other's entries after this batch's own
+    void append(const WriteBatch& other) {
+        rep.append(other.rep);
+        entries += other.entries;
+    }
+
+    void clear() {
+        rep.clear();
+        entries = 0;
+    }
+
+    size_t count() const { return entries; }
+    bool empty() const { return entries == 0; }
+
+    // The encoded entries
+    std::string_view contents() const { return rep; }
+
+    // Calls visit(type, key, value) for each entry of encoded, in order.
+    // Returns false if encoded is malformed; entries before the bad one have
+    // been visited by then.
+    template <typename Visit>
+    static bool forEach(std::string_view encoded, Visit&& visit) {
+        const char* p = encoded.data();
+        const char* limit = p + encoded.size();
+        while (p < limit) {
+            if (!isValidRecordType(static_cast<uint8_t>(*p))) {
+                return false;
+            }
+            RecordType type = static_cast<RecordType>(*p++);
+            std::string_view key, value;
+            if (!decodeLengthPrefixed(p, limit, key) || !decodeLengthPrefixed(p, limit, value)) {
+                return false;
+            }
+            visit(type, key, value);
+        }
+        return true;
+    }
+
+    template <typename Visit>
+    void forEach(Visit&& visit) const {
+        forEach(rep, visit);
+    }
+};
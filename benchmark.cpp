@@ -0,0 +1,526 @@
+// Micro-benchmarks for the storage engine. Build with:
+//   g++ -std=c++17 -O2 benchmark.cpp -o benchmark -pthread
+// and run one of:
+//   ./benchmark contention [seconds-per-step] [max-threads] [rbtree|skiplist]
+//   ./benchmark wal [seconds-per-step] [max-writers] [per-write|group|interval|none]
+//   ./benchmark recovery [wal-megabytes] [max-threads]
+//   ./benchmark compaction [megabytes] [leveled|universal|both]
+//   ./benchmark shards [seconds-per-step] [max-shards] [writers] [per-write|group|interval|none]
+//   ./benchmark selfcheck
+//
+// selfcheck runs no benchmark: it checks the recovery and snapshot behavior
+// that is easiest to break, and exits non-zero if any check fails.
+//
+// Every run works inside a scratch directory (bench_data/) so it never touches
+// the server's own WAL and SSTables.
+
+#include "ShardedKVStore.cpp"
+#include <atomic>
+#include <filesystem>
+#include <random>
+#include <thread>
+
+namespace {
+
+const string BENCH_DIR = "bench_data";
+
+// Starts every benchmark step from an empty store directory.
+void resetBenchDir(const filesystem::path& root) {
+    filesystem::current_path(root);
+    filesystem::remove_all(BENCH_DIR);
+    filesystem::create_directories(BENCH_DIR);
+    filesystem::current_path(BENCH_DIR);
+}
+
+string benchKey(size_t i) {
+    return "key" + to_string(i);
+}
+
+// The store logs its operations; keep that out of the measurements.
+struct QuietLogs {
+    LogLevel level = Logger::instance().getLevel();
+    QuietLogs() { Logger::instance().setLevel(LogLevel::OFF); }
+    ~QuietLogs() { Logger::instance().setLevel(level); }
+};
+
+MemtableType parseMemtableType(const string& name) {
+    return name == "skiplist" ? MemtableType::SKIPLIST : MemtableType::RBTREE;
+}
+
+// Mixed read/write workload (90% getKey, 10% insertKey) over a preloaded key
+// space, repeated for 1..maxThreads threads. Reads should scale with cores;
+// writes serialize on the WAL, and on the memtable unless it is the skiplist.
+void runContention(const filesystem::path& root, double seconds, unsigned maxThreads, const KVStoreOptions& options) {
+    const size_t KEY_SPACE = 2000;
+    const string value(32, 'v');
+
+    cout << "threads,ops_per_sec,speedup" << endl;
+    double baseline = 0;
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        resetBenchDir(root);
+        atomic<bool> stop{false};
+        atomic<uint64_t> totalOps{0};
+        double elapsed;
+        {
+            QuietLogs quiet;
+            KVStore store(options);
+            for (size_t i = 0; i < KEY_SPACE; i++) {
+                store.insertKey(benchKey(i), value);
+            }
+
+            vector<thread> workers;
+            auto start = steady_clock::now();
+            for (unsigned t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    mt19937_64 rng(t + 1);
+                    uniform_int_distribution<size_t> pick(0, KEY_SPACE - 1);
+                    uint64_t ops = 0;
+                    while (!stop.load(memory_order_relaxed)) {
+                        size_t k = pick(rng);
+                        if (k % 10 == 0) {
+                            store.insertKey(benchKey(k), value);
+                        } else {
+                            store.getKey(benchKey(k));
+                        }
+                        ops++;
+                    }
+                    totalOps += ops;
+                });
+            }
+            this_thread::sleep_for(duration<double>(seconds));
+            stop = true;
+            for (auto& w : workers) {
+                w.join();
+            }
+            elapsed = duration<double>(steady_clock::now() - start).count();
+        }
+
+        double opsPerSec = totalOps / elapsed;
+        if (threads == 1) {
+            baseline = opsPerSec;
+        }
+        cout << threads << "," << static_cast<uint64_t>(opsPerSec) << "," << opsPerSec / baseline << endl;
+        if (threads < maxThreads && threads * 2 > maxThreads) {
+            threads = maxThreads / 2; // Always finish with a run at maxThreads
+        }
+    }
+}
+
+// Write-only workload with 1, 2, 4, ... maxWriters concurrent writers. In the
+// default group mode every write waits for its WAL record to be synced, so
+// throughput with one writer is bounded by fdatasync latency; with more
+// writers, group commit shares each sync across the whole batch.
+void runWALGroupCommit(const filesystem::path& root, double seconds, unsigned maxWriters, WALSyncMode syncMode) {
+    const string value(100, 'v');
+
+    cout << "writers,ops_per_sec,speedup" << endl;
+    double baseline = 0;
+    for (unsigned writers = 1; writers <= maxWriters; writers *= 2) {
+        resetBenchDir(root);
+        atomic<bool> stop{false};
+        atomic<uint64_t> totalOps{0};
+        double elapsed;
+        {
+            QuietLogs quiet;
+            KVStoreOptions options;
+            options.memtableType = MemtableType::SKIPLIST;
+            options.walSyncMode = syncMode;
+            KVStore store(options);
+
+            vector<thread> workers;
+            auto start = steady_clock::now();
+            for (unsigned t = 0; t < writers; t++) {
+                workers.emplace_back([&, t] {
+                    uint64_t ops = 0;
+                    while (!stop.load(memory_order_relaxed)) {
+                        store.insertKey("w" + to_string(t) + "-" + to_string(ops), value);
+                        ops++;
+                    }
+                    totalOps += ops;
+                });
+            }
+            this_thread::sleep_for(duration<double>(seconds));
+            stop = true;
+            for (auto& w : workers) {
+                w.join();
+            }
+            elapsed = duration<double>(steady_clock::now() - start).count();
+        }
+
+        double opsPerSec = totalOps / elapsed;
+        if (writers == 1) {
+            baseline = opsPerSec;
+        }
+        cout << writers << "," << static_cast<uint64_t>(opsPerSec) << "," << opsPerSec / baseline << endl;
+    }
+}
+
+// Startup time with a large WAL left behind, for 1, 2, 4, ... maxThreads
+// recovery threads. The WAL is written once, straight to disk as 64 MB files,
+// as if the store had crashed with that much unflushed data. Keys overwrite
+// each other, so recovery also has to keep the newest version of each.
+void runRecovery(const filesystem::path& root, size_t megabytes, unsigned maxThreads) {
+    const size_t FILE_SIZE = 64 * 1024 * 1024;
+    const size_t KEY_SPACE = 1000000;
+    const string value(100, 'v');
+
+    resetBenchDir(root);
+    filesystem::create_directories("temp");
+    size_t records = 0;
+    size_t bytes = 0;
+    mt19937_64 rng(1);
+    uniform_int_distribution<size_t> pick(0, KEY_SPACE - 1);
+    for (uint64_t number = 1; bytes < megabytes * 1024 * 1024; number++) {
+        ofstream file("temp/wal_" + to_string(number) + ".log", ios::binary);
+        string buffer = walFileHeader();
+        while (buffer.size() < FILE_SIZE && bytes + buffer.size() < megabytes * 1024 * 1024) {
+            buffer += encodeWALRecord(RecordType::PUT, ++records, benchKey(pick(rng)), value);
+        }
+        file.write(buffer.data(), buffer.size());
+        bytes += buffer.size();
+    }
+    cerr << "Wrote " << records << " records (" << bytes / (1024 * 1024) << " MB) of WAL" << endl;
+
+    cout << "threads,startup_seconds,mb_per_sec,speedup" << endl;
+    double baseline = 0;
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        double elapsed;
+        {
+            QuietLogs quiet;
+            KVStoreOptions options;
+            options.memtableType = MemtableType::SKIPLIST;
+            options.memtableThreshold = SIZE_MAX; // Keep everything in one memtable; nothing to flush on exit
+            options.recoveryThreads = threads;
+            auto start = steady_clock::now();
+            KVStore store(options);
+            elapsed = duration<double>(steady_clock::now() - start).count();
+        }
+
+        if (threads == 1) {
+            baseline = elapsed;
+        }
+        cout << threads << "," << elapsed << "," << bytes / (1024.0 * 1024.0) / elapsed << "," << baseline / elapsed << endl;
+        if (threads < maxThreads && threads * 2 > maxThreads) {
+            threads = maxThreads / 2; // Always finish with a run at maxThreads
+        }
+    }
+}
+
+// Amplification of one compaction style on an overwrite-heavy workload:
+// megabytes of random puts over a key space a quarter that size, so each key
+// is written about four times. Once compaction has settled, reports
+//  - write amplification: table bytes written per byte flushed
+//  - space amplification: table bytes on disk per byte of live key-value data
+//  - read amplification: tables whose filter a point read checks, and data
+//    blocks it reads, per lookup of an existing key
+void runCompactionStyle(const filesystem::path& root, size_t megabytes, CompactionStyle style) {
+    const string value(100, 'v');
+    const size_t ENTRY_BYTES = benchKey(0).size() + 5 + value.size(); // Typical key plus value
+    const size_t KEY_SPACE = max<size_t>(1, megabytes * 1024 * 1024 / ENTRY_BYTES / 4);
+    const size_t WRITES = KEY_SPACE * 4;
+    const size_t READS = 20000;
+
+    resetBenchDir(root);
+    double ingestSeconds;
+    KVStoreStats stats;
+    uint64_t liveBytes = 0;
+    uint64_t probed = 0;
+    uint64_t blocks = 0;
+    size_t reads = 0;
+    {
+        QuietLogs quiet;
+        KVStoreOptions options;
+        options.memtableType = MemtableType::SKIPLIST;
+        options.walSyncMode = WALSyncMode::INTERVAL;
+        options.compactionStyle = style;
+        KVStore store(options);
+
+        mt19937_64 rng(1);
+        uniform_int_distribution<size_t> pick(0, KEY_SPACE - 1);
+        vector<bool> written(KEY_SPACE);
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < WRITES; i++) {
+            size_t k = pick(rng);
+            store.insertKey(benchKey(k), value);
+            written[k] = true;
+        }
+        ingestSeconds = duration<double>(steady_clock::now() - start).count();
+        for (size_t k = 0; k < KEY_SPACE; k++) {
+            if (written[k]) {
+                liveBytes += benchKey(k).size() + value.size();
+            }
+        }
+
+        // Wait for compaction to catch up: nothing running and nothing finished
+        // for a second
+        stats = store.getStats();
+        while (true) {
+            this_thread::sleep_for(seconds(1));
+            KVStoreStats next = store.getStats();
+            bool idle = next.runningCompactions == 0 && next.compactions == stats.compactions;
+            stats = next;
+            if (idle) {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < READS; i++) {
+            size_t k = pick(rng);
+            if (written[k]) {
+                store.getKey(benchKey(k));
+                reads++;
+            }
+        }
+        KVStoreStats after = store.getStats();
+        blocks = (after.bloomHits - stats.bloomHits) + (after.bloomFalsePositives - stats.bloomFalsePositives);
+        probed = blocks + (after.bloomMisses - stats.bloomMisses);
+    }
+
+    uint64_t tableBytes = 0;
+    size_t tables = 0;
+    for (const auto& level : stats.levels) {
+        tableBytes += level.bytes;
+        tables += level.tables;
+    }
+    reads = max<size_t>(reads, 1);
+    cout << (style == CompactionStyle::UNIVERSAL ? "universal" : "leveled") << "," << megabytes / ingestSeconds << ","
+         << stats.writeAmplification << "," << static_cast<double>(tableBytes) / liveBytes << ","
+         << static_cast<double>(probed) / reads << "," << static_cast<double>(blocks) / reads << "," << tables << endl;
+}
+
+// Write-only workload from a fixed number of writers against a ShardedKVStore
+// of 1, 2, 4, ... maxShards shards. With one shard every write goes through one
+// WAL and one memtable; each added shard brings its own, so throughput should
+// grow until the writers, the cores or the disk run out.
+void runShards(const filesystem::path& root, double seconds, unsigned maxShards, unsigned writers, WALSyncMode syncMode) {
+    const string value(100, 'v');
+
+    cout << "shards,writers,ops_per_sec,speedup" << endl;
+    double baseline = 0;
+    for (unsigned shards = 1; shards <= maxShards; shards *= 2) {
+        resetBenchDir(root);
+        atomic<bool> stop{false};
+        atomic<uint64_t> totalOps{0};
+        double elapsed;
+        {
+            QuietLogs quiet;
+            ShardedKVStoreOptions options;
+            options.shards = shards;
+            options.shard.memtableType = MemtableType::SKIPLIST;
+            options.shard.walSyncMode = syncMode;
+            ShardedKVStore store(options);
+
+            vector<thread> workers;
+            auto start = steady_clock::now();
+            for (unsigned t = 0; t < writers; t++) {
+                workers.emplace_back([&, t] {
+                    uint64_t ops = 0;
+                    while (!stop.load(memory_order_relaxed)) {
+                        store.insertKey("w" + to_string(t) + "-" + to_string(ops), value);
+                        ops++;
+                    }
+                    totalOps += ops;
+                });
+            }
+            this_thread::sleep_for(duration<double>(seconds));
+            stop = true;
+            for (auto& w : workers) {
+                w.join();
+            }
+            elapsed = duration<double>(steady_clock::now() - start).count();
+        }
+
+        double opsPerSec = totalOps / elapsed;
+        if (shards == 1) {
+            baseline = opsPerSec;
+        }
+        cout << shards << "," << writers << "," << static_cast<uint64_t>(opsPerSec) << "," << opsPerSec / baseline << endl;
+        if (shards < maxShards && shards * 2 > maxShards) {
+            shards = maxShards / 2; // Always finish with a run at maxShards
+        }
+    }
+}
+
+// Waits until compaction has finished at least one job and nothing is running
+bool waitForCompaction(KVStore& store) {
+    for (int i = 0; i < 1000; i++) {
+        KVStoreStats stats = store.getStats();
+        if (stats.compactions > 0 && stats.runningCompactions == 0) {
+            return true;
+        }
+        this_thread::sleep_for(milliseconds(10));
+    }
+    return false;
+}
+
+// A snapshot taken before an overwrite still reads the old value after the
+// overwrite is flushed and compacted into the same table
+bool checkSnapshotAfterCompaction(const filesystem::path& root) {
+    resetBenchDir(root);
+    KVStoreOptions options;
+    options.memtableThreshold = 1; // A flush after every write
+    options.leveledCompaction.level0FileTrigger = 2;
+    KVStore store(options);
+    store.insertKey("key", "old");
+    const Snapshot* snapshot = store.getSnapshot();
+    store.insertKey("key", "new");
+    for (int i = 0; i < 8; i++) {
+        store.insertKey("filler" + to_string(i), "x");
+    }
+    bool compacted = waitForCompaction(store);
+
+    ReadOptions atSnapshot;
+    atSnapshot.snapshot = snapshot;
+    bool ok = compacted && store.getKey("key", atSnapshot) == "old" && store.getKey("key") == "new";
+    store.releaseSnapshot(snapshot);
+    return ok;
+}
+
+// A WAL whose last batch was cut short by a crash recovers the batches before
+// it in full and none of the torn one, and the store keeps working after
+bool checkTornBatchReplay(const filesystem::path& root) {
+    resetBenchDir(root);
+    filesystem::create_directories("temp");
+    string walPath = "temp/wal_1.log";
+    {
+        WALWriter wal(walPath);
+        WriteBatch first, torn;
+        first.put("a", "1");
+        first.put("b", "1");
+        torn.put("c", "1");
+        torn.put("d", "1");
+        uint64_t firstTicket = wal.submit(encodeWALBatch(1, first));
+        uint64_t tornTicket = wal.submit(encodeWALBatch(3, torn));
+        if (!wal.commit(firstTicket, WALSyncMode::GROUP) || !wal.commit(tornTicket, WALSyncMode::GROUP)) {
+            return false;
+        }
+    }
+    filesystem::resize_file(walPath, filesystem::file_size(walPath) - 3);
+
+    {
+        KVStore store;
+        PinnedValue value;
+        if (!store.isOpen() || store.getKey("a") != "1" || store.getKey("b") != "1" || store.getKey("c", value) ||
+            store.getKey("d", value) || !store.insertKey("e", "1")) {
+            return false;
+        }
+    }
+    KVStore reopened;
+    PinnedValue value;
+    return reopened.isOpen() && reopened.getKey("a") == "1" && reopened.getKey("e") == "1" && !reopened.getKey("c", value);
+}
+
+// Tables flushed before a close are found through the MANIFEST on every
+// reopen, with nothing left to replay from the WAL
+bool checkManifestReopen(const filesystem::path& root) {
+    const size_t KEYS = 2000;
+    resetBenchDir(root);
+    KVStoreOptions options;
+    options.memtableThreshold = 64 * 1024;
+    {
+        KVStore store(options);
+        for (size_t i = 0; i < KEYS; i++) {
+            store.insertKey(benchKey(i), string(100, 'v'));
+        }
+    }
+    for (int reopen = 0; reopen < 2; reopen++) {
+        KVStore store(options);
+        size_t tables = 0;
+        for (const auto& level : store.getStats().levels) {
+            tables += level.tables;
+        }
+        if (!store.isOpen() || tables == 0) {
+            return false;
+        }
+        for (size_t i = 0; i < KEYS; i++) {
+            PinnedValue value;
+            if (!store.getKey(benchKey(i), value) || value.view().size() != 100) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Runs every check, printing one line each. Returns false if any failed.
+bool runSelfCheck(const filesystem::path& root) {
+    QuietLogs quiet;
+    pair<const char*, bool (*)(const filesystem::path&)> checks[] = {
+        {"snapshot_after_compaction", checkSnapshotAfterCompaction},
+        {"torn_batch_replay", checkTornBatchReplay},
+        {"manifest_reopen", checkManifestReopen},
+    };
+    bool ok = true;
+    cout << "check,result" << endl;
+    for (const auto& [name, check] : checks) {
+        bool passed = check(root);
+        cout << name << "," << (passed ? "ok" : "FAILED") << endl;
+        ok = ok && passed;
+    }
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+    filesystem::path root = filesystem::current_path();
+
+    if (mode == "contention") {
+        double seconds = argc > 2 ? stod(argv[2]) : 2.0;
+        unsigned maxThreads = argc > 3 ? stoul(argv[3]) : max(1u, thread::hardware_concurrency());
+        KVStoreOptions options;
+        options.memtableType = parseMemtableType(argc > 4 ? argv[4] : "rbtree");
+        runContention(root, seconds, maxThreads, options);
+    } else if (mode == "wal") {
+        double seconds = argc > 2 ? stod(argv[2]) : 2.0;
+        unsigned maxWriters = argc > 3 ? stoul(argv[3]) : 64;
+        optional<WALSyncMode> syncMode = parseWALSyncMode(argc > 4 ? argv[4] : "group");
+        if (!syncMode) {
+            cerr << "Unknown WAL sync mode: " << argv[4] << endl;
+            return 1;
+        }
+        runWALGroupCommit(root, seconds, maxWriters, *syncMode);
+    } else if (mode == "recovery") {
+        size_t megabytes = argc > 2 ? stoul(argv[2]) : 1024;
+        unsigned maxThreads = argc > 3 ? stoul(argv[3]) : max(1u, thread::hardware_concurrency());
+        runRecovery(root, megabytes, maxThreads);
+    } else if (mode == "compaction") {
+        size_t megabytes = argc > 2 ? stoul(argv[2]) : 256;
+        string style = argc > 3 ? argv[3] : "both";
+        cout << "style,ingest_mb_per_sec,write_amp,space_amp,tables_per_read,blocks_per_read,tables" << endl;
+        if (style != "universal") {
+            runCompactionStyle(root, megabytes, CompactionStyle::LEVELED);
+        }
+        if (style != "leveled") {
+            runCompactionStyle(root, megabytes, CompactionStyle::UNIVERSAL);
+        }
+    } else if (mode == "shards") {
+        double seconds = argc > 2 ? stod(argv[2]) : 2.0;
+        unsigned maxShards = argc > 3 ? stoul(argv[3]) : max(1u, thread::hardware_concurrency());
+        unsigned writers = argc > 4 ? stoul(argv[4]) : max(maxShards, 16u);
+        optional<WALSyncMode> syncMode = parseWALSyncMode(argc > 5 ? argv[5] : "interval");
+        if (!syncMode) {
+            cerr << "Unknown WAL sync mode: " << argv[5] << endl;
+            return 1;
+        }
+        runShards(root, seconds, maxShards, writers, *syncMode);
+    } else if (mode == "selfcheck") {
+        bool ok = runSelfCheck(root);
+        filesystem::current_path(root);
+        filesystem::remove_all(BENCH_DIR);
+        return ok ? 0 : 1;
+    } else {
+        cerr << "Usage: " << argv[0] << " contention [seconds-per-step] [max-threads] [rbtree|skiplist]" << endl;
+        cerr << "       " << argv[0] << " wal [seconds-per-step] [max-writers] [per-write|group|interval|none]" << endl;
+        cerr << "       " << argv[0] << " recovery [wal-megabytes] [max-threads]" << endl;
+        cerr << "       " << argv[0] << " compaction [megabytes] [leveled|universal|both]" << endl;
+        cerr << "       " << argv[0] << " shards [seconds-per-step] [max-shards] [writers] [per-write|group|interval|none]" << endl;
+        cerr << "       " << argv[0] << " selfcheck" << endl;
+        return 1;
+    }
+
+    filesystem::current_path(root);
+    filesystem::remove_all(BENCH_DIR);
+    return 0;
+}
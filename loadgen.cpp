@@ -0,0 +1,168 @@
+// Load generator for the binary protocol front end (see BinaryProtocol.h).
+// Build with:
+//   g++ -std=c++17 -O2 loadgen.cpp -o loadgen -pthread
+// and run against a running fastKV:
+//   ./loadgen [connections] [depth] [seconds] [read-percent] [keys] [value-bytes] [host] [port]
+//
+// Each connection runs on its own thread and keeps depth requests in flight,
+// sending a new one as each response arrives. Keys are drawn uniformly from
+// keys keys, which are written once before the timed run. Prints throughput
+// and latency percentiles as CSV.
+
+#include "BinaryClient.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace chrono;
+
+struct LoadOptions {
+    unsigned connections = 4;
+    size_t depth = 128;        // Requests in flight per connection
+    double seconds = 10;
+    unsigned readPercent = 90;
+    size_t keys = 100000;
+    size_t valueBytes = 100;
+    string host = "127.0.0.1";
+    uint16_t port = 7070;
+};
+
+struct LoadResult {
+    uint64_t operations = 0;
+    uint64_t errors = 0;
+    vector<double> latenciesUs;
+};
+
+string loadKey(size_t i) {
+    char key[32];
+    snprintf(key, sizeof(key), "key%012zu", i);
+    return key;
+}
+
+// Writes keys [first, last) with every write of the range pipelined
+bool preload(BinaryClient& client, size_t first, size_t last, const string& value) {
+    for (size_t i = first; i < last; i++) {
+        client.sendPut(loadKey(i), value);
+    }
+    BinaryResponse response;
+    while (client.pending() > 0) {
+        if (!client.receive(response) || response.status != BinaryStatus::OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void runConnection(const LoadOptions& options, unsigned index, atomic<bool>& stop, LoadResult& result) {
+    BinaryClient client;
+    if (!client.connect(options.host, options.port)) {
+        cerr << "Could not connect to " << options.host << ":" << options.port << endl;
+        result.errors++;
+        return;
+    }
+    mt19937_64 rng(index + 1);
+    uniform_int_distribution<size_t> pickKey(0, options.keys - 1);
+    uniform_int_distribution<unsigned> pickOp(0, 99);
+    string value(options.valueBytes, 'v');
+    unordered_map<uint64_t, steady_clock::time_point> sentAt;
+
+    auto sendOne = [&] {
+        string key = loadKey(pickKey(rng));
+        uint64_t id = pickOp(rng) < options.readPercent ? client.sendGet(key) : client.sendPut(key, value);
+        sentAt.emplace(id, steady_clock::now());
+    };
+    for (size_t i = 0; i < options.depth; i++) {
+        sendOne();
+    }
+    BinaryResponse response;
+    while (!stop.load(memory_order_relaxed)) {
+        if (!client.receive(response)) {
+            result.errors++;
+            return;
+        }
+        auto it = sentAt.find(response.id);
+        result.latenciesUs.push_back(duration<double, micro>(steady_clock::now() - it->second).count());
+        sentAt.erase(it);
+        result.operations++;
+        if (response.status == BinaryStatus::ERROR) {
+            result.errors++;
+        }
+        sendOne();
+    }
+    // Drain what is still in flight, so the server isn't left answering a closed socket
+    while (client.pending() > 0 && client.receive(response)) {
+    }
+}
+
+double percentile(const vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+    if (argc > 1) options.connections = max(1ul, stoul(argv[1]));
+    if (argc > 2) options.depth = max(1ul, stoul(argv[2]));
+    if (argc > 3) options.seconds = stod(argv[3]);
+    if (argc > 4) options.readPercent = min(100ul, stoul(argv[4]));
+    if (argc > 5) options.keys = max(1ul, stoul(argv[5]));
+    if (argc > 6) options.valueBytes = stoul(argv[6]);
+    if (argc > 7) options.host = argv[7];
+    if (argc > 8) options.port = static_cast<uint16_t>(stoul(argv[8]));
+
+    // Load every key once, split between the connections
+    vector<thread> loaders;
+    atomic<bool> loaded{true};
+    for (unsigned i = 0; i < options.connections; i++) {
+        loaders.emplace_back([&, i] {
+            BinaryClient client;
+            size_t first = options.keys * i / options.connections;
+            size_t last = options.keys * (i + 1) / options.connections;
+            if (!client.connect(options.host, options.port) || !preload(client, first, last, string(options.valueBytes, 'v'))) {
+                loaded = false;
+            }
+        });
+    }
+    for (auto& loader : loaders) {
+        loader.join();
+    }
+    if (!loaded) {
+        cerr << "Could not load the keys into " << options.host << ":" << options.port << endl;
+        return 1;
+    }
+
+    atomic<bool> stop{false};
+    vector<LoadResult> results(options.connections);
+    vector<thread> connections;
+    auto start = steady_clock::now();
+    for (unsigned i = 0; i < options.connections; i++) {
+        connections.emplace_back(runConnection, cref(options), i, ref(stop), ref(results[i]));
+    }
+    this_thread::sleep_for(duration<double>(options.seconds));
+    stop = true;
+    for (auto& connection : connections) {
+        connection.join();
+    }
+    double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    LoadResult total;
+    for (LoadResult& result : results) {
+        total.operations += result.operations;
+        total.errors += result.errors;
+        total.latenciesUs.insert(total.latenciesUs.end(), result.latenciesUs.begin(), result.latenciesUs.end());
+    }
+    sort(total.latenciesUs.begin(), total.latenciesUs.end());
+    cout << "connections,depth,read_percent,ops_per_sec,p50_us,p99_us,p999_us,errors" << endl;
+    cout << options.connections << "," << options.depth << "," << options.readPercent << "," << static_cast<uint64_t>(total.operations / elapsed)
+         << "," << percentile(total.latenciesUs, 0.5) << "," << percentile(total.latenciesUs, 0.99) << ","
+         << percentile(total.latenciesUs, 0.999) << "," << total.errors << endl;
+    return total.errors == 0 ? 0 : 1;
+}
@@ -1,11 +1,26 @@
 #include "server.cpp"
+#include "RespServer.cpp"
+#include "BinaryServer.cpp"
 
 int main() {
-    KVStore store; // Create an instance of your KVStore
+    KVStoreOptions options;
+    // Keys are shaped "tenant:object:field"; /prefix/tenant:object: queries
+    // skip every SSTable whose prefix filter rules the prefix out
+    options.prefixExtractor = make_shared<DelimitedPrefixExtractor>(':', 2);
+    KVStore store(options); // Create an instance of your KVStore
+    if (!store.isOpen()) {
+        return 1;
+    }
+
+    // Serve Redis clients on port 6379 alongside the web server
+    thread respServer([&store] { start_resp_server(store); });
+    // and binary protocol clients on port 7070
+    thread binaryServer([&store] { start_binary_server(store); });
 
     // Start the web server and pass the KVStore instance to it
     start_web_server(store);
 
+    respServer.join();
+    binaryServer.join();
     return 0;
 }
-
@@ -3,6 +3,86 @@
 #include <chrono>
 #include <iostream>
 
+// Reads the optional 'sync' parameter (per-write, group or interval) that
+// overrides the store's WAL sync mode for one write. Returns false if the
+// parameter is present but not a known mode, or is none on a store with a WAL:
+// a write left out of the WAL could be lost behind an older one on recovery.
+bool parseWriteOptions(const httplib::Request& req, const KVStore& store, WriteOptions& writeOptions) {
+    if (!req.has_param("sync")) {
+        return true;
+    }
+    writeOptions.syncMode = parseWALSyncMode(req.get_param_value("sync"));
+    return writeOptions.syncMode.has_value() &&
+           (writeOptions.syncMode != WALSyncMode::NONE || store.getOptions().walSyncMode == WALSyncMode::NONE);
+}
+
+// Keys a /scan response sends per chunk. Each chunk is read with a fresh
+// iterator, since a memtable iterator holds the memtable's lock, so no store
+// lock is held while the client drains the socket.
+const size_t SCAN_CHUNK_KEYS = 1024;
+
+// Where a streaming /scan or /prefix response has got to
+struct ScanCursor {
+    string next;         // Smallest key not yet sent
+    string end;          // Exclusive; empty for no upper bound
+    size_t remaining = SIZE_MAX; // Keys still to send
+    ReadOptions readOptions; // Its snapshot keeps every chunk at one point in time
+};
+
+// Reads the optional 'limit' parameter into cursor; 0, like no limit at all,
+// sends every key, as KVStore::scan does. Returns false if it is present but
+// not a number.
+bool parseScanLimit(const httplib::Request& req, ScanCursor& cursor) {
+    if (!req.has_param("limit")) {
+        return true;
+    }
+    string limit = req.get_param_value("limit");
+    if (limit.empty() || limit.find_first_not_of("0123456789") != string::npos) {
+        return false;
+    }
+    cursor.remaining = stoull(limit);
+    if (cursor.remaining == 0) {
+        cursor.remaining = SIZE_MAX;
+    }
+    return true;
+}
+
+// Streams the keys cursor covers as "key\tvalue" lines, one chunk at a time.
+// Every chunk reads at a snapshot taken now, released once the response is
+// done or the client goes away.
+void streamScan(KVStore& store, httplib::Response& res, shared_ptr<ScanCursor> cursor) {
+    cursor->readOptions.snapshot = store.getSnapshot();
+    auto release = [&store, cursor](bool) {
+        store.releaseSnapshot(cursor->readOptions.snapshot);
+        cursor->readOptions.snapshot = nullptr;
+    };
+    res.set_chunked_content_provider("text/plain", [&store, cursor](size_t, httplib::DataSink& sink) {
+        size_t batch = min(cursor->remaining, SCAN_CHUNK_KEYS);
+        string chunk;
+        string lastKey;
+        size_t sent = 0;
+        auto visit = [&](string_view key, string_view value) {
+            chunk.append(key).append("\t").append(value).append("\n");
+            lastKey.assign(key.data(), key.size());
+            sent++;
+            return true;
+        };
+        if (batch > 0 && !store.scan(cursor->next, cursor->end, batch, visit, cursor->readOptions)) {
+            return false; // Aborts the response, so the client sees it is incomplete
+        }
+        if (!chunk.empty() && !sink.write(chunk.data(), chunk.size())) {
+            return false;
+        }
+        cursor->remaining -= sent;
+        if (sent < batch || cursor->remaining == 0) {
+            sink.done();
+        } else {
+            cursor->next = lastKey + '\0'; // The smallest key after lastKey
+        }
+        return true;
+    }, release);
+}
+
 // This function sets up and runs the web server.
 void start_web_server(KVStore& store) {
     httplib::Server svr;
@@ -10,13 +90,21 @@ void start_web_server(KVStore& store) {
     // Endpoint for inserting a key-value pair
     svr.Post("/insert", [&](const httplib::Request& req, httplib::Response& res) {
         auto start = chrono::high_resolution_clock::now();
-        cout << "[REQUEST] " << req.method << " " << req.path << endl;
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
 
-        if (req.has_param("key") && req.has_param("value")) {
+        WriteOptions writeOptions;
+        if (!parseWriteOptions(req, store, writeOptions)) {
+            res.status = 400;
+            res.set_content("Bad Request: 'sync' must be one of per-write, group, interval; none only on a store without a WAL.", "text/plain");
+        } else if (req.has_param("key") && req.has_param("value")) {
             string key = req.get_param_value("key");
             string value = req.get_param_value("value");
-            store.insertKey(key, value);
-            res.set_content("Key '" + key + "' inserted.", "text/plain");
+            if (store.insertKey(key, value, writeOptions)) {
+                res.set_content("Key '" + key + "' inserted.", "text/plain");
+            } else {
+                res.status = 500;
+                res.set_content("Could not write to the WAL.", "text/plain");
+            }
         } else {
             res.status = 400;
             res.set_content("Bad Request: 'key' and 'value' parameters are required.", "text/plain");
@@ -24,40 +112,239 @@ void start_web_server(KVStore& store) {
 
         auto end = chrono::high_resolution_clock::now();
         chrono::duration<double, milli> duration = end - start;
-        cout << "[RESPONSE] " << req.method << " " << req.path << " - Status: " << res.status << " - Duration: " << duration.count() << " ms" << endl;
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status, "ms", duration.count());
     });
 
     // Endpoint for retrieving a value by key
     svr.Get(R"(/get/(.+))", [&](const httplib::Request& req, httplib::Response& res) {
         auto start = chrono::high_resolution_clock::now();
-        cout << "[REQUEST] " << req.method << " " << req.path << endl;
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
 
         string key = req.matches[1];
-        string value = store.getKey(key);
-        if (value == "Key not found.") {
+        auto value = make_shared<PinnedValue>();
+        if (store.getKey(key, *value)) {
+            // Write the value to the socket straight from where the store holds
+            // it; the provider keeps it pinned until the response is sent
+            res.set_content_provider(value->size(), "text/plain", [value](size_t offset, size_t length, httplib::DataSink& sink) {
+                return sink.write(value->data() + offset, length);
+            });
+        } else {
             res.status = 404;
+            res.set_content("Key not found.", "text/plain");
         }
-        res.set_content(value, "text/plain");
 
         auto end = chrono::high_resolution_clock::now();
         chrono::duration<double, milli> duration = end - start;
-        cout << "[RESPONSE] " << req.method << " " << req.path << " - Status: " << res.status << " - Duration: " << duration.count() << " ms" << endl;
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status, "ms", duration.count());
+    });
+
+    // Endpoint for retrieving many keys at once. The body holds one key per
+    // line; the response has one "key\tvalue" line per key found, in request
+    // order, written straight from the store's pinned values.
+    svr.Post("/mget", [&](const httplib::Request& req, httplib::Response& res) {
+        auto start = chrono::high_resolution_clock::now();
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
+
+        vector<string> keys;
+        istringstream lines(req.body);
+        for (string line; getline(lines, line);) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                keys.push_back(move(line));
+            }
+        }
+        auto found = make_shared<vector<pair<string, PinnedValue>>>();
+        vector<optional<PinnedValue>> values = store.multiGet(keys);
+        size_t length = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (values[i]) {
+                length += keys[i].size() + values[i]->size() + 2;
+                found->emplace_back(move(keys[i]), move(*values[i]));
+            }
+        }
+        res.set_content_provider(length, "text/plain", [found](size_t offset, size_t, httplib::DataSink& sink) {
+            // Skip what was already sent, then write the rest piece by piece
+            for (const auto& [key, value] : *found) {
+                for (string_view piece : {string_view(key), string_view("\t"), value.view(), string_view("\n")}) {
+                    if (offset >= piece.size()) {
+                        offset -= piece.size();
+                        continue;
+                    }
+                    if (!sink.write(piece.data() + offset, piece.size() - offset)) {
+                        return false;
+                    }
+                    offset = 0;
+                }
+            }
+            return true;
+        });
+
+        auto end = chrono::high_resolution_clock::now();
+        chrono::duration<double, milli> duration = end - start;
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status, "keys", keys.size(), "found", found->size(),
+                 "ms", duration.count());
     });
 
     // Endpoint for deleting a key
     svr.Delete(R"(/delete/(.+))", [&](const httplib::Request& req, httplib::Response& res) {
         auto start = chrono::high_resolution_clock::now();
-        cout << "[REQUEST] " << req.method << " " << req.path << endl;
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
 
         string key = req.matches[1];
-        store.deleteKey(key);
-        res.set_content("Key '" + key + "' deleted.", "text/plain");
+        WriteOptions writeOptions;
+        if (!parseWriteOptions(req, store, writeOptions)) {
+            res.status = 400;
+            res.set_content("Bad Request: 'sync' must be one of per-write, group, interval; none only on a store without a WAL.", "text/plain");
+        } else if (!store.deleteKey(key, writeOptions)) {
+            res.status = 500;
+            res.set_content("Could not write to the WAL.", "text/plain");
+        } else {
+            res.set_content("Key '" + key + "' deleted.", "text/plain");
+        }
+
+        auto end = chrono::high_resolution_clock::now();
+        chrono::duration<double, milli> duration = end - start;
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status, "ms", duration.count());
+    });
+
+    // Endpoint for applying many writes atomically. The body holds one write per
+    // line, "put\tkey\tvalue" or "delete\tkey"; if any line is malformed,
+    // nothing is written.
+    svr.Post("/batch", [&](const httplib::Request& req, httplib::Response& res) {
+        auto start = chrono::high_resolution_clock::now();
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
+
+        WriteOptions writeOptions;
+        WriteBatch batch;
+        string error;
+        istringstream lines(req.body);
+        size_t lineNumber = 0;
+        for (string line; error.empty() && getline(lines, line);) {
+            lineNumber++;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty()) {
+                continue;
+            }
+            string_view fields(line);
+            size_t keyStart = fields.find('\t');
+            size_t valueStart = keyStart == string::npos ? string::npos : fields.find('\t', keyStart + 1);
+            string_view op = fields.substr(0, keyStart);
+            if (op == "put" && valueStart != string::npos) {
+                batch.put(fields.substr(keyStart + 1, valueStart - keyStart - 1), fields.substr(valueStart + 1));
+            } else if (op == "delete" && keyStart != string::npos && valueStart == string::npos) {
+                batch.remove(fields.substr(keyStart + 1));
+            } else {
+                error = "Bad Request: line " + to_string(lineNumber) + " must be 'put\\tkey\\tvalue' or 'delete\\tkey'.";
+            }
+        }
+        if (!parseWriteOptions(req, store, writeOptions)) {
+            res.status = 400;
+            res.set_content("Bad Request: 'sync' must be one of per-write, group, interval; none only on a store without a WAL.", "text/plain");
+        } else if (!error.empty()) {
+            res.status = 400;
+            res.set_content(error, "text/plain");
+        } else if (!store.write(batch, writeOptions)) {
+            res.status = 500;
+            res.set_content("Could not write to the WAL.", "text/plain");
+        } else {
+            res.set_content("Batch of " + to_string(batch.count()) + " writes applied.", "text/plain");
+        }
 
         auto end = chrono::high_resolution_clock::now();
         chrono::duration<double, milli> duration = end - start;
-        cout << "[RESPONSE] " << req.method << " " << req.path << " - Status: " << res.status << " - Duration: " << duration.count() << " ms" << endl;
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status, "writes", batch.count(), "ms", duration.count());
+    });
+
+    // Endpoint for the live keys in [start, end), one "key\tvalue" per line in
+    // key order, streamed in chunks
+    svr.Get("/scan", [&](const httplib::Request& req, httplib::Response& res) {
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
+
+        auto cursor = make_shared<ScanCursor>();
+        cursor->next = req.get_param_value("start");
+        cursor->end = req.get_param_value("end");
+        if (!parseScanLimit(req, *cursor)) {
+            res.status = 400;
+            res.set_content("Bad Request: 'limit' must be a number.", "text/plain");
+        } else {
+            streamScan(store, res, cursor);
+        }
+
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status);
+    });
+
+    // Endpoint for the live keys starting with a prefix, streamed like /scan.
+    // Only prefixes the store's extractor produces exactly are accepted, so
+    // SSTables whose prefix filter rules the prefix out are never read; other
+    // ranges go through /scan.
+    svr.Get(R"(/prefix/(.+))", [&](const httplib::Request& req, httplib::Response& res) {
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
+
+        auto cursor = make_shared<ScanCursor>();
+        cursor->readOptions.prefix = req.matches[1];
+        cursor->next = cursor->readOptions.prefix;
+        const PrefixExtractor* extractor = store.getOptions().prefixExtractor.get();
+        if (!extractor || !extractor->isFullPrefix(cursor->readOptions.prefix)) {
+            res.status = 400;
+            res.set_content("Bad Request: the prefix must be a whole prefix as the store groups keys (" +
+                                (extractor ? extractor->name() : string("none configured")) + "); use /scan for other ranges.",
+                            "text/plain");
+        } else if (!parseScanLimit(req, *cursor)) {
+            res.status = 400;
+            res.set_content("Bad Request: 'limit' must be a number.", "text/plain");
+        } else {
+            streamScan(store, res, cursor);
+        }
+
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status);
+    });
+
+    // Endpoint for the store's internal counters, one "name: value" per line
+    svr.Get("/stats", [&](const httplib::Request& req, httplib::Response& res) {
+        LOG_DEBUG("Request", "method", req.method, "path", req.path);
+
+        KVStoreStats stats = store.getStats();
+        uint64_t absent = stats.bloomFalsePositives + stats.bloomMisses;
+        stringstream body;
+        body << "bloom.hits: " << stats.bloomHits << "\n";
+        body << "bloom.misses: " << stats.bloomMisses << "\n";
+        body << "bloom.false_positives: " << stats.bloomFalsePositives << "\n";
+        body << "bloom.false_positive_rate: " << (absent == 0 ? 0.0 : static_cast<double>(stats.bloomFalsePositives) / absent) << "\n";
+        body << "prefix_bloom.hits: " << stats.prefixBloomHits << "\n";
+        body << "prefix_bloom.misses: " << stats.prefixBloomMisses << "\n";
+        body << "compaction.count: " << stats.compactions << "\n";
+        body << "compaction.running: " << stats.runningCompactions << "\n";
+        body << "compaction.bytes_read: " << stats.compactionBytesRead << "\n";
+        body << "compaction.bytes_written: " << stats.compactionBytesWritten << "\n";
+        body << "flush.bytes_written: " << stats.flushBytesWritten << "\n";
+        body << "write_amplification: " << stats.writeAmplification << "\n";
+        uint64_t cacheLookups = stats.blockCache.hits + stats.blockCache.misses;
+        body << "block_cache.hits: " << stats.blockCache.hits << "\n";
+        body << "block_cache.misses: " << stats.blockCache.misses << "\n";
+        body << "block_cache.hit_ratio: " << (cacheLookups == 0 ? 0.0 : static_cast<double>(stats.blockCache.hits) / cacheLookups) << "\n";
+        body << "block_cache.inserts: " << stats.blockCache.inserts << "\n";
+        body << "block_cache.evictions: " << stats.blockCache.evictions << "\n";
+        body << "block_cache.usage_bytes: " << stats.blockCache.usage << "\n";
+        body << "block_cache.capacity_bytes: " << stats.blockCache.capacity << "\n";
+        body << "table_cache.hits: " << stats.tableCache.hits << "\n";
+        body << "table_cache.misses: " << stats.tableCache.misses << "\n";
+        body << "table_cache.evictions: " << stats.tableCache.evictions << "\n";
+        body << "table_cache.open_tables: " << stats.tableCache.usage << "\n";
+        body << "table_cache.capacity: " << stats.tableCache.capacity << "\n";
+        for (size_t level = 0; level < stats.levels.size(); level++) {
+            body << "level." << level << ".tables: " << stats.levels[level].tables << "\n";
+            body << "level." << level << ".bytes: " << stats.levels[level].bytes << "\n";
+            body << "level." << level << ".score: " << stats.levels[level].score << "\n";
+        }
+        res.set_content(body.str(), "text/plain");
+
+        LOG_INFO("Response", "method", req.method, "path", req.path, "status", res.status);
     });
 
-    cout << "[INFO] Starting web server on http://localhost:8080" << endl;
+    LOG_INFO("Starting web server", "url", "http://localhost:8080");
     svr.listen("localhost", 8080);
 }